@@ -1,228 +1,503 @@
 #include "lib/Y86.h"
 #include "lib/list.h"
+#include "lib/object.h"
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define error(message, syntax, value)			\
+#define error(message, syntax, ...)			\
 	fprintf(stderr, "Error: %s: %s - "syntax"\n",	\
-			__func__, message, value)
+			__func__, message, __VA_ARGS__)
+
+/*
+ * Errors of a line on its own.  A worker assembling a chunk of the
+ * source gives up silently instead, and the source is assembled again
+ * serially to report them in order.
+ */
+static __thread jmp_buf *bail;
+
+#define fail(message, syntax, ...)				\
+	do {							\
+		if (bail != NULL)				\
+			longjmp(*bail, 1);			\
+		error(message, syntax, __VA_ARGS__);		\
+		exit(EXIT_FAILURE);				\
+	} while (0)
+
+#define max(x, y) ((x) < (y) ? (y) : (x))
+#define min(x, y) ((x) < (y) ? (x) : (y))
+
+/* a field of a line, in place in the source */
+struct token {
+	const char *str;
+	size_t len;
+};
+
+#define TOKEN_FMT "%.*s"
+#define TOKEN_ARG(tok) (int)(tok).len, (tok).str
+
+/* return whether @tok is the string @str */
+static int token_is(struct token tok, const char *str)
+{
+	return strlen(str) == tok.len && memcmp(tok.str, str, tok.len) == 0;
+}
+
+/* return whether @a and @b are the same string */
+static int token_eq(struct token a, struct token b)
+{
+	return a.len == b.len && memcmp(a.str, b.str, a.len) == 0;
+}
+
+/*
+ * The binary grows as it is assembled, and is written out once all
+ * the symbols are known.
+ */
+static byte *binary;
+static size_t bin_cap;
+static val_t bin_size;
+
+/**
+ * reserve(offset, len)
+ *
+ * @offset: where bytes are about to be emitted.
+ * @len: how many.
+ *
+ * make room for them in the binary, return a pointer to them.
+ */
+static byte *reserve(val_t offset, val_t len)
+{
+	size_t end = (size_t)offset + len, cap = bin_cap;
+
+	if (end > (val_t)-1) {
+		error("binary beyond the address space", "0x%x", offset);
+		exit(EXIT_FAILURE);
+	}
+	if (end > cap) {
+		cap = max(max(2 * cap, end), 4096);
+		if ((binary = realloc(binary, cap)) == NULL) {
+			error("out of memory", "%zu", cap);
+			exit(EXIT_FAILURE);
+		}
+		memset(binary + bin_cap, 0, cap - bin_cap);
+		bin_cap = cap;
+	}
+	return binary + offset;
+}
 
 static LIST_HEAD(symbol_head);		/* head of symbol list */
 
+/*
+ * Symbols, their names and the patches waiting for their values are
+ * allocated from an arena and never freed one by one: the assembler
+ * exits when it is done with them.
+ */
+#define ARENA_CHUNK (64 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t used, size;
+	char data[];
+};
+
+static struct arena_chunk *arena;
+
+/**
+ * arena_alloc(size)
+ *
+ * @size: bytes to allocate.
+ *
+ * return @size bytes aligned for any type, taken from the arena.
+ */
+static void *arena_alloc(size_t size)
+{
+	struct arena_chunk *chunk;
+	size_t align = sizeof(long long) - 1;
+	void *ptr;
+
+	size = (size + align) & ~align;
+	if (arena == NULL || arena->size - arena->used < size) {
+		chunk = malloc(sizeof(*chunk) + max(size, ARENA_CHUNK));
+		if (chunk == NULL) {
+			error("out of memory", "%zu", size);
+			exit(EXIT_FAILURE);
+		}
+		chunk->used = 0;
+		chunk->size = max(size, ARENA_CHUNK);
+		chunk->next = arena;
+		arena = chunk;
+	}
+	ptr = arena->data + arena->used;
+	arena->used += size;
+	return ptr;
+}
+
 struct valp_entry {
-	val_t *valp;
-	struct list_head valp_list;	/* valp list node */
+	val_t offset;			/* in the binary of the value */
+	unsigned int lineno;		/* of the reference */
+	unsigned int section;		/* of the reference, in an object */
+	struct symbol_entry *sptr;	/* symbol referenced */
+	struct valp_entry *next;	/* next patch of the symbol */
 };
 
 struct symbol_entry {
-	char *symbol;
+	size_t len;
 	int valid;
 	val_t value;
+	unsigned int section;		/* of the value, in an object */
 	struct list_head symbol_list;	/* symbol list node */
-	struct list_head valp_head;	/* head of valp list of the symbol */
+	struct valp_entry *valp_head;	/* patches waiting for the value */
+	char symbol[];			/* interned, NUL terminated */
 };
 
-/**
- * add_valp(valp)
- *
- * @valp: a pointer to where the value should be stored.
- * @valp_headp: a pointer to the head of the valp lint.
- * 
- * add the valp to the valp list.
+/*
+ * Open addressing on str_hash(), at most half full.  Slots keep the
+ * hash so that probing seldom looks at the entries.
+ */
+struct symbol_slot {
+	unsigned int hash;
+	struct symbol_entry *sptr;
+};
+
+static struct symbol_slot *symbol_table;
+static unsigned int nr_symbols, symbol_table_size;
+
+/* line being assembled, for the patches */
+static unsigned int cur_lineno;
+
+/*
+ * With -c the source is assembled into a relocatable object instead,
+ * see lib/object.h: every .pos starts a section, and the values of
+ * symbols are left to the linker, with the patches as relocations.
  */
-static void add_valp(val_t *valp, struct list_head *valp_headp)
+static int relocatable;
+static struct obj_section *sections;
+static unsigned int nr_sections, sections_cap;
+
+/* where a line of the source went, for the map and the listing */
+struct src_line {
+	unsigned int lineno;
+	const char *text;	/* in the source, without the newline */
+	size_t text_len;
+	val_t addr;		/* of its bytes, or where they would go */
+	val_t len;		/* bytes emitted */
+	byte code;		/* has a label, directive or instruction */
+	byte pos;		/* is a .pos */
+};
+
+static unsigned int symbol_hash(struct token symbol)
 {
-	struct valp_entry *iptr = malloc(sizeof(*iptr));
+	return str_hash(symbol.str, symbol.len, 2166136261U);
+}
 
-	iptr->valp = valp;
+static struct symbol_slot *symbol_slot(const char *symbol, size_t len,
+				       unsigned int hash)
+{
+	unsigned int mask = symbol_table_size - 1, i = hash & mask;
+	struct symbol_slot *slot;
 
-	INIT_LIST_HEAD(&iptr->valp_list);
-	list_add(&iptr->valp_list, valp_headp);
+	for (; (slot = &symbol_table[i])->sptr != NULL; i = (i + 1) & mask)
+		if (slot->hash == hash && slot->sptr->len == len
+		    && memcmp(slot->sptr->symbol, symbol, len) == 0)
+			break;
+	return slot;
 }
 
 /**
- * add_symbol(symbol)
+ * find_symbol(symbol, hash)
  *
- * @symbol: a string, name of the symbol (without trailing ':')
+ * @symbol: name of the symbol (without trailing ':')
+ * @hash: symbol_hash() of it.
  *
- * add the symbol to the symbol list @symbol_head,
- * with an unassigned value and an empty valp list.
+ * return the entry of the symbol, adding it to the symbol table and
+ * to the symbol list @symbol_head with an unassigned value and no
+ * patches if it is new.
  */
-static struct symbol_entry *add_symbol(const char *symbol)
+static struct symbol_entry *find_symbol(struct token symbol,
+					unsigned int hash)
 {
-	struct symbol_entry *sptr = malloc(sizeof(*sptr));
+	unsigned int i, old_size;
+	struct symbol_slot *slot, *old;
+	struct symbol_entry *sptr;
 
-	sptr->symbol = strdup(symbol);
-	sptr->valid = 0;
-	INIT_LIST_HEAD(&sptr->valp_head);
+	if (2 * (nr_symbols + 1) > symbol_table_size) {
+		old = symbol_table;
+		old_size = symbol_table_size;
+		symbol_table_size = old_size ? 2 * old_size : 1024;
+		symbol_table = calloc(symbol_table_size, sizeof(*symbol_table));
+		if (symbol_table == NULL) {
+			error("out of memory", TOKEN_FMT, TOKEN_ARG(symbol));
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < old_size; i++)
+			if (old[i].sptr != NULL)
+				*symbol_slot(old[i].sptr->symbol,
+					     old[i].sptr->len,
+					     old[i].hash) = old[i];
+		free(old);
+	}
 
-	INIT_LIST_HEAD(&sptr->symbol_list);
-	list_add(&sptr->symbol_list, &symbol_head);
-	return sptr;
+	slot = symbol_slot(symbol.str, symbol.len, hash);
+	if (slot->sptr != NULL)
+		return slot->sptr;
+
+	sptr = arena_alloc(sizeof(*sptr) + symbol.len + 1);
+	memcpy(sptr->symbol, symbol.str, symbol.len);
+	sptr->symbol[symbol.len] = '\0';
+	sptr->len = symbol.len;
+	sptr->valid = 0;
+	sptr->valp_head = NULL;
+	list_add_tail(&sptr->symbol_list, &symbol_head);
+	nr_symbols++;
+	slot->hash = hash;
+	return slot->sptr = sptr;
 }
 
 /**
- * assign_value(symbol, value)
+ * assign_value(symbol, hash, value)
  *
- * @symbol: a string, name of the symbol (without trailing ':').
+ * @symbol: name of the symbol (without trailing ':').
+ * @hash: symbol_hash() of it.
  * @value: a number assigned to that symbol.
  *
  * assign the symbol with the value,
  * for each valp in valp list of the symbol,
- * fill *valp with the value.
+ * fill the value at its offset with the value.
  */
-static void assign_value(const char *symbol, val_t value)
+static void assign_value(struct token symbol, unsigned int hash, val_t value)
 {
-	struct symbol_entry *sptr;
-	struct valp_entry *iptr, *itmp;
-
-	list_for_each_entry(sptr, &symbol_head, symbol_list)
-		if (strcmp(sptr->symbol, symbol) == 0)
-			break;
-
-	if (&sptr->symbol_list == &symbol_head)
-		sptr = add_symbol(symbol);
+	struct symbol_entry *sptr = find_symbol(symbol, hash);
+	struct valp_entry *iptr;
 
 	if (sptr->valid == 1) {
-		error("symbol already assigned with a value", "%s", symbol);
+		error("symbol already assigned with a value",
+		      TOKEN_FMT, TOKEN_ARG(symbol));
 		exit(EXIT_FAILURE);
 	}
 
 	sptr->valid = 1;
 	sptr->value = value;
+	sptr->section = nr_sections - 1;
+	if (relocatable)
+		return;
 
-	list_for_each_entry_safe(iptr, itmp, &sptr->valp_head, valp_list) {
-		*iptr->valp = value;
-		free(iptr);
-	}
+	for (iptr = sptr->valp_head; iptr != NULL; iptr = iptr->next)
+		*(val_t *)(binary + iptr->offset) = value;
+	sptr->valp_head = NULL;
 }
 
 /**
  * lookup_symbol(symbol, valp)
  *
- * @symbol: a string, name of the symbol.
- * @valp: a pointer to where the value should be stored.
+ * @symbol: name of the symbol.
+ * @valp: a pointer to where the value should be stored, in the binary.
  *
  * fill *valp with the value of the symbol.
  * if the symbol haven't been assigned with a value yet,
- * store valp in the valp list of the symbol,
+ * store the offset of valp in the valp list of the symbol,
  * which will be filled when a value is assigned to the symbol.
+ * In an object the value is always left to the linker.
  */
-static void lookup_symbol(const char *symbol, val_t *valp)
+static void lookup_symbol(struct token symbol, val_t *valp)
+{
+	struct symbol_entry *sptr = find_symbol(symbol, symbol_hash(symbol));
+	struct valp_entry *iptr;
+
+	if (sptr->valid && !relocatable) {
+		*valp = sptr->value;
+	} else {
+		iptr = arena_alloc(sizeof(*iptr));
+		iptr->offset = (byte *)valp - binary;
+		iptr->lineno = cur_lineno;
+		iptr->section = nr_sections - 1;
+		iptr->sptr = sptr;
+		iptr->next = sptr->valp_head;
+		sptr->valp_head = iptr;
+	}
+}
+
+static void report_undefined(unsigned int lineno, struct token symbol)
+{
+	fprintf(stderr, "Error: line %u: undefined symbol - "TOKEN_FMT"\n",
+		lineno, TOKEN_ARG(symbol));
+}
+
+static int valp_cmp(const void *a, const void *b)
+{
+	const struct valp_entry *x = *(const struct valp_entry **)a;
+	const struct valp_entry *y = *(const struct valp_entry **)b;
+
+	return x->lineno < y->lineno ? -1 : x->lineno > y->lineno;
+}
+
+/**
+ * check_symbols()
+ *
+ * report every reference to a symbol that was never assigned a value,
+ * in line order, return the number of them.
+ */
+static unsigned int check_symbols(void)
 {
 	struct symbol_entry *sptr;
+	struct valp_entry *iptr, **refs = NULL;
+	unsigned int i, n = 0, size = 0;
 
 	list_for_each_entry(sptr, &symbol_head, symbol_list)
-		if (strcmp(sptr->symbol, symbol) == 0)
-			break;
-
-	if (&sptr->symbol_list == &symbol_head)
-		sptr = add_symbol(symbol);
+		for (iptr = sptr->valp_head; iptr != NULL; iptr = iptr->next) {
+			if (n == size) {
+				size = size ? 2 * size : 64;
+				refs = realloc(refs, size * sizeof(*refs));
+				if (refs == NULL) {
+					error("out of memory", "%u", size);
+					exit(EXIT_FAILURE);
+				}
+			}
+			refs[n++] = iptr;
+		}
+	qsort(refs, n, sizeof(*refs), valp_cmp);
+	for (i = 0; i < n; i++)
+		report_undefined(refs[i]->lineno,
+				 (struct token){ refs[i]->sptr->symbol,
+						 refs[i]->sptr->len });
+	free(refs);
+	return n;
+}
 
-	if (sptr->valid) {
-		*valp = sptr->value;
-	} else {
-		add_valp(valp, &sptr->valp_head);
+static val_t scan_number(const char *str, const char *end, unsigned int base)
+{
+	val_t val = 0, sign = 1;
+	int digit;
+
+	if (str < end && (*str == '-' || *str == '+'))
+		sign = *str++ == '-' ? -1 : 1;
+	if (base == 16 && end - str > 2 && str[0] == '0'
+	    && tolower(str[1]) == 'x' && isxdigit(str[2]))
+		str += 2;
+	for (; str < end; str++) {
+		if (isdigit(*str))
+			digit = *str - '0';
+		else if (base == 16 && isxdigit(*str))
+			digit = tolower(*str) - 'a' + 10;
+		else
+			break;
+		val = val * base + digit;
 	}
+	return val * sign;
 }
 
-static val_t parse_number(const char *str)
+/**
+ * parse_number(tok)
+ *
+ * return the value of @tok read as a decimal, or as hexadecimal if
+ * that is 0, the way sscanf() reads "%d" and "%x": "15", "-1" and
+ * "0x1f" are 15, -1 and 31.
+ */
+static val_t parse_number(struct token tok)
 {
-	val_t dec, hex;
+	val_t dec;
 
-	if (str[0] == '\0')
+	if (tok.len == 0)
 		return 0;
 
-	sscanf(str, "%d", &dec);
-	sscanf(str, "%x", &hex);
+	dec = scan_number(tok.str, tok.str + tok.len, 10);
 
-	return dec == 0 ? hex : dec;
+	return dec == 0 ? scan_number(tok.str, tok.str + tok.len, 16) : dec;
 }
 
-static void fill_constant(const char *str, val_t *valp)
+/* a constant, or the symbol it is the value of in *@refp */
+static void fill_constant(struct token tok, val_t *valp, struct token *refp)
 {
-	if (str[0] == '\0')
+	if (tok.len == 0)
 		*valp = 0;
-	else if (str[0] == '$')
-		*valp = parse_number(str + 1);
-	else if (isdigit(str[0]) || str[0] == '-' || str[0] == '+')
-		*valp = parse_number(str);
+	else if (tok.str[0] == '$')
+		*valp = parse_number((struct token){ tok.str + 1, tok.len - 1 });
+	else if (isdigit(tok.str[0]) || tok.str[0] == '-' || tok.str[0] == '+')
+		*valp = parse_number(tok);
 	else
-		lookup_symbol(str, valp);
+		*refp = tok;
 }
 
-static regid_t parse_memory(char *str, val_t *valp)
+static regid_t parse_reg(struct token tok)
 {
-	char *x, *y;
-	regid_t regid;
-
-	x = strchr(str, '(');
-	y = strrchr(str, ')');
+	return parse_regid_n(tok.str, tok.len);
+}
 
-	if (*x == '\0' || *y == '\0' || x > y
-			|| x[1] != '%' || y[1] != '\0') {
-		error("wrong memory access syntax", "%s", str);
-		exit(EXIT_FAILURE);
-	}
+static regid_t parse_memory(struct token tok, val_t *valp)
+{
+	const char *x, *y;
 
-	*x = '\0';
-	*y = '\0';
+	x = memchr(tok.str, '(', tok.len);
+	for (y = tok.str + tok.len; y > tok.str && y[-1] != ')'; y--)
+		;
 
-	*valp = parse_number(str);
-	regid = parse_regid(x + 1);
+	if (x == NULL || y == tok.str || x >= --y
+			|| x[1] != '%' || y != tok.str + tok.len - 1)
+		fail("wrong memory access syntax", TOKEN_FMT, TOKEN_ARG(tok));
 
-	*x = '(';
-	*y = ')';
+	*valp = parse_number((struct token){ tok.str, x - tok.str });
 
-	return regid;
+	return parse_regid_n(x + 1, y - x - 1);
 }
 
 /**
- * fill__(args, regp, valp)
+ * fill__(args, regp, valp, refp)
  *
  *  _i: instruction
  *  _r: register
  *  _v: constant
  *  _m: memory
  *
- * fill *regp and *valp according to args.
+ * fill *regp and *valp according to args, and *refp with the symbol
+ * of the constant if it is one.
  */
-static void fill_i(char **args, reg_t *regp, val_t *valp)
+static void fill_i(struct token *args, reg_t *regp, val_t *valp,
+		   struct token *refp)
 {
 	return;
 }
 
-static void fill_i_r_r(char **args, reg_t *regp, val_t *valp)
+static void fill_i_r_r(struct token *args, reg_t *regp, val_t *valp,
+		       struct token *refp)
 {
-	*regp = pack_reg(parse_regid(args[1]), parse_regid(args[2]));
+	*regp = pack_reg(parse_reg(args[1]), parse_reg(args[2]));
 }
 
-static void fill_i_v_r(char **args, reg_t *regp, val_t *valp)
+static void fill_i_v_r(struct token *args, reg_t *regp, val_t *valp,
+		       struct token *refp)
 {
-	fill_constant(args[1], valp);
-	*regp = pack_reg(R_NONE, parse_regid(args[2]));
+	fill_constant(args[1], valp, refp);
+	*regp = pack_reg(R_NONE, parse_reg(args[2]));
 }
 
-static void fill_i_r_m(char **args, reg_t *regp, val_t *valp)
+static void fill_i_r_m(struct token *args, reg_t *regp, val_t *valp,
+		       struct token *refp)
 {
-	*regp = pack_reg(parse_regid(args[1]), parse_memory(args[2], valp));
+	*regp = pack_reg(parse_reg(args[1]), parse_memory(args[2], valp));
 }
 
-static void fill_i_m_r(char **args, reg_t *regp, val_t *valp)
+static void fill_i_m_r(struct token *args, reg_t *regp, val_t *valp,
+		       struct token *refp)
 {
-	*regp = pack_reg(parse_regid(args[2]), parse_memory(args[1], valp));
+	*regp = pack_reg(parse_reg(args[2]), parse_memory(args[1], valp));
 }
 
-static void fill_i_v(char **args, reg_t *regp, val_t *valp)
+static void fill_i_v(struct token *args, reg_t *regp, val_t *valp,
+		     struct token *refp)
 {
-	fill_constant(args[1], valp);
+	fill_constant(args[1], valp, refp);
 }
 
-static void fill_i_r(char **args, reg_t *regp, val_t *valp)
+static void fill_i_r(struct token *args, reg_t *regp, val_t *valp,
+		     struct token *refp)
 {
-	*regp = pack_reg(parse_regid(args[1]), R_NONE);
+	*regp = pack_reg(parse_reg(args[1]), R_NONE);
 }
 
 /**
@@ -249,14 +524,15 @@ static int icode_argn(icode_t icode)
 	case I_RMMOVL:
 	case I_MRMOVL:
 	case I_OPL:
+	case I_XCHGL:
 		return 3;
 	default:
-		error("unknown icode", "%d", icode);
-		exit(EXIT_FAILURE);
+		fail("unknown icode", "%d", icode);
 	}
 }
 
-static void (*icode_filler[])(char **, reg_t *, val_t *) = {
+static void (*icode_filler[])(struct token *, reg_t *, val_t *,
+			      struct token *) = {
 	fill_i,		/* 0 halt */
 	fill_i,		/* 1 nop */
 	fill_i_r_r,	/* 2 rrmovl */
@@ -269,158 +545,1352 @@ static void (*icode_filler[])(char **, reg_t *, val_t *) = {
 	fill_i,		/* 9 ret */
 	fill_i_r,	/* A pushl */
 	fill_i_r,	/* B popl */
+	fill_i_r_m,	/* C xchgl */
+};
+
+enum code_kind {
+	CODE_NONE,		/* nothing, or only a label */
+	CODE_BYTES,		/* .long or an instruction */
+	CODE_POS,
+	CODE_ALIGN,
 };
 
-static val_t assembler(char **args, byte *base)
+#define MAX_CODE_LEN (sizeof(ins_t) + sizeof(reg_t) + sizeof(val_t))
+
+/* a line assembled on its own, before it has an address */
+struct code {
+	byte kind;		/* enum code_kind */
+	byte len;		/* of buf */
+	byte ins;		/* is an instruction */
+	byte val_at;		/* offset of the constant in buf */
+	byte buf[MAX_CODE_LEN];
+	val_t arg;		/* of .pos and .align */
+	struct token ref;	/* symbol of the constant, len 0 if none */
+};
+
+/**
+ * take_label(args, argn, label)
+ *
+ * if the fields of a line start with a label, store it without the
+ * ':' in *@label and drop it from *@args.  Return the fields left.
+ */
+static unsigned int take_label(struct token **args, unsigned int argn,
+			       struct token *label)
+{
+	struct token *first = &(*args)[0];
+
+	label->len = 0;
+	if (argn == 0 || first->str[first->len - 1] != ':')
+		return argn;
+	*label = (struct token){ first->str, first->len - 1 };
+	(*args)++;
+	return argn - 1;
+}
+
+/**
+ * assembler(args, argn, c)
+ *
+ * @args: the fields of a line, without its label.
+ * @argn: how many fields there are.
+ * @c: filled with the line assembled on its own.
+ *
+ * encode a directive or an instruction.  Its address is not needed:
+ * a constant that is a symbol is left 0, and the symbol in @c->ref.
+ */
+static void assembler(struct token *args, unsigned int argn, struct code *c)
 {
-	static val_t s_offset = 0;	/* at the start of next instruction */
-	static val_t e_offset = 0;	/* after the end of last instruction */
-	byte *pos = base + s_offset;
+	byte *pos = c->buf;
 	ins_t ins;
 	icode_t icode;
-	ins_t *insp = NULL;
 	reg_t *regp = NULL;
 	val_t *valp = NULL;
-	val_t tmp;
 
-	if (args[0] == NULL)
-		return e_offset;
-
-	/* check symbol */
-	tmp = strlen(args[0]);
-	if (args[0][tmp - 1] == ':') {
-		args[0][tmp - 1] = '\0';
-		assign_value(args[0], s_offset);
-		if (*++args == NULL)
-			return e_offset;
-	}
+	memset(c, 0, sizeof(*c));
+	if (argn == 0)
+		return;
 
 	/* check command */
-	if (args[0][0] == '.') {
-		if (args[1] == NULL || args[2] != NULL) {
-			error("wrong command syntax", "%s", args[0]);
-			exit(EXIT_FAILURE);
-		}
-		if (strcmp(args[0], ".long") == 0) {
-			valp = (val_t *)pos;
-			fill_constant(args[1], valp);
-			pos = (byte *)(valp + 1);
-			s_offset = e_offset = pos - base;
-		} else if (strcmp(args[0], ".pos") == 0) {
-			tmp = parse_number(args[1]);
-			s_offset = tmp;
-		} else if (strcmp(args[0], ".align") == 0) {
-			tmp = parse_number(args[1]);
-			if (s_offset % tmp != 0)
-				s_offset += tmp - s_offset % tmp;
+	if (args[0].str[0] == '.') {
+		if (argn != 2)
+			fail("wrong command syntax", TOKEN_FMT,
+			     TOKEN_ARG(args[0]));
+		if (token_is(args[0], ".long")) {
+			c->kind = CODE_BYTES;
+			c->len = sizeof(*valp);
+			fill_constant(args[1], (val_t *)c->buf, &c->ref);
+		} else if (token_is(args[0], ".pos")) {
+			c->kind = CODE_POS;
+			c->arg = parse_number(args[1]);
+		} else if (token_is(args[0], ".align")) {
+			c->kind = CODE_ALIGN;
+			c->arg = parse_number(args[1]);
+			if (c->arg == 0)
+				fail("wrong alignment", TOKEN_FMT,
+				     TOKEN_ARG(args[1]));
 		} else {
-			error("unknown command", "%s", args[0]);
-			exit(EXIT_FAILURE);
+			fail("unknown command", TOKEN_FMT, TOKEN_ARG(args[0]));
 		}
-		return e_offset;
+		return;
 	}
 
 	/* instruction */
-	ins = parse_ins(args[0]);
+	ins = parse_ins_n(args[0].str, args[0].len);
 	icode = ins_icode(ins);
 
-	insp = (ins_t *)pos;
-	pos = (byte *)(insp + 1);
+	*pos++ = ins;
 	if (need_reg(icode)) {
 		regp = (reg_t *)pos;
 		pos = (byte *)(regp + 1);
 	}
 	if (need_val(icode)) {
 		valp = (val_t *)pos;
+		c->val_at = pos - c->buf;
 		pos = (byte *)(valp + 1);
 	}
-
-	/* next instruction follows the last */
-	s_offset = e_offset = pos - base;
+	c->kind = CODE_BYTES;
+	c->len = pos - c->buf;
+	c->ins = 1;
 
 	/* check argn */
-	for (tmp = 0; args[tmp] != NULL; tmp++)
-		;
-	if (tmp != icode_argn(icode)) {
-		error("wrong instruction syntax", "%s", args[0]);
+	if (argn != icode_argn(icode))
+		fail("wrong instruction syntax", TOKEN_FMT,
+		     TOKEN_ARG(args[0]));
+
+	/* fill sections */
+	icode_filler[icode](args, regp, valp, &c->ref);
+}
+
+static val_t s_offset;	/* at the start of next instruction */
+static val_t e_offset;	/* after the end of last instruction */
+
+/**
+ * lay_out(kind, len, arg, line)
+ *
+ * move the offsets past a line of @kind, with @len bytes or the
+ * argument @arg, and fill @line with where it went.  Return the
+ * address of its bytes.
+ */
+static val_t lay_out(byte kind, byte len, val_t arg, struct src_line *line)
+{
+	val_t addr = s_offset;
+
+	line->addr = s_offset;
+	line->len = 0;
+	line->pos = 0;
+	switch (kind) {
+	case CODE_BYTES:
+		/* next instruction follows the last */
+		s_offset = e_offset = s_offset + len;
+		line->len = len;
+		break;
+	case CODE_POS:
+		s_offset = arg;
+		line->addr = s_offset;
+		line->pos = 1;
+		break;
+	case CODE_ALIGN:
+		if (s_offset % arg != 0)
+			s_offset += arg - s_offset % arg;
+		line->addr = s_offset;
+		break;
+	}
+	return addr;
+}
+
+/*
+ * Start a section of the object at @addr: an absolute one if @align is
+ * 0, else one the linker aligns to @align.  The addresses of relative
+ * sections are the ones they would have at 0 until the object is made.
+ */
+static void open_section(val_t addr, val_t align)
+{
+	struct obj_section *sec;
+
+	if (nr_sections == sections_cap) {
+		sections_cap = sections_cap ? 2 * sections_cap : 16;
+		sections = realloc(sections, sections_cap * sizeof(*sections));
+		if (sections == NULL) {
+			error("out of memory", "%u", sections_cap);
+			exit(EXIT_FAILURE);
+		}
+	}
+	sec = &sections[nr_sections++];
+	sec->addr = addr;
+	sec->align = align;
+	sec->size = 0;
+	sec->end = 0;
+	sec->data = NULL;
+}
+
+/*
+ * End the last section at @end, and keep its bytes before a later
+ * section writes over them.
+ */
+static void close_section(val_t end)
+{
+	struct obj_section *sec = &sections[nr_sections - 1];
+
+	sec->end = end - sec->addr;
+	if ((sec->data = malloc(sec->size + 1)) == NULL) {
+		error("out of memory", "%u", sec->size);
 		exit(EXIT_FAILURE);
 	}
+	memcpy(sec->data, binary + sec->addr, sec->size);
+}
 
-	/* fill sections */
-	*insp = ins;
-	icode_filler[icode](args, regp, valp);
+/**
+ * section_add(c, addr)
+ *
+ * add what line @c put at @addr to the sections of the object.
+ */
+static void section_add(const struct code *c, val_t addr)
+{
+	struct obj_section *sec = &sections[nr_sections - 1];
+
+	switch (c->kind) {
+	case CODE_BYTES:
+		sec->size = max(sec->size, addr + c->len - sec->addr);
+		break;
+	case CODE_POS:
+		close_section(addr);
+		open_section(c->arg, 0);
+		break;
+	case CODE_ALIGN:
+		/* only the linker knows where relative sections go */
+		if (sec->align != 0) {
+			close_section(addr);
+			open_section(s_offset, c->arg);
+		}
+		break;
+	}
+}
+
+/**
+ * emit_code(c, line)
+ *
+ * @c: a line assembled on its own.
+ * @line: filled with where its bytes went.
+ *
+ * give @c its address and put its bytes in the binary, return the end
+ * of the binary so far.
+ */
+static val_t emit_code(const struct code *c, struct src_line *line)
+{
+	val_t addr;
+	byte *pos;
+
+	addr = lay_out(c->kind, c->len, c->arg, line);
+	if (relocatable)
+		section_add(c, addr);
+	if (c->kind == CODE_BYTES) {
+		pos = reserve(addr, c->len);
+		memcpy(pos, c->buf, c->len);
+		if (c->ref.len > 0)
+			lookup_symbol(c->ref, (val_t *)(pos + c->val_at));
+	}
 
 	return e_offset;
 }
 
-#define MAXBIN 4000
-#define BUFSIZE 1000
-#define MAXARGN 8
+/**
+ * assemble_line(args, argn, line)
+ *
+ * @args: the fields of a line.
+ * @argn: how many fields there are.
+ * @line: filled with where the bytes of the line went.
+ *
+ * assemble a line, return the end of the binary so far.
+ */
+static val_t assemble_line(struct token *args, unsigned int argn,
+			   struct src_line *line)
+{
+	struct token label;
+	struct code c;
 
-#define max(x, y) ((x) < (y) ? (y) : (x))
+	line->code = argn > 0;
+	argn = take_label(&args, argn, &label);
+	if (label.len > 0)
+		assign_value(label, symbol_hash(label), s_offset);
 
-static byte binary[MAXBIN];
-static val_t bin_size;
+	assembler(args, argn, &c);
+	return emit_code(&c, line);
+}
+
+/* label, mnemonic and two operands, and one more to tell it is too many */
+#define MAXARGN 5
+
+static struct src_line *src_lines;	/* only if keep_lines */
+static unsigned int nr_src_lines, src_lines_cap;
+static int keep_lines;
+
+/* add the line @lineno, from @src to @next, to @src_lines */
+static struct src_line *keep_line(unsigned int lineno, const char *src,
+				  const char *next)
+{
+	struct src_line *line;
+
+	if (nr_src_lines == src_lines_cap) {
+		src_lines_cap = src_lines_cap ? 2 * src_lines_cap : 256;
+		src_lines = realloc(src_lines,
+				    src_lines_cap * sizeof(*src_lines));
+		if (src_lines == NULL) {
+			error("out of memory", "%u", src_lines_cap);
+			exit(EXIT_FAILURE);
+		}
+	}
+	line = &src_lines[nr_src_lines++];
+	line->lineno = lineno;
+	line->text = src;
+	line->text_len = next - src - (next[-1] == '\n');
+	return line;
+}
 
-static char **parse_line(char *str)
+static int is_separator(char c)
+{
+	return c == ' ' || c == '\t' || c == ',' || c == '\n';
+}
+
+/**
+ * parse_line(str, end, args)
+ *
+ * split the line from @str to @end in fields separated by blanks and
+ * commas, up to a field starting with '#'.  Store the first MAXARGN of
+ * them in @args and return how many there are.
+ */
+static unsigned int parse_line(const char *str, const char *end,
+			       struct token *args)
 {
-	static char *args[MAXARGN];
-	char *token;
-	int n = 0;
+	const char *token;
+	unsigned int n = 0;
 
-	while ((token = strsep(&str, "\n\t ,")) != NULL) {
+	for (;;) {
+		while (str < end && is_separator(*str))
+			str++;
 
-		/* skip comments, ensure within limit */
-		if (token[0] == '#' || n + 1 == MAXARGN)
+		/* skip comments */
+		if (str == end || *str == '#')
 			break;
 
-		/* skip empty fields */
-		if (token[0] == '\0')
+		token = str;
+		while (str < end && !is_separator(*str))
+			str++;
+		if (n < MAXARGN)
+			args[n] = (struct token){ token, str - token };
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * driver(src, size)
+ *
+ * assemble the @size bytes of source at @src, in place.
+ */
+static void driver(const char *src, size_t size)
+{
+	const char *end = src + size, *next;
+	struct token args[MAXARGN];
+	struct src_line scratch, *line = &scratch;
+	unsigned int argn;
+	val_t e_offset;
+
+	bin_size = 0;
+
+	for (; src < end; src = next) {
+		next = memchr(src, '\n', end - src);
+		next = next != NULL ? next + 1 : end;
+		cur_lineno++;
+
+		if (keep_lines)
+			line = keep_line(cur_lineno, src, next);
+
+		argn = parse_line(src, next, args);
+		e_offset = assemble_line(args, argn, line);
+		bin_size = max(e_offset, bin_size);
+	}
+}
+
+/*
+ * Big sources are assembled in parallel: the source is cut in chunks
+ * at line boundaries, and each chunk is encoded on its own thread into
+ * a fragment, one item per line with the labels it defines and the
+ * symbols it refers to on the side.  Laying the fragments out and
+ * defining the labels is left to the main thread, then the threads
+ * copy the bytes of their fragments into the binary and look up the
+ * symbols.  The result is the same as assembling serially, so any
+ * line the workers cannot encode, and code written over other code
+ * (where the order of the patches matters), is left to driver().
+ */
+#define CHUNK_MIN (256 * 1024)
+
+/* a line of a fragment: a struct code without its symbols */
+struct item {
+	val_t arg;		/* of .pos and .align, address of the bytes */
+	byte kind;
+	byte len;
+	byte ins;
+	byte buf[MAX_CODE_LEN];
+};
+
+struct label {
+	unsigned int item;	/* defining it */
+	unsigned int hash;
+	struct token name;
+	val_t value;
+};
+
+struct ref {
+	unsigned int item;	/* whose constant it is */
+	unsigned int hash;
+	struct token name;
+	byte val_at;
+};
+
+struct fragment {
+	const char *src, *end;		/* the chunk */
+	unsigned int first;		/* lines before it */
+	struct item *items;
+	struct label *labels;
+	struct ref *refs;
+	unsigned int nr_items, nr_labels, nr_refs;
+	unsigned int items_cap, labels_cap, refs_cap;
+	unsigned int undefined;		/* refs to symbols never defined */
+	int failed;
+	pthread_t thread;
+	int threaded;			/* else done by the caller */
+};
+
+static void *grow(void *array, unsigned int *cap, size_t size)
+{
+	*cap = *cap ? 2 * *cap : 256;
+	if ((array = realloc(array, *cap * size)) == NULL)
+		fail("out of memory", "%u", *cap);
+	return array;
+}
+
+/* return a new element at the end of @array, of @nr and @cap elements */
+#define push(array, nr, cap)						\
+	((nr) == (cap) ? (array) = grow(array, &(cap), sizeof(*(array))) \
+		       : (array),					\
+	 &(array)[(nr)++])
+
+static void *encode_fragment(void *arg)
+{
+	struct fragment *f = arg;
+	const char *src, *next;
+	struct token args[MAXARGN], *argp, label;
+	unsigned int argn;
+	struct label *lp;
+	struct ref *rp;
+	struct item *it;
+	struct code c;
+	jmp_buf env;
+
+	bail = &env;
+	if (setjmp(env)) {
+		f->failed = 1;
+		bail = NULL;
+		return NULL;
+	}
+
+	for (src = f->src; src < f->end; src = next) {
+		next = memchr(src, '\n', f->end - src);
+		next = next != NULL ? next + 1 : f->end;
+
+		argp = args;
+		argn = take_label(&argp, parse_line(src, next, args), &label);
+		assembler(argp, argn, &c);
+
+		if (label.len > 0) {
+			lp = push(f->labels, f->nr_labels, f->labels_cap);
+			lp->item = f->nr_items;
+			lp->hash = symbol_hash(label);
+			lp->name = label;
+		}
+		if (c.ref.len > 0) {
+			rp = push(f->refs, f->nr_refs, f->refs_cap);
+			rp->item = f->nr_items;
+			rp->hash = symbol_hash(c.ref);
+			rp->name = c.ref;
+			rp->val_at = c.val_at;
+		}
+		it = push(f->items, f->nr_items, f->items_cap);
+		it->arg = c.arg;
+		it->kind = c.kind;
+		it->len = c.len;
+		it->ins = c.ins;
+		memcpy(it->buf, c.buf, sizeof(it->buf));
+	}
+	bail = NULL;
+	return NULL;
+}
+
+/**
+ * lay_out_fragments(frags, n)
+ *
+ * give every item and label of the @n fragments its address, the way
+ * assemble_line() would.  Return 0 if the bytes of no two lines overlap
+ * and the binary fits in the address space, else -1.
+ */
+static int lay_out_fragments(struct fragment *frags, unsigned int n)
+{
+	struct src_line scratch, *line = &scratch;
+	unsigned int i, j, l, lineno = 0;
+	unsigned char *seen = NULL;
+	size_t seen_size = 0, size, end;
+	const char *src = frags[0].src, *next;
+	struct fragment *f;
+	struct item *it;
+	val_t addr, k;
+
+	bin_size = 0;
+	for (f = frags; f < frags + n; f++) {
+		f->first = lineno;
+		for (i = l = 0; i < f->nr_items; i++) {
+			it = &f->items[i];
+			if (keep_lines) {
+				next = memchr(src, '\n', f->end - src);
+				next = next != NULL ? next + 1 : f->end;
+				line = keep_line(lineno + i + 1, src, next);
+				line->code = it->kind != CODE_NONE
+					  || (l < f->nr_labels
+					      && f->labels[l].item == i);
+				src = next;
+			}
+			if (l < f->nr_labels && f->labels[l].item == i)
+				f->labels[l++].value = s_offset;
+
+			addr = lay_out(it->kind, it->len, it->arg, line);
+			bin_size = max(e_offset, bin_size);
+			if (it->kind != CODE_BYTES)
+				continue;
+			it->arg = addr;
+
+			/* mark the bytes, no byte is written twice */
+			end = (size_t)addr + it->len;
+			if (end > (val_t)-1)
+				goto fail;
+			if ((end + 7) / 8 > seen_size) {
+				size = max(max(2 * seen_size, (end + 7) / 8), 512);
+				if ((seen = realloc(seen, size)) == NULL)
+					goto fail;
+				memset(seen + seen_size, 0, size - seen_size);
+				seen_size = size;
+			}
+			for (k = addr; k < end; k++) {
+				if (seen[k / 8] & (1 << k % 8))
+					goto fail;
+				seen[k / 8] |= 1 << k % 8;
+			}
+		}
+		lineno += f->nr_items;
+	}
+	free(seen);
+	return 0;
+fail:
+	free(seen);
+	for (j = 0; j < n; j++)
+		frags[j].failed = 1;
+	return -1;
+}
+
+/* return the symbol of @rp if it has a value, else NULL */
+static struct symbol_entry *ref_symbol(const struct ref *rp)
+{
+	struct symbol_entry *sptr;
+
+	sptr = symbol_slot(rp->name.str, rp->name.len, rp->hash)->sptr;
+	return sptr != NULL && sptr->valid ? sptr : NULL;
+}
+
+static void *resolve_fragment(void *arg)
+{
+	struct fragment *f = arg;
+	struct symbol_entry *sptr;
+	struct item *it;
+	struct ref *rp;
+
+	for (it = f->items; it < f->items + f->nr_items; it++)
+		if (it->kind == CODE_BYTES)
+			memcpy(binary + it->arg, it->buf, it->len);
+
+	/* the table is only read now */
+	for (rp = f->refs; rp < f->refs + f->nr_refs; rp++) {
+		if ((sptr = ref_symbol(rp)) == NULL) {
+			f->undefined++;
 			continue;
+		}
+		it = &f->items[rp->item];
+		*(val_t *)(binary + it->arg + rp->val_at) = sptr->value;
+	}
+	return NULL;
+}
+
+/* run @work on @f on a thread of its own, or right here if there is none */
+static void run_fragment(struct fragment *f, void *(*work)(void *))
+{
+	f->threaded = pthread_create(&f->thread, NULL, work, f) == 0;
+	if (!f->threaded)
+		work(f);
+}
+
+static void join_fragment(struct fragment *f)
+{
+	if (f->threaded)
+		pthread_join(f->thread, NULL);
+}
+
+/**
+ * parallel_driver(src, size, jobs)
+ *
+ * assemble the @size bytes of source at @src on up to @jobs threads,
+ * or serially if it is too small to be worth it.  A fragment whose
+ * thread cannot be created is done by this one.
+ */
+static void parallel_driver(const char *src, size_t size, unsigned int jobs)
+{
+	struct fragment *frags, *f;
+	const char *end = src + size, *cut;
+	unsigned int i, n, undefined = 0;
+	struct ref *rp;
+	struct label *lp;
+
+	n = relocatable ? 1 : max(1, min(jobs, size / CHUNK_MIN));
+	if (n == 1) {
+		driver(src, size);
+		return;
+	}
 
-		args[n++] = token;
+	if ((frags = calloc(n, sizeof(*frags))) == NULL) {
+		driver(src, size);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		f = &frags[i];
+		f->src = i > 0 ? frags[i - 1].end : src;
+		cut = i < n - 1 ? src + size / n * (i + 1) : end;
+		if (cut < f->src)
+			cut = f->src;
+		if (cut < end && (cut = memchr(cut, '\n', end - cut)) != NULL)
+			cut++;
+		f->end = cut != NULL ? cut : end;
+		run_fragment(f, encode_fragment);
 	}
+	for (i = 0; i < n; i++)
+		join_fragment(&frags[i]);
 
-	/* null terminate */
-	args[n] = NULL;
+	for (i = 0; i < n; i++)
+		if (frags[i].failed)
+			break;
+	if (i < n || lay_out_fragments(frags, n) != 0) {
+		/* let the serial assembler tell what is wrong */
+		s_offset = e_offset = 0;
+		nr_src_lines = 0;
+		driver(src, size);
+		goto out;
+	}
 
-	return args;
+	for (f = frags; f < frags + n; f++)
+		for (lp = f->labels; lp < f->labels + f->nr_labels; lp++)
+			assign_value(lp->name, lp->hash, lp->value);
+
+	if (bin_size > 0)
+		reserve(0, bin_size);
+	for (i = 0; i < n; i++)
+		run_fragment(&frags[i], resolve_fragment);
+	for (i = 0; i < n; i++) {
+		join_fragment(&frags[i]);
+		undefined += frags[i].undefined;
+	}
+
+	if (undefined > 0) {
+		for (f = frags; f < frags + n; f++)
+			for (rp = f->refs; rp < f->refs + f->nr_refs; rp++)
+				if (ref_symbol(rp) == NULL)
+					report_undefined(f->first + rp->item + 1,
+							 rp->name);
+		exit(EXIT_FAILURE);
+	}
+out:
+	for (f = frags; f < frags + n; f++) {
+		free(f->items);
+		free(f->labels);
+		free(f->refs);
+	}
+	free(frags);
 }
 
-static void driver(FILE *in)
+/*
+ * With -O the source is encoded as one fragment, then a peephole pass
+ * goes over the instructions of every basic block, before the fragment
+ * is laid out.  A block starts at a label or a directive, and ends
+ * after a jXX, call, ret or halt.  The pass drops instructions that
+ * change nothing:
+ *
+ *  - nop, and rrmovl or cmovXX of a register to itself;
+ *  - irmovl of the constant or symbol the register already holds from
+ *    an irmovl or rrmovl earlier in the block;
+ *  - jXX to the address right after it.
+ *
+ * The code after them moves up, and the labels with it, so the code
+ * must only be reached through labels and never be read as data.
+ */
+enum peep_kind {
+	PEEP_NOP,
+	PEEP_MOVE,
+	PEEP_CONST,
+	PEEP_JUMP,
+	NR_PEEP,
+};
+
+static const char *peep_names[NR_PEEP] = { "nop", "rrmovl", "irmovl", "jXX" };
+static unsigned int peep_removed[NR_PEEP], peep_bytes;
+
+/* what a register is known to hold */
+struct known {
+	int valid;
+	val_t value;
+	struct token ref;	/* symbol of the value, len 0 if none */
+};
+
+static int known_same(const struct known *x, const struct known *y)
+{
+	return x->valid && y->valid && x->value == y->value
+		&& token_eq(x->ref, y->ref);
+}
+
+static void peep_remove(struct item *it, enum peep_kind kind)
+{
+	peep_removed[kind]++;
+	peep_bytes += it->len;
+	it->kind = CODE_NONE;
+	it->len = 0;
+}
+
+/**
+ * peephole(f)
+ *
+ * drop the instructions of @f that change nothing.  Those left keep
+ * their bytes, only their addresses change.
+ */
+static void peephole(struct fragment *f)
 {
-	char buf[BUFSIZE];
-	char **argp;
+	unsigned int *label_of, *ref_of, i, k;
+	struct known known[16], v;
+	struct item *it;
+	struct ref *rp;
+	regid_t rA, rB;
+
+	/* index + 1 of the label and ref of each item, 0 if none */
+	label_of = calloc(f->nr_items + 1, sizeof(*label_of));
+	ref_of = calloc(f->nr_items + 1, sizeof(*ref_of));
+	if (label_of == NULL || ref_of == NULL)
+		fail("out of memory", "%u", f->nr_items);
+	for (i = 0; i < f->nr_labels; i++)
+		label_of[f->labels[i].item] = i + 1;
+	for (i = 0; i < f->nr_refs; i++)
+		ref_of[f->refs[i].item] = i + 1;
+
+	memset(known, 0, sizeof(known));
+	for (i = 0; i < f->nr_items; i++) {
+		it = &f->items[i];
+		if (label_of[i] || (it->kind != CODE_NONE && !it->ins))
+			memset(known, 0, sizeof(known));
+		if (!it->ins)
+			continue;
+		rA = reg_rA(it->buf[1]);
+		rB = reg_rB(it->buf[1]);
+		switch (ins_icode(it->buf[0])) {
+		case I_NOP:
+			peep_remove(it, PEEP_NOP);
+			break;
+		case I_RRMOVL:
+			if (rA == rB)
+				peep_remove(it, PEEP_MOVE);
+			else if (ins_ifun(it->buf[0]) == C_ALL)
+				known[rB] = known[rA];
+			else if (!known_same(&known[rA], &known[rB]))
+				known[rB].valid = 0;
+			break;
+		case I_IRMOVL:
+			v.valid = 1;
+			memcpy(&v.value, it->buf + 2, sizeof(v.value));
+			v.ref = ref_of[i] ? f->refs[ref_of[i] - 1].name
+					      : (struct token){ NULL, 0 };
+			if (known_same(&known[rB], &v))
+				peep_remove(it, PEEP_CONST);
+			else
+				known[rB] = v;
+			break;
+		case I_RMMOVL:
+			break;
+		case I_MRMOVL:
+		case I_XCHGL:
+			known[rA].valid = 0;
+			break;
+		case I_OPL:
+			known[rB].valid = 0;
+			break;
+		case I_PUSHL:
+			known[R_ESP].valid = 0;
+			break;
+		case I_POPL:
+			known[R_ESP].valid = 0;
+			known[rA].valid = 0;
+			break;
+		default:
+			/* the end of the block */
+			memset(known, 0, sizeof(known));
+		}
+	}
+
+	/* backwards, so that a jump over dropped jumps is dropped too */
+	for (i = f->nr_items; i-- > 0; ) {
+		it = &f->items[i];
+		if (it->kind == CODE_NONE || !it->ins || !ref_of[i]
+		    || ins_icode(it->buf[0]) != I_JXX)
+			continue;
+		rp = &f->refs[ref_of[i] - 1];
+		for (k = i + 1; k < f->nr_items; k++) {
+			if (label_of[k]
+			    && token_eq(f->labels[label_of[k] - 1].name,
+					rp->name)) {
+				peep_remove(it, PEEP_JUMP);
+				break;
+			}
+			if (f->items[k].kind != CODE_NONE)
+				break;
+		}
+	}
+	free(label_of);
+	free(ref_of);
+}
+
+/**
+ * optimizing_driver(src, size)
+ *
+ * assemble the @size bytes of source at @src through peephole().  The
+ * items are then assembled one by one as driver() would, so patches,
+ * sections and errors come out the same way.
+ */
+static void optimizing_driver(const char *src, size_t size)
+{
+	struct fragment f = { .src = src, .end = src + size };
+	struct src_line scratch, *line = &scratch;
+	unsigned int i, l = 0, r = 0;
+	const char *next;
+	struct item *it;
+	struct code c;
 	val_t e_offset;
 
+	encode_fragment(&f);
+	if (f.failed) {
+		/* let the serial assembler tell what is wrong */
+		driver(src, size);
+		goto out;
+	}
+	peephole(&f);
+
 	bin_size = 0;
+	for (i = 0; i < f.nr_items; i++) {
+		it = &f.items[i];
+		cur_lineno++;
+		if (keep_lines) {
+			next = memchr(src, '\n', f.end - src);
+			next = next != NULL ? next + 1 : f.end;
+			line = keep_line(cur_lineno, src, next);
+			src = next;
+		}
+		line->code = it->kind != CODE_NONE || it->ins;
+		if (l < f.nr_labels && f.labels[l].item == i) {
+			line->code = 1;
+			assign_value(f.labels[l].name, f.labels[l].hash,
+				     s_offset);
+			l++;
+		}
 
-	while (fgets(buf, BUFSIZE, in) != NULL) {
-		argp = parse_line(buf);
-		e_offset = assembler(argp, binary);
+		memset(&c, 0, sizeof(c));
+		c.kind = it->kind;
+		c.len = it->len;
+		c.arg = it->arg;
+		memcpy(c.buf, it->buf, sizeof(c.buf));
+		if (r < f.nr_refs && f.refs[r].item == i) {
+			c.ref = f.refs[r].name;
+			c.val_at = f.refs[r].val_at;
+			r++;
+		}
+		e_offset = emit_code(&c, line);
 		bin_size = max(e_offset, bin_size);
 	}
+out:
+	free(f.items);
+	free(f.labels);
+	free(f.refs);
 }
 
-int main(int argc, char *argv[])
+static void report_peephole(void)
 {
-	FILE *input, *output;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < NR_PEEP; i++)
+		n += peep_removed[i];
+	fprintf(stderr, "Peephole: removed %u instructions, %u bytes (",
+		n, peep_bytes);
+	for (i = 0; i < NR_PEEP; i++)
+		fprintf(stderr, "%s%s %u", i > 0 ? ", " : "", peep_names[i],
+			peep_removed[i]);
+	fprintf(stderr, ")\n");
+}
 
-	if (argc < 2 || argc > 3) {
-		fprintf(stderr, "Usage: %s <input> [<output>]\n", argv[0]);
+static int symbol_cmp(const void *a, const void *b)
+{
+	const struct symbol_entry *x = *(const struct symbol_entry **)a;
+	const struct symbol_entry *y = *(const struct symbol_entry **)b;
+
+	if (x->value != y->value)
+		return x->value < y->value ? -1 : 1;
+	return strcmp(x->symbol, y->symbol);
+}
+
+/**
+ * write_map(out)
+ *
+ * write the symbols, the address and line of the bytes of every line,
+ * and the extents of the code at each .pos, one record per line:
+ *
+ *	<address> <symbol>
+ *	line <address> <size> <line>
+ *	pos <start> <end>
+ *
+ * The symbol lines can be read by Y86sim -S as they are.
+ */
+static void write_map(FILE *out, const char *source)
+{
+	struct symbol_entry *sptr, **syms = NULL;
+	unsigned int i, n = 0, size = 0;
+	struct src_line *line;
+	val_t start = 0, end = 0;
+
+	fprintf(out, "# %s\n", source);
+	list_for_each_entry(sptr, &symbol_head, symbol_list) {
+		if (!sptr->valid)
+			continue;
+		if (n == size) {
+			size = size ? 2 * size : 64;
+			if ((syms = realloc(syms,
+					    size * sizeof(*syms))) == NULL) {
+				error("out of memory", "%u", size);
+				exit(EXIT_FAILURE);
+			}
+		}
+		syms[n++] = sptr;
+	}
+	qsort(syms, n, sizeof(*syms), symbol_cmp);
+	for (i = 0; i < n; i++)
+		fprintf(out, "0x%08x %s\n", syms[i]->value, syms[i]->symbol);
+	free(syms);
+
+	for (i = 0; i < nr_src_lines; i++) {
+		line = &src_lines[i];
+		if (line->len > 0)
+			fprintf(out, "line 0x%08x %u %u\n",
+				line->addr, line->len, line->lineno);
+	}
+
+	/* code before the first .pos starts at 0 */
+	for (i = 0; i <= nr_src_lines; i++) {
+		line = i < nr_src_lines ? &src_lines[i] : NULL;
+		if (line == NULL || line->pos) {
+			if (end > start)
+				fprintf(out, "pos 0x%08x 0x%08x\n", start, end);
+			if (line != NULL)
+				start = end = line->addr;
+		} else if (line->len > 0) {
+			end = max(end, line->addr + line->len);
+		}
+	}
+}
+
+/**
+ * write_listing(out)
+ *
+ * write the source with the address and bytes of every line in front,
+ * the way .yo files of CS:APP are.
+ */
+static void write_listing(FILE *out)
+{
+	struct src_line *line;
+	val_t i;
+
+	for (line = src_lines; line < src_lines + nr_src_lines; line++) {
+		if (!line->code) {
+			fprintf(out, "%22s| %.*s\n", "",
+				(int)line->text_len, line->text);
+			continue;
+		}
+		fprintf(out, "  0x%03x: ", line->addr);
+		for (i = 0; i < line->len; i++)
+			fprintf(out, "%02x", binary[line->addr + i]);
+		fprintf(out, "%*s | %.*s\n", 12 - 2 * line->len, "",
+			(int)line->text_len, line->text);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-O] [-j <jobs>] [-m <map>] [-l <listing>] "
+			"<input> [<output>]\n"
+			"       %s -c [-O] [-C <cache>] [-m <map>] "
+			"[-l <listing>] <input> [<output>]\n", prog, prog);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * map_input(path, sizep)
+ *
+ * return the contents of @path, mapped in memory if it is a regular
+ * file, else read, and store its size in *@sizep.
+ */
+static const char *map_input(const char *path, size_t *sizep)
+{
+	struct stat st;
+	char *buf = NULL;
+	size_t size = 0, cap = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+		goto fail;
+	if (S_ISREG(st.st_mode)) {
+		*sizep = st.st_size;
+		if (st.st_size == 0) {
+			close(fd);
+			return "";
+		}
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED)
+			goto fail;
+		madvise(buf, st.st_size, MADV_SEQUENTIAL);
+		close(fd);
+		return buf;
+	}
+	do {
+		if (size == cap) {
+			cap = cap ? 2 * cap : 1 << 16;
+			if ((buf = realloc(buf, cap)) == NULL)
+				goto fail;
+		}
+		n = read(fd, buf + size, cap - size);
+		if (n > 0)
+			size += n;
+	} while (n > 0 || (n == -1 && errno == EINTR));
+	if (n == -1)
+		goto fail;
+	close(fd);
+	*sizep = size;
+	return buf;
+fail:
+	perror(path);
+	exit(EXIT_FAILURE);
+}
+
+static int write_all(int fd, const byte *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* write the @len bytes at @buf to @path */
+static void write_output(const char *path, const byte *buf, size_t len)
+{
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1
+	    || write_all(fd, buf, len) == -1 || close(fd) == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static int reloc_cmp(const void *a, const void *b)
+{
+	const struct obj_reloc *x = a, *y = b;
+
+	if (x->section != y->section)
+		return x->section < y->section ? -1 : 1;
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int section_cmp(const void *a, const void *b)
+{
+	const struct obj_section *x = *(struct obj_section *const *)a;
+	const struct obj_section *y = *(struct obj_section *const *)b;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/*
+ * The linker cannot tell the bytes a section wrote from the ones it
+ * skipped, and refuses sections sharing bytes.  Those after a .pos
+ * already have their addresses, so refuse them here.
+ */
+static void check_sections(void)
+{
+	struct obj_section **abs, *last = NULL;
+	unsigned int i, n = 0;
+
+	if ((abs = malloc((nr_sections + 1) * sizeof(*abs))) == NULL) {
+		error("out of memory", "%u", nr_sections);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nr_sections; i++)
+		if (sections[i].align == 0 && sections[i].size > 0)
+			abs[n++] = &sections[i];
+	qsort(abs, n, sizeof(*abs), section_cmp);
+	for (i = 0; i < n; i++) {
+		if (last != NULL && abs[i]->addr < (unsigned long long)
+		    last->addr + last->size) {
+			error("sections overlap", "0x%x", abs[i]->addr);
+			exit(EXIT_FAILURE);
+		}
+		if (last == NULL || (unsigned long long)abs[i]->addr
+		    + abs[i]->size > (unsigned long long)last->addr
+		    + last->size)
+			last = abs[i];
+	}
+	free(abs);
+}
+
+/**
+ * object_image(lenp)
+ *
+ * return the object assembled, as written in a file, and store its
+ * length in *@lenp.
+ */
+static byte *object_image(size_t *lenp)
+{
+	struct object obj = { 0 };
+	struct symbol_entry *sptr;
+	struct valp_entry *iptr;
+	struct obj_symbol *sym;
+	struct obj_reloc *rel;
+	unsigned int i, rels_cap = 0;
+	char *buf;
+	FILE *out;
+
+	close_section(s_offset);
+	check_sections();
+	obj.sections = sections;
+	obj.nr_sections = nr_sections;
+
+	if ((obj.symbols = calloc(nr_symbols + 1,
+				  sizeof(*obj.symbols))) == NULL) {
+		error("out of memory", "%u", nr_symbols);
+		exit(EXIT_FAILURE);
+	}
+	list_for_each_entry(sptr, &symbol_head, symbol_list) {
+		sym = &obj.symbols[obj.nr_symbols];
+		sym->name = sptr->symbol;
+		sym->section = sptr->valid ? sptr->section : OBJ_UNDEF;
+		sym->value = sptr->valid
+			   ? sptr->value - sections[sptr->section].addr : 0;
+		for (iptr = sptr->valp_head; iptr != NULL; iptr = iptr->next) {
+			if (obj.nr_relocs == rels_cap) {
+				rels_cap = rels_cap ? 2 * rels_cap : 64;
+				obj.relocs = realloc(obj.relocs, rels_cap
+						     * sizeof(*obj.relocs));
+				if (obj.relocs == NULL) {
+					error("out of memory", "%u", rels_cap);
+					exit(EXIT_FAILURE);
+				}
+			}
+			rel = &obj.relocs[obj.nr_relocs++];
+			rel->section = iptr->section;
+			rel->offset = iptr->offset
+				    - sections[iptr->section].addr;
+			rel->symbol = obj.nr_symbols;
+		}
+		obj.nr_symbols++;
+	}
+	qsort(obj.relocs, obj.nr_relocs, sizeof(*obj.relocs), reloc_cmp);
+	for (i = 0; i < nr_sections; i++)
+		if (sections[i].align != 0)
+			sections[i].addr = 0;
+
+	if ((out = open_memstream(&buf, lenp)) == NULL
+	    || object_save(&obj, out) == -1 || fclose(out) == EOF) {
+		perror("object");
+		exit(EXIT_FAILURE);
+	}
+	free(obj.symbols);
+	free(obj.relocs);
+	return (byte *)buf;
+}
+
+/*
+ * The object cache of -C: objects are kept under the hash of their
+ * source, and copied from there instead of assembling a source again.
+ * The hash starts with the object format and the build of Y86asm, so
+ * that a new assembler does not get the objects of an old one.
+ */
+static const char cache_salt[] = OBJ_MAGIC " " __DATE__ " " __TIME__;
+
+static unsigned long long fnv(unsigned long long hash, const char *buf,
+			      size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		hash ^= (byte)buf[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static char *cache_path(const char *dir, const char *src, size_t size,
+			int optimize)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	size_t len = strlen(dir) + 48;
+	char *path;
+
+	hash = fnv(hash, cache_salt, sizeof(cache_salt) - 1);
+	hash = fnv(hash, src, size);
+	if ((path = malloc(len)) == NULL) {
+		perror(dir);
 		exit(EXIT_FAILURE);
 	}
+	snprintf(path, len, "%s/%016llx-%zx%s.o", dir, hash, size,
+		 optimize ? "-O" : "");
+	return path;
+}
 
-	input = fopen(argv[1], "r");
-	driver(input);
-	fclose(input);
+/* put the @len bytes of object at @buf in the cache as @path, if it can */
+static void cache_store(const char *path, const byte *buf, size_t len)
+{
+	size_t size = strlen(path) + 8;
+	char *tmp;
+	int fd;
+
+	if ((tmp = malloc(size)) == NULL)
+		return;
+	snprintf(tmp, size, "%s.XXXXXX", path);
+	/* never let a half written object be seen */
+	if ((fd = mkstemp(tmp)) == -1) {
+		perror(tmp);
+	} else if (write_all(fd, buf, len) == -1 || close(fd) == -1
+		   || rename(tmp, path) == -1) {
+		perror(tmp);
+		unlink(tmp);
+	}
+	free(tmp);
+}
 
-	if (argc == 3) {
-		output = fopen(argv[2], "w");
+static FILE *open_output(const char *path)
+{
+	FILE *output = fopen(path, "w");
+
+	if (output == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	return output;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *output;
+	const char *map = NULL, *listing = NULL, *cache = NULL, *src, *out;
+	const byte *obj;
+	char *cached = NULL;
+	size_t size, len;
+	int opt, jobs = 0, optimize = 0;
+
+	while ((opt = getopt(argc, argv, "j:m:l:cC:O")) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'm':
+			map = optarg;
+			break;
+		case 'l':
+			listing = optarg;
+			break;
+		case 'c':
+			relocatable = 1;
+			break;
+		case 'C':
+			cache = optarg;
+			break;
+		case 'O':
+			optimize = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < 1 || argc - optind > 2)
+		usage(argv[0]);
+	if (argc - optind == 2)
+		out = argv[optind + 1];
+	else
+		out = relocatable ? "y.o" : "y.out";
+
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	keep_lines = map != NULL || listing != NULL;
+	src = map_input(argv[optind], &size);
+
+	/* the map and the listing are not cached, only the object is */
+	if (relocatable && cache != NULL && !keep_lines) {
+		cached = cache_path(cache, src, size, optimize);
+		if (access(cached, R_OK) == 0) {
+			obj = (const byte *)map_input(cached, &len);
+			write_output(out, obj, len);
+			exit(EXIT_SUCCESS);
+		}
+	}
+
+	if (relocatable)
+		open_section(0, 1);
+	if (optimize)
+		optimizing_driver(src, size);
+	else
+		parallel_driver(src, size, jobs);
+	if (!relocatable && check_symbols() > 0)
+		exit(EXIT_FAILURE);
+	if (optimize)
+		report_peephole();
+
+	if (relocatable) {
+		obj = object_image(&len);
+		write_output(out, obj, len);
+		if (cached != NULL)
+			cache_store(cached, obj, len);
 	} else {
-		output = fopen("y.out", "w");
+		write_output(out, binary, bin_size);
+	}
+
+	if (map != NULL) {
+		output = open_output(map);
+		write_map(output, argv[optind]);
+		fclose(output);
+	}
+	if (listing != NULL) {
+		output = open_output(listing);
+		write_listing(output);
+		fclose(output);
 	}
-	fwrite(binary, sizeof(byte), bin_size, output);
-	fclose(output);
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,365 @@
+#include "lib/Y86.h"
+#include "lib/object.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define max(x, y) ((x) < (y) ? (y) : (x))
+
+/*
+ * Objects are linked in the order they are given, the way their sources
+ * would be assembled one after the other: relative sections go where
+ * the previous section ended, aligned, and absolute sections where
+ * their .pos put them.  Unlike the assembler, the linker does not know
+ * which bytes of a section were written and which are just in between,
+ * so sections must not share any byte.
+ */
+struct input {
+	const char *path;
+	struct object *obj;
+	val_t *base;			/* of each section */
+};
+
+struct global {
+	const char *name;
+	val_t value;
+	struct input *in;		/* defining it */
+};
+
+static struct input *inputs;
+static unsigned int nr_inputs;
+
+static struct global *globals;
+static size_t nr_globals;
+
+static byte *image;
+static val_t image_size;
+
+static void out_of_memory(void)
+{
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+static void load_objects(char **paths, unsigned int n)
+{
+	struct input *in;
+	FILE *file;
+
+	if ((inputs = calloc(n, sizeof(*inputs))) == NULL)
+		out_of_memory();
+	for (in = inputs; in < inputs + n; in++) {
+		in->path = *paths++;
+		if ((file = fopen(in->path, "rb")) == NULL) {
+			perror(in->path);
+			exit(EXIT_FAILURE);
+		}
+		if ((in->obj = object_load(file)) == NULL) {
+			fprintf(stderr, "%s: %s\n", in->path, errno == EINVAL
+				? "not a Y86 object" : strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		fclose(file);
+	}
+	nr_inputs = n;
+}
+
+struct span {
+	val_t start;
+	unsigned long long end;
+	struct input *in;
+	val_t section;
+};
+
+static int span_cmp(const void *a, const void *b)
+{
+	const struct span *x = a, *y = b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/**
+ * check_overlaps()
+ *
+ * make sure no two sections placed have a byte in common.
+ */
+static void check_overlaps(void)
+{
+	struct span *spans, *sp, *last = NULL;
+	struct input *in;
+	size_t n = 0;
+	val_t i;
+	int overlap = 0;
+
+	for (in = inputs; in < inputs + nr_inputs; in++)
+		n += in->obj->nr_sections;
+	if ((spans = calloc(n + 1, sizeof(*spans))) == NULL)
+		out_of_memory();
+	n = 0;
+	for (in = inputs; in < inputs + nr_inputs; in++)
+		for (i = 0; i < in->obj->nr_sections; i++) {
+			if (in->obj->sections[i].size == 0)
+				continue;
+			sp = &spans[n++];
+			sp->start = in->base[i];
+			sp->end = (unsigned long long)in->base[i]
+				+ in->obj->sections[i].size;
+			sp->in = in;
+			sp->section = i;
+		}
+	qsort(spans, n, sizeof(*spans), span_cmp);
+
+	for (sp = spans; sp < spans + n; sp++) {
+		if (last != NULL && sp->start < last->end) {
+			fprintf(stderr, "Error: %s: section %u overlaps "
+				"section %u of %s at 0x%x\n", sp->in->path,
+				sp->section, last->section, last->in->path,
+				sp->start);
+			overlap = 1;
+		}
+		if (last == NULL || sp->end > last->end)
+			last = sp;
+	}
+	free(spans);
+	if (overlap)
+		exit(EXIT_FAILURE);
+}
+
+/**
+ * lay_out()
+ *
+ * place every section, and size the image.
+ */
+static void lay_out(void)
+{
+	unsigned long long pos = 0, size = 0;
+	struct obj_section *sec;
+	struct object *obj;
+	struct input *in;
+	val_t i;
+
+	for (in = inputs; in < inputs + nr_inputs; in++) {
+		obj = in->obj;
+		in->base = calloc(obj->nr_sections + 1, sizeof(*in->base));
+		if (in->base == NULL)
+			out_of_memory();
+		for (i = 0; i < obj->nr_sections; i++) {
+			sec = &obj->sections[i];
+			if (sec->align == 0)
+				pos = sec->addr;
+			else if (pos % sec->align != 0)
+				pos += sec->align - pos % sec->align;
+			if (pos > (val_t)-1) {
+				fprintf(stderr, "Error: %s: section %u beyond "
+					"the address space\n", in->path, i);
+				exit(EXIT_FAILURE);
+			}
+			in->base[i] = pos;
+			if (sec->size > 0)
+				size = max(size, pos + sec->size);
+			pos += sec->end;
+		}
+	}
+	if (size > (val_t)-1) {
+		fprintf(stderr, "Error: image beyond the address space\n");
+		exit(EXIT_FAILURE);
+	}
+	image_size = size;
+	check_overlaps();
+}
+
+static int global_cmp(const void *a, const void *b)
+{
+	const struct global *x = a, *y = b;
+
+	return strcmp(x->name, y->name);
+}
+
+/**
+ * define_symbols()
+ *
+ * collect the symbols the objects define, with their addresses, and
+ * make sure none is defined twice.
+ */
+static void define_symbols(void)
+{
+	struct obj_symbol *sym;
+	struct global *g;
+	struct input *in;
+	size_t i, cap = 0;
+	int twice = 0;
+
+	for (in = inputs; in < inputs + nr_inputs; in++)
+		for (sym = in->obj->symbols;
+		     sym < in->obj->symbols + in->obj->nr_symbols; sym++) {
+			if (sym->section == OBJ_UNDEF)
+				continue;
+			if (nr_globals == cap) {
+				cap = cap ? 2 * cap : 256;
+				g = realloc(globals, cap * sizeof(*globals));
+				if (g == NULL)
+					out_of_memory();
+				globals = g;
+			}
+			g = &globals[nr_globals++];
+			g->name = sym->name;
+			g->value = in->base[sym->section] + sym->value;
+			g->in = in;
+		}
+	qsort(globals, nr_globals, sizeof(*globals), global_cmp);
+
+	for (i = 1; i < nr_globals; i++)
+		if (strcmp(globals[i - 1].name, globals[i].name) == 0) {
+			fprintf(stderr, "Error: %s: symbol already defined "
+				"in %s - %s\n", globals[i].in->path,
+				globals[i - 1].in->path, globals[i].name);
+			twice = 1;
+		}
+	if (twice)
+		exit(EXIT_FAILURE);
+}
+
+/**
+ * relocate()
+ *
+ * copy the sections of every object into the image, then store the
+ * address of a symbol at each of their relocations.
+ */
+static void relocate(void)
+{
+	struct obj_section *sec;
+	struct obj_reloc *rel;
+	struct obj_symbol *sym;
+	struct global key, *g;
+	struct object *obj;
+	struct input *in;
+	unsigned int undefined = 0;
+	val_t i, value;
+
+	if ((image = calloc((size_t)image_size + 1, 1)) == NULL)
+		out_of_memory();
+	for (in = inputs; in < inputs + nr_inputs; in++)
+		for (i = 0; i < in->obj->nr_sections; i++) {
+			sec = &in->obj->sections[i];
+			memcpy(image + in->base[i], sec->data, sec->size);
+		}
+
+	for (in = inputs; in < inputs + nr_inputs; in++) {
+		obj = in->obj;
+		for (rel = obj->relocs; rel < obj->relocs + obj->nr_relocs;
+		     rel++) {
+			sym = &obj->symbols[rel->symbol];
+			if (sym->section != OBJ_UNDEF) {
+				value = in->base[sym->section] + sym->value;
+			} else {
+				key.name = sym->name;
+				g = bsearch(&key, globals, nr_globals,
+					    sizeof(*globals), global_cmp);
+				if (g == NULL) {
+					fprintf(stderr, "Error: %s: undefined "
+						"symbol - %s\n", in->path,
+						sym->name);
+					undefined++;
+					continue;
+				}
+				value = g->value;
+			}
+			memcpy(image + in->base[rel->section] + rel->offset,
+			       &value, sizeof(value));
+		}
+	}
+	if (undefined > 0)
+		exit(EXIT_FAILURE);
+}
+
+static void write_image(const char *path)
+{
+	val_t done = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+		goto fail;
+	while (done < image_size) {
+		n = write(fd, image + done, image_size - done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			goto fail;
+		done += n;
+	}
+	if (close(fd) == 0)
+		return;
+fail:
+	perror(path);
+	exit(EXIT_FAILURE);
+}
+
+static int value_cmp(const void *a, const void *b)
+{
+	const struct global *x = a, *y = b;
+
+	if (x->value != y->value)
+		return x->value < y->value ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+/* write the symbols the way Y86asm -m does, for Y86sim -S */
+static void write_map(const char *path, const char *image_path)
+{
+	FILE *out = fopen(path, "w");
+	size_t i;
+
+	if (out == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	qsort(globals, nr_globals, sizeof(*globals), value_cmp);
+	fprintf(out, "# %s\n", image_path);
+	for (i = 0; i < nr_globals; i++)
+		fprintf(out, "0x%08x %s\n", globals[i].value, globals[i].name);
+	if (fclose(out) == EOF) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-o <output>] [-m <map>] <object>...\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *output = "y.out", *map = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:m:")) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'm':
+			map = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+
+	load_objects(argv + optind, argc - optind);
+	lay_out();
+	define_symbols();
+	relocate();
+	write_image(output);
+	if (map != NULL)
+		write_map(map, output);
+	exit(EXIT_SUCCESS);
+}
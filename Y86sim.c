@@ -1,440 +1,1347 @@
-#include "lib/Y86.h"
+#include "lib/machine.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 
-enum stat {
-	S_AOK = 1,
-	S_HLT = 2,
-	S_ADR = 3,
-	S_INS = 4,
-};
-
-static const char *stat_name[] = { NULL, "AOK", "HLT", "ADR", "INS" };
+/**
+ * read_image(path, lenp)
+ *
+ * return the image in @path and store its size in *@lenp,
+ * or NULL with errno set.
+ */
+static byte *read_image(const char *path, size_t *lenp)
+{
+	FILE *input;
+	byte *image = NULL, *p;
+	size_t n, size = 0, image_size = 0;
 
-enum flag {
-	F_OF = 0,
-	F_SF = 1,
-	F_ZF = 2,
-};
+	if ((input = fopen(path, "r")) == NULL)
+		return NULL;
+	do {
+		if (image_size == size) {
+			size = size ? 2 * size : BUFSIZ;
+			if ((p = realloc(image, size)) == NULL) {
+				free(image);
+				fclose(input);
+				return NULL;
+			}
+			image = p;
+		}
+		n = fread(image + image_size, sizeof(byte),
+			  size - image_size, input);
+		image_size += n;
+	} while (n > 0);
+	fclose(input);
+	*lenp = image_size;
+	return image;
+}
 
-#define setCC(cc, o, s, z)			\
-	do {					\
-		cc = ((((o) != 0) << F_OF)	\
-		    | (((s) != 0) << F_SF)	\
-		    | (((z) != 0) << F_ZF));	\
-	} while (0)
+/**
+ * load_file(path, enginename)
+ *
+ * return a machine running engine @enginename with the image in @path
+ * loaded, or NULL with errno set.
+ */
+static struct machine *load_file(const char *path, const char *enginename)
+{
+	struct machine *m;
+	byte *image;
+	size_t len;
 
-#define getCC(cc, o, s, z)			\
-	do {					\
-		o = ((cc >> F_OF) & 1);		\
-		s = ((cc >> F_SF) & 1);		\
-		z = ((cc >> F_ZF) & 1);		\
-	} while (0)
+	if ((image = read_image(path, &len)) == NULL)
+		return NULL;
+	m = machine_create(image, len);
+	free(image);
+	if (m != NULL)
+		machine_set_engine(m, enginename);
+	return m;
+}
 
-#define MAXMEM 4000
+/**
+ * attach_devices(m, input)
+ *
+ * attach the devices to @m, with the console on stdout and the input
+ * read from @input ("-" for stdin, NULL for none).  Return 0 on
+ * success, or -1 with an error printed.
+ */
+static int attach_devices(struct machine *m, const char *input)
+{
+	FILE *in = NULL;
 
-static byte M[MAXMEM], origM[MAXMEM];
-static val_t PC, CC, R[8];
-static unsigned int Step;
-static enum stat Stat;
+	if (input != NULL && strcmp(input, "-") == 0)
+		in = stdin;
+	else if (input != NULL && (in = fopen(input, "r")) == NULL) {
+		perror(input);
+		return -1;
+	}
+	if (machine_set_devices(m, stdout, in)) {
+		perror("devices");
+		return -1;
+	}
+	return 0;
+}
 
-static int cond(ifun_t ifun)
+/**
+ * resume_file(path, enginename)
+ *
+ * return a machine running engine @enginename in the state saved in
+ * checkpoint @path, or NULL with errno set.
+ */
+static struct machine *resume_file(const char *path, const char *enginename)
 {
-	int of, sf, zf;
+	struct snapshot *s;
+	struct machine *m;
+	FILE *input;
 
-	getCC(CC, of, sf, zf);
-	switch (ifun) {
-	case C_LE:
-		return (sf != of) || (zf);
-	case C_L:
-		return sf != of;
-	case C_E:
-		return zf;
-	case C_NE:
-		return !zf;
-	case C_GE:
-		return !(sf != of);
-	case C_G:
-		return !(sf != of) && !zf;
-	default:
-		return 1;
+	if ((input = fopen(path, "r")) == NULL)
+		return NULL;
+	s = snapshot_load(input);
+	fclose(input);
+	if (s == NULL)
+		return NULL;
+	if ((m = machine_create(NULL, 0)) != NULL) {
+		machine_restore(m, s);
+		machine_set_engine(m, enginename);
 	}
+	snapshot_free(s);
+	return m;
 }
 
-static sval_t alu(alu_t alufun, sval_t aluA, sval_t aluB, int set_cc)
+/**
+ * checkpoint(m, path)
+ *
+ * save the state of @m to @path, replacing it atomically.
+ * Return 0 on success, or -1 with an error printed.
+ */
+static int checkpoint(struct machine *m, const char *path)
+{
+	struct snapshot *s;
+	FILE *out;
+	char *tmp;
+	int ret = -1;
+
+	if ((tmp = malloc(strlen(path) + sizeof(".tmp"))) == NULL)
+		return -1;
+	sprintf(tmp, "%s.tmp", path);
+	if ((s = machine_snapshot(m)) == NULL || (out = fopen(tmp, "w")) == NULL)
+		goto out;
+	if (snapshot_save(s, out) | fclose(out))
+		unlink(tmp);
+	else if (rename(tmp, path) == 0)
+		ret = 0;
+out:
+	if (ret)
+		perror(path);
+	if (s != NULL)
+		snapshot_free(s);
+	free(tmp);
+	return ret;
+}
+
+static void print_change(void *arg, val_t addr, val_t orig, val_t now)
+{
+	fprintf(arg, "0x%04x:\t0x%08x\t0x%08x\n", addr, orig, now);
+}
+
+/* print the registers of @m, which started with @eax in %eax */
+static void report_regs(struct machine *m, val_t eax, FILE *out)
 {
 	int zf, sf, of;
-	sval_t aluE;
+	val_t orig;
+
+	getCC(machine_cc(m), of, sf, zf);
+	fprintf(out, "Stopped in %llu steps at PC = 0x%x. ",
+		machine_steps(m), machine_pc(m));
+	fprintf(out, "Status '%s', ", stat_name(machine_stat(m)));
+	fprintf(out, "CC Z=%d, S=%d, O=%d\n", zf, sf, of);
+	fprintf(out, "Changes to registers:\n");
+	for (regid_t r = R_EAX; r <= R_EDI; r++) {
+		orig = r == R_EAX ? eax : 0;
+		if (machine_reg(m, r) != orig)
+			fprintf(out, "%s:\t0x%08x\t0x%08x\n",
+				regid_name(r), orig, machine_reg(m, r));
+	}
+	fputs("\n", out);
+}
+
+/* print the state of @m the way the CS:APP tools do */
+static void report(struct machine *m, FILE *out)
+{
+	report_regs(m, 0, out);
+	fprintf(out, "Changes to memory:\n");
+	machine_changes(m, print_change, out);
+}
+
+/* print the cycle counts of the pipe engine */
+static void report_pipe(struct machine *m, FILE *out)
+{
+	static const char *const causes[NR_PIPE_CAUSES] = {
+		[PIPE_LOAD_USE] = "load/use",
+		[PIPE_MISPREDICT] = "mispredict",
+		[PIPE_RET] = "ret",
+		[PIPE_CACHE] = "cache",
+	};
+	const struct pipe_stats *st = machine_pipe_stats(m);
+	unsigned long long total[NR_PIPE_CAUSES] = { 0 }, n;
+	int c;
+
+	for (int i = 0; i < 256; i++)
+		for (c = 0; c < NR_PIPE_CAUSES; c++)
+			total[c] += st->bubbles[i][c];
+	fprintf(out, "\nPIPE: %llu cycles, %llu instructions, CPI = %.3f\n",
+		st->cycles, st->insns,
+		st->insns ? (double)st->cycles / st->insns : 0.0);
+	fprintf(out, "Bubbles:");
+	for (c = 0; c < NR_PIPE_CAUSES; c++)
+		fprintf(out, " %s %llu", causes[c], total[c]);
+	fprintf(out, "\n\n%-8s%12s", "ins", "count");
+	for (c = 0; c < NR_PIPE_CAUSES; c++)
+		fprintf(out, "%12s", causes[c]);
+	fputs("\n", out);
+	for (int i = 0; i < 256; i++) {
+		n = st->count[i];
+		for (c = 0; c < NR_PIPE_CAUSES; c++)
+			n |= st->bubbles[i][c];
+		if (n == 0)
+			continue;
+		fprintf(out, "%-8s%12llu", ins_name(i) ? ins_name(i) : "(bad)",
+			st->count[i]);
+		for (c = 0; c < NR_PIPE_CAUSES; c++)
+			fprintf(out, "%12llu", st->bubbles[i][c]);
+		fputs("\n", out);
+	}
+}
 
-	switch (alufun) {
-	case A_ADD:
-		aluE = (aluB + aluA);
-		of = (((aluA < 0) == (aluB < 0))
-		   && ((aluE < 0) != (aluA < 0)));
-		break;
-	case A_SUB:
-		aluE = (aluB - aluA);
-		of = (((aluA < 0) != (aluB < 0))
-		   && ((aluE < 0) != (aluA < 0)));
-		break;
-	case A_AND:
-		aluE = (aluB & aluA);
-		of = 0;
-		break;
-	case A_XOR:
-		aluE = (aluB ^ aluA);
-		of = 0;
-		break;
+/**
+ * parse_cache(m, spec)
+ *
+ * add the cache described by @spec to @m:
+ * "{i|d|l2}[:key=value,...]" with keys size, assoc, block,
+ * policy (lru, fifo, random), write (back, through), hit and miss.
+ * Return 0 on success, or -1 with an error printed.
+ */
+static int parse_cache(struct machine *m, char *spec)
+{
+	static const char *const names[NR_CACHES] = {
+		[CACHE_I] = "i", [CACHE_D] = "d", [CACHE_L2] = "l2",
+	};
+	struct cache_config cfg = {
+		.size = 4096, .assoc = 1, .block = 32, .policy = CACHE_LRU,
+		.write_through = 0, .hit_time = 0, .miss_time = 100,
+	};
+	char *name, *key, *value, *end;
+	unsigned long n;
+	int id;
+
+	name = strtok(spec, ":");
+	for (id = 0; id < NR_CACHES; id++)
+		if (name != NULL && strcmp(name, names[id]) == 0)
+			break;
+	if (id == NR_CACHES)
+		goto bad;
+	if (id == CACHE_L2)
+		cfg.hit_time = 10;
+	while ((key = strtok(NULL, ",")) != NULL) {
+		if ((value = strchr(key, '=')) == NULL)
+			goto bad;
+		*value++ = '\0';
+		n = strtoul(value, &end, 0);
+		if (*end == 'k' || *end == 'K')
+			n <<= 10, end++;
+		if (strcmp(key, "policy") == 0) {
+			if (strcmp(value, "lru") == 0)
+				cfg.policy = CACHE_LRU;
+			else if (strcmp(value, "fifo") == 0)
+				cfg.policy = CACHE_FIFO;
+			else if (strcmp(value, "random") == 0)
+				cfg.policy = CACHE_RANDOM;
+			else
+				goto bad;
+		} else if (strcmp(key, "write") == 0) {
+			if (strcmp(value, "back") == 0)
+				cfg.write_through = 0;
+			else if (strcmp(value, "through") == 0)
+				cfg.write_through = 1;
+			else
+				goto bad;
+		} else if (*value == '\0' || *end != '\0') {
+			goto bad;
+		} else if (strcmp(key, "size") == 0) {
+			cfg.size = n;
+		} else if (strcmp(key, "assoc") == 0) {
+			cfg.assoc = n;
+		} else if (strcmp(key, "block") == 0) {
+			cfg.block = n;
+		} else if (strcmp(key, "hit") == 0) {
+			cfg.hit_time = n;
+		} else if (strcmp(key, "miss") == 0) {
+			cfg.miss_time = n;
+		} else {
+			goto bad;
+		}
+	}
+	if (machine_set_cache(m, id, &cfg) == 0)
+		return 0;
+bad:
+	fprintf(stderr, "Bad cache: %s\n", spec);
+	return -1;
+}
+
+/* print the statistics of the caches of @m */
+static void report_caches(struct machine *m, FILE *out)
+{
+	static const char *const names[NR_CACHES] = {
+		[CACHE_I] = "I-cache", [CACHE_D] = "D-cache", [CACHE_L2] = "L2",
+	};
+	const struct cache_stats *st;
+	unsigned long long hits, misses;
+
+	for (int id = 0; id < NR_CACHES; id++) {
+		if ((st = machine_cache_stats(m, id)) == NULL)
+			continue;
+		hits = misses = 0;
+		for (int i = 0; i < NR_CACHE_ACCESSES; i++) {
+			hits += st->hits[i];
+			misses += st->misses[i];
+		}
+		fprintf(out, "%s: %llu accesses, %llu misses (%.2f%%), "
+			"%llu writebacks, %llu cycles\n", names[id],
+			hits + misses, misses,
+			hits + misses ? 100.0 * misses / (hits + misses) : 0.0,
+			st->writebacks, st->cycles);
+		fprintf(out, "  fetch %llu/%llu, read %llu/%llu, "
+			"write %llu/%llu (misses/accesses)\n",
+			st->misses[CACHE_FETCH],
+			st->hits[CACHE_FETCH] + st->misses[CACHE_FETCH],
+			st->misses[CACHE_READ],
+			st->hits[CACHE_READ] + st->misses[CACHE_READ],
+			st->misses[CACHE_WRITE],
+			st->hits[CACHE_WRITE] + st->misses[CACHE_WRITE]);
 	}
+}
+
+/**
+ * parse_predictor(m, spec)
+ *
+ * give @m the branch predictor described by @spec:
+ * "{taken|btfnt|bimodal|gshare}[:key=value,...]" with keys bits
+ * and ras.  Return 0 on success, or -1 with an error printed.
+ */
+static int parse_predictor(struct machine *m, char *spec)
+{
+	static const char *const names[] = {
+		[PREDICT_TAKEN] = "taken", [PREDICT_BTFNT] = "btfnt",
+		[PREDICT_BIMODAL] = "bimodal", [PREDICT_GSHARE] = "gshare",
+	};
+	struct predictor_config cfg = { .bits = 10, .ras_depth = 16 };
+	char *name, *key, *value, *end;
+	unsigned long n;
+
+	name = strtok(spec, ":");
+	for (cfg.kind = 0; cfg.kind <= PREDICT_GSHARE; cfg.kind++)
+		if (name != NULL && strcmp(name, names[cfg.kind]) == 0)
+			break;
+	if (cfg.kind > PREDICT_GSHARE)
+		goto bad;
+	while ((key = strtok(NULL, ",")) != NULL) {
+		if ((value = strchr(key, '=')) == NULL)
+			goto bad;
+		*value++ = '\0';
+		n = strtoul(value, &end, 0);
+		if (*value == '\0' || *end != '\0')
+			goto bad;
+		if (strcmp(key, "bits") == 0)
+			cfg.bits = n;
+		else if (strcmp(key, "ras") == 0)
+			cfg.ras_depth = n;
+		else
+			goto bad;
+	}
+	if (machine_set_predictor(m, &cfg) == 0)
+		return 0;
+bad:
+	fprintf(stderr, "Bad predictor: %s\n", spec);
+	return -1;
+}
+
+static void print_site(void *arg, val_t pc, int is_ret,
+		       unsigned long long count, unsigned long long misses)
+{
+	fprintf(arg, "0x%04x:\t%-4s%12llu%12llu%9.2f%%\n", pc,
+		is_ret ? "ret" : "jXX", count, misses,
+		100.0 * (count - misses) / count);
+}
+
+/* print the accuracy of the branch predictor of @m */
+static void report_predictor(struct machine *m, FILE *out)
+{
+	const struct predictor_stats *st = machine_predictor_stats(m);
+
+	fprintf(out, "Branches: %llu, mispredicted %llu (%.2f%% right)\n",
+		st->branches, st->branch_misses, st->branches
+		? 100.0 * (st->branches - st->branch_misses) / st->branches
+		: 0.0);
+	fprintf(out, "Returns: %llu, mispredicted %llu (%.2f%% right)\n",
+		st->returns, st->return_misses, st->returns
+		? 100.0 * (st->returns - st->return_misses) / st->returns
+		: 0.0);
+	fprintf(out, "%-8s%-4s%12s%12s%10s\n",
+		"pc", "", "count", "misses", "right");
+	machine_predictor_sites(m, print_site, out);
+}
 
-	zf = (aluE == 0);
-	sf = (aluE < 0);
+/*
+ * Symbols and source lines for the profile, read from a map of
+ * Y86asm: "<address> <name>" lines are symbols, "line <address> <size>
+ * <line>" lines say where the bytes at address come from, and other
+ * lines are skipped.
+ */
+struct symbol {
+	val_t addr;
+	char *name;
+};
 
-	if (set_cc)
-		setCC(CC, of, sf, zf);
+struct src_line {
+	val_t addr, size;
+	unsigned int lineno;
+};
 
-	return aluE;
+struct symtab {
+	struct symbol *syms;	/* sorted by address */
+	size_t nr_syms;
+	struct src_line *lines;	/* sorted by address */
+	size_t nr_lines;
+};
+
+static int symbol_cmp(const void *a, const void *b)
+{
+	const struct symbol *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+static int src_line_cmp(const void *a, const void *b)
+{
+	const struct src_line *x = a, *y = b;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
 }
 
-static int memory(val_t addr, int mem_read, int mem_write, val_t *valp) 
+/*
+ * add the "line" record strtok() is in the middle of to @t,
+ * return -1 if there is no room for it.
+ */
+static int read_src_line(struct symtab *t, size_t *cap)
 {
-	if ((mem_read || mem_write) && (addr + sizeof(*valp) > MAXMEM))
+	struct src_line l, *lines;
+	char *field[3], *end;
+
+	for (int i = 0; i < 3; i++) {
+		if ((field[i] = strtok(NULL, " \t\r\n")) == NULL)
+			return 0;
+	}
+	l.addr = strtoul(field[0], &end, 0);
+	if (*end != '\0')
+		return 0;
+	l.size = strtoul(field[1], &end, 0);
+	if (*end != '\0' || l.size == 0)
+		return 0;
+	l.lineno = strtoul(field[2], &end, 0);
+	if (*end != '\0')
+		return 0;
+	if (t->nr_lines == *cap) {
+		*cap = *cap ? 2 * *cap : 64;
+		if ((lines = realloc(t->lines,
+				     *cap * sizeof(*lines))) == NULL)
+			return -1;
+		t->lines = lines;
+	}
+	t->lines[t->nr_lines++] = l;
+	return 0;
+}
+
+/**
+ * read_symbols(path, t)
+ *
+ * add the symbols and source lines of @path to @t.
+ * Return 0 on success, or -1 with an error printed.
+ */
+static int read_symbols(const char *path, struct symtab *t)
+{
+	FILE *input;
+	char *line = NULL, *addr, *name, *end;
+	size_t size = 0, cap = t->nr_syms, lines_cap = t->nr_lines;
+	struct symbol *syms;
+	unsigned long val;
+
+	if ((input = fopen(path, "r")) == NULL) {
+		perror(path);
 		return -1;
+	}
+	while (getline(&line, &size, input) != -1) {
+		addr = strtok(line, " \t\r\n");
+		if (addr != NULL && strcmp(addr, "line") == 0) {
+			if (read_src_line(t, &lines_cap))
+				goto nomem;
+			continue;
+		}
+		name = strtok(NULL, " \t\r\n");
+		if (addr == NULL || name == NULL)
+			continue;
+		val = strtoul(addr, &end, 0);
+		if (*end != '\0' || val > (val_t)-1)
+			continue;
+		if (t->nr_syms == cap) {
+			cap = cap ? 2 * cap : 64;
+			if ((syms = realloc(t->syms,
+					    cap * sizeof(*syms))) == NULL)
+				goto nomem;
+			t->syms = syms;
+		}
+		t->syms[t->nr_syms].addr = val;
+		if ((t->syms[t->nr_syms].name = strdup(name)) == NULL)
+			goto nomem;
+		t->nr_syms++;
+	}
+	free(line);
+	fclose(input);
+	qsort(t->syms, t->nr_syms, sizeof(*t->syms), symbol_cmp);
+	qsort(t->lines, t->nr_lines, sizeof(*t->lines), src_line_cmp);
+	return 0;
+nomem:
+	perror(path);
+	free(line);
+	fclose(input);
+	return -1;
+}
+
+/* return the source line of the bytes at @addr, or 0 */
+static unsigned int line_at(const struct symtab *t, val_t addr)
+{
+	size_t lo = 0, hi = t->nr_lines, mid;
 
-	if (mem_write)
-		*(val_t *)&M[addr] = *valp;
-	if (mem_read)
-		*valp = *(val_t *)&M[addr];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (t->lines[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0 && addr - t->lines[lo - 1].addr < t->lines[lo - 1].size)
+		return t->lines[lo - 1].lineno;
 	return 0;
 }
 
-static void run()
-{
-	val_t valP, mem_addr;
-	ins_t ins;
-	icode_t icode;
-	ifun_t ifun, alufun;
-	reg_t reg;
-	regid_t rA, rB, srcA, srcB, dstE;
-	val_t valA, valB, valC, valE, valM;
-	sval_t aluA, aluB;
-	int Cnd, set_cc, mem_read, mem_write;
-
-	PC = 0;
-	Step = 0;
-	Stat = S_AOK;
-	while (1) {
-		Step++;
-		/* fetch */
-		valP = PC;
-		ins = *(ins_t *)&M[valP];
-		if (ins_name(ins) == NULL) {
-			Stat = S_INS;
-			return;
+/* return the last symbol at or below @addr, or NULL */
+static const struct symbol *symbol_at(const struct symtab *t, val_t addr)
+{
+	size_t lo = 0, hi = t->nr_syms, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (t->syms[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo > 0 ? &t->syms[lo - 1] : NULL;
+}
+
+/* print @addr as "symbol", "symbol+offset" or a bare address */
+static void print_addr(FILE *out, const struct symtab *t, val_t addr)
+{
+	const struct symbol *sym = symbol_at(t, addr);
+
+	if (sym == NULL)
+		fprintf(out, "0x%x", addr);
+	else if (sym->addr == addr)
+		fputs(sym->name, out);
+	else
+		fprintf(out, "%s+0x%x", sym->name, addr - sym->addr);
+}
+
+/* counts gathered from the profile of a machine */
+struct hot {
+	val_t addr;
+	unsigned long long count, total;	/* exclusive, inclusive */
+	unsigned long long seen;		/* last stack counted in */
+	int leader;				/* pc starts a block */
+};
+
+struct hot_list {
+	struct hot *hot;
+	size_t nr, cap;
+	size_t *slots, size;	/* index + 1 of hot_get() entries by addr */
+	unsigned long long stacks;
+};
+
+static struct hot *hot_add(struct hot_list *l, val_t addr)
+{
+	struct hot *hot;
+
+	if (l->nr == l->cap) {
+		l->cap = l->cap ? 2 * l->cap : 64;
+		if ((hot = realloc(l->hot, l->cap * sizeof(*hot))) == NULL) {
+			perror("profile");
+			exit(EXIT_FAILURE);
 		}
-		valP += sizeof(ins);
-		icode = ins_icode(ins);
-		ifun = ins_ifun(ins);
-		if (need_reg(icode)) {
-			reg = *(reg_t *)&M[valP];
-			rA = reg_rA(reg);
-			rB = reg_rB(reg);
-			valP += sizeof(reg);
+		l->hot = hot;
+	}
+	memset(&l->hot[l->nr], 0, sizeof(*l->hot));
+	l->hot[l->nr].addr = addr;
+	return &l->hot[l->nr++];
+}
+
+static size_t hot_slot(const struct hot_list *l, val_t addr)
+{
+	size_t mask = l->size - 1, i = (addr * 2654435761U) & mask;
+
+	while (l->slots[i] != 0 && l->hot[l->slots[i] - 1].addr != addr)
+		i = (i + 1) & mask;
+	return i;
+}
+
+/* return the entry of @addr in @l, added the first time */
+static struct hot *hot_get(struct hot_list *l, val_t addr)
+{
+	size_t i;
+
+	if (2 * (l->nr + 1) > l->size) {
+		free(l->slots);
+		l->size = l->size ? 2 * l->size : 256;
+		if ((l->slots = calloc(l->size, sizeof(*l->slots))) == NULL) {
+			perror("profile");
+			exit(EXIT_FAILURE);
 		}
-		if (need_val(icode)) {
-			valC = *(val_t *)&M[valP];
-			valP += sizeof(valC);
+		for (i = 0; i < l->nr; i++)
+			l->slots[hot_slot(l, l->hot[i].addr)] = i + 1;
+	}
+	i = hot_slot(l, addr);
+	if (l->slots[i] == 0) {
+		hot_add(l, addr);
+		l->slots[i] = l->nr;
+	}
+	return &l->hot[l->slots[i] - 1];
+}
+
+static int hot_cmp(const void *a, const void *b)
+{
+	const struct hot *x = a, *y = b;
+
+	if (x->total != y->total)
+		return x->total > y->total ? -1 : 1;
+	if (x->count != y->count)
+		return x->count > y->count ? -1 : 1;
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static void hot_pc(void *arg, val_t pc, unsigned long long count, int leader)
+{
+	struct hot *h = hot_add(arg, pc);
+
+	h->count = h->total = count;
+	h->leader = leader;
+}
+
+/* functions: count is the exclusive total, total the inclusive one */
+static void hot_stack(void *arg, const val_t *stack, unsigned int depth,
+		      unsigned long long count)
+{
+	struct hot_list *l = arg;
+	struct hot *h = NULL;
+
+	l->stacks++;
+	for (unsigned int i = 0; i < depth; i++) {
+		h = hot_get(l, stack[i]);
+		if (h->seen != l->stacks) {
+			h->seen = l->stacks;
+			h->total += count;
 		}
-		if (icode == I_HALT) {
-			Stat = S_HLT;
-			return;
+	}
+	h->count += count;
+}
+
+#define PROFILE_TOP 20	/* lines of the longer tables */
+
+/**
+ * report_profile(m, t, out)
+ *
+ * print the profile of @m with the symbols of @t: instructions per
+ * symbol, inclusive and exclusive per function, and the hottest basic
+ * blocks and pcs.
+ */
+static void report_profile(struct machine *m, const struct symtab *t,
+			   FILE *out)
+{
+	struct hot_list pcs = { 0 }, blocks = { 0 }, funcs = { 0 };
+	struct hot_list syms = { 0 };
+	const struct symbol *sym;
+	unsigned long long all = 0;
+	unsigned int lineno;
+	size_t i;
+
+	machine_profile_pcs(m, hot_pc, &pcs);
+	for (i = 0; i < pcs.nr; i++) {
+		all += pcs.hot[i].count;
+		/* a block runs until the next leader */
+		if (pcs.hot[i].leader || blocks.nr == 0)
+			hot_add(&blocks, pcs.hot[i].addr)->count =
+				pcs.hot[i].count;
+		blocks.hot[blocks.nr - 1].total += pcs.hot[i].count;
+		sym = symbol_at(t, pcs.hot[i].addr);
+		if (sym == NULL)
+			continue;
+		if (syms.nr == 0 || syms.hot[syms.nr - 1].addr != sym->addr)
+			hot_add(&syms, sym->addr);
+		syms.hot[syms.nr - 1].total += pcs.hot[i].count;
+		syms.hot[syms.nr - 1].count += pcs.hot[i].count;
+	}
+	machine_profile_stacks(m, hot_stack, &funcs);
+
+	fprintf(out, "Profile: %llu instructions\n", all);
+	if (all == 0)
+		goto out;
+	qsort(syms.hot, syms.nr, sizeof(*syms.hot), hot_cmp);
+	qsort(funcs.hot, funcs.nr, sizeof(*funcs.hot), hot_cmp);
+	qsort(blocks.hot, blocks.nr, sizeof(*blocks.hot), hot_cmp);
+	qsort(pcs.hot, pcs.nr, sizeof(*pcs.hot), hot_cmp);
+	if (syms.nr > 0) {
+		fprintf(out, "\n%12s%9s  %s\n", "count", "", "symbol");
+		for (i = 0; i < syms.nr; i++)
+			fprintf(out, "%12llu%8.2f%%  %s\n", syms.hot[i].count,
+				100.0 * syms.hot[i].count / all,
+				symbol_at(t, syms.hot[i].addr)->name);
+	}
+	fprintf(out, "\n%12s%9s%12s%9s  %s\n",
+		"inclusive", "", "exclusive", "", "function");
+	for (i = 0; i < funcs.nr; i++) {
+		fprintf(out, "%12llu%8.2f%%%12llu%8.2f%%  ", funcs.hot[i].total,
+			100.0 * funcs.hot[i].total / all, funcs.hot[i].count,
+			100.0 * funcs.hot[i].count / all);
+		print_addr(out, t, funcs.hot[i].addr);
+		fputs("\n", out);
+	}
+	fprintf(out, "\n%12s%9s%12s  %s\n", "count", "", "runs", "block");
+	for (i = 0; i < blocks.nr && i < PROFILE_TOP; i++) {
+		fprintf(out, "%12llu%8.2f%%%12llu  ", blocks.hot[i].total,
+			100.0 * blocks.hot[i].total / all, blocks.hot[i].count);
+		print_addr(out, t, blocks.hot[i].addr);
+		fputs("\n", out);
+	}
+	fprintf(out, "\n%12s%9s  %s\n", "count", "", "pc");
+	for (i = 0; i < pcs.nr && i < PROFILE_TOP; i++) {
+		fprintf(out, "%12llu%8.2f%%  0x%04x", pcs.hot[i].count,
+			100.0 * pcs.hot[i].count / all, pcs.hot[i].addr);
+		if (t->nr_syms > 0) {
+			fputs("  ", out);
+			print_addr(out, t, pcs.hot[i].addr);
 		}
+		if ((lineno = line_at(t, pcs.hot[i].addr)) != 0)
+			fprintf(out, "  (line %u)", lineno);
+		fputs("\n", out);
+	}
+out:
+	free(pcs.hot);
+	free(blocks.hot);
+	free(funcs.hot);
+	free(funcs.slots);
+	free(syms.hot);
+}
 
-		/* decode */
-		/**
-		 * int srcA = [
-		 * 	icode in { I_RRMOVL, I_IMMOVL, I_OPL, I_PUSHL } : rA;
-		 * 	icode in { I_POPL, I_RET } : R_ESP;
-		 * 	1 : R_NONE;
-		 * ];
-		 */
-		switch(icode) {
-		case I_RRMOVL:
-		case I_RMMOVL:
-		case I_OPL:
-		case I_PUSHL:
-			srcA = rA;
-			break;
-		case I_POPL:
-		case I_RET:
-			srcA = R_ESP;
-			break;
-		default:
-			srcA = R_NONE;
+struct folded {
+	FILE *out;
+	const struct symtab *t;
+};
+
+/* print a stack the way flame graph tools fold them */
+static void print_folded(void *arg, const val_t *stack, unsigned int depth,
+			 unsigned long long count)
+{
+	struct folded *f = arg;
+
+	for (unsigned int i = 0; i < depth; i++) {
+		if (i > 0)
+			fputc(';', f->out);
+		print_addr(f->out, f->t, stack[i]);
+	}
+	fprintf(f->out, " %llu\n", count);
+}
+
+/**
+ * write_folded(m, t, path)
+ *
+ * write the call stacks of the profile of @m to @path, one
+ * "outer;...;inner count" line each.
+ * Return 0 on success, or -1 with an error printed.
+ */
+static int write_folded(struct machine *m, const struct symtab *t,
+			const char *path)
+{
+	struct folded f = { .t = t };
+
+	if ((f.out = fopen(path, "w")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	machine_profile_stacks(m, print_folded, &f);
+	if (fclose(f.out) != 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+static void json_string(FILE *out, const char *str)
+{
+	fputc('"', out);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(out, "\\u%04x", *str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+struct json_list {
+	FILE *out;
+	int first;
+};
+
+static void json_change(void *arg, val_t addr, val_t orig, val_t now)
+{
+	struct json_list *list = arg;
+
+	fprintf(list->out, "%s[%u,%u,%u]", list->first ? "" : ",",
+		addr, orig, now);
+	list->first = 0;
+}
+
+/* print the state of @m as one line of JSON */
+static void report_json(struct machine *m, const char *name, FILE *out)
+{
+	struct json_list mem = { out, 1 };
+	int zf, sf, of, first = 1;
+
+	getCC(machine_cc(m), of, sf, zf);
+	fprintf(out, "{\"image\":");
+	json_string(out, name);
+	fprintf(out, ",\"stat\":\"%s\",\"steps\":%llu,\"pc\":%u",
+		stat_name(machine_stat(m)), machine_steps(m), machine_pc(m));
+	fprintf(out, ",\"cc\":{\"z\":%d,\"s\":%d,\"o\":%d}", zf, sf, of);
+	fprintf(out, ",\"regs\":{");
+	for (regid_t r = R_EAX; r <= R_EDI; r++) {
+		if (machine_reg(m, r) == 0)
+			continue;
+		fprintf(out, "%s\"%s\":%u", first ? "" : ",",
+			regid_name(r), machine_reg(m, r));
+		first = 0;
+	}
+	fprintf(out, "},\"mem\":[");
+	machine_changes(m, json_change, &mem);
+	fprintf(out, "]}\n");
+}
+
+/*
+ * Batch mode.
+ *
+ * Runs every image of a manifest on its own machine, spread over a
+ * pool of threads.  Each worker owns a contiguous range of jobs and
+ * takes them from the front; a worker that runs out steals from the
+ * back of the others.  Results are kept per job and printed in
+ * manifest order once all jobs are done.
+ */
+struct job {
+	char *image;
+	unsigned long long limit;
+	char *result;
+	size_t len;
+	int err;		/* if result could not be kept */
+};
+
+struct worker {
+	pthread_t thread;
+	int started;
+	pthread_mutex_t lock;
+	size_t lo, hi;		/* jobs [lo, hi) are left */
+	struct batch *batch;
+};
+
+struct batch {
+	const char *engine;
+	struct job *jobs;
+	size_t nr_jobs;
+	struct worker *workers;
+	int nr_workers;
+};
+
+/* print the error @err of @image as one line of JSON */
+static void report_error(const char *image, int err, FILE *out)
+{
+	fprintf(out, "{\"image\":");
+	json_string(out, image);
+	fprintf(out, ",\"error\":");
+	json_string(out, strerror(err));
+	fprintf(out, "}\n");
+}
+
+/* run @job, keeping its result, or the error there is no room for it */
+static void run_job(const char *engine, struct job *job)
+{
+	struct machine *m;
+	FILE *out;
+
+	if ((out = open_memstream(&job->result, &job->len)) == NULL) {
+		job->err = errno;
+		return;
+	}
+	if ((m = load_file(job->image, engine)) == NULL) {
+		report_error(job->image, errno, out);
+	} else {
+		machine_run(m, job->limit);
+		report_json(m, job->image, out);
+		machine_destroy(m);
+	}
+	fclose(out);
+}
+
+/* take a job of @w from the front, or NULL */
+static struct job *job_take(struct worker *w)
+{
+	struct job *job = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->lo < w->hi)
+		job = &w->batch->jobs[w->lo++];
+	pthread_mutex_unlock(&w->lock);
+	return job;
+}
+
+/* steal a job of @w from the back, or NULL */
+static struct job *job_steal(struct worker *w)
+{
+	struct job *job = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->lo < w->hi)
+		job = &w->batch->jobs[--w->hi];
+	pthread_mutex_unlock(&w->lock);
+	return job;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct batch *batch = w->batch;
+	struct job *job;
+	int i, self = w - batch->workers;
+
+	for (;;) {
+		if ((job = job_take(w)) == NULL) {
+			for (i = 1; i < batch->nr_workers; i++) {
+				job = job_steal(&batch->workers[
+					(self + i) % batch->nr_workers]);
+				if (job != NULL)
+					break;
+			}
 		}
-		valA = R[srcA];
-
-		/**
-		 * int srcB = [
-		 * 	icode in { I_RMMOVL, I_MRMOVL, I_OPL } : rB;
-		 * 	icode in { I_PUSHL, I_POPL, I_CALL, I_RET } : R_ESP;
-		 * 	1 : R_NONE;
-		 * ];
-		 */
-		switch(icode) {
-		case I_RMMOVL:
-		case I_MRMOVL:
-		case I_OPL:
-			srcB = rB;
-			break;
-		case I_PUSHL:
-		case I_POPL:
-		case I_CALL:
-		case I_RET:
-			srcB = R_ESP;
-			break;
-		default:
-			srcB = R_NONE;
+		/* no job is ever added, so nothing left anywhere means done */
+		if (job == NULL)
+			return NULL;
+		run_job(batch->engine, job);
+	}
+}
+
+/**
+ * read_manifest(path, batch)
+ *
+ * read the jobs of @batch from @path, one "<image> [<step limit>]" per
+ * line; blank lines and lines starting with '#' are skipped.
+ * Return 0 on success, or -1 with an error printed.
+ */
+static int read_manifest(const char *path, struct batch *batch)
+{
+	FILE *input;
+	char *line = NULL, *image, *limit, *end;
+	size_t size = 0, cap = 0;
+	unsigned int lineno = 0;
+	struct job *job;
+
+	if ((input = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (getline(&line, &size, input) != -1) {
+		lineno++;
+		image = strtok(line, " \t\r\n");
+		if (image == NULL || image[0] == '#')
+			continue;
+		if (batch->nr_jobs == cap) {
+			cap = cap ? 2 * cap : 64;
+			if ((job = realloc(batch->jobs,
+					   cap * sizeof(*job))) == NULL)
+				goto nomem;
+			batch->jobs = job;
 		}
-		valB = R[srcB];
-
-		/**
-		 * int dstE = [
-		 * 	icode == I_RRMOVL && Cnd : rB;
-		 * 	icode in { I_IRMOVL, I_OPL } : rB;
-		 * 	icode in { I_PUSHL, I_POPL, I_CALL, I_RET } : R_ESP;
-		 * 	1 : R_NONE;
-		 * ];
-		 */
-		switch(icode) {
-		case I_RRMOVL:
-			Cnd = cond(ifun);
-			dstE = Cnd ? rB : R_NONE;
+		job = &batch->jobs[batch->nr_jobs];
+		memset(job, 0, sizeof(*job));
+		if ((job->image = strdup(image)) == NULL)
+			goto nomem;
+		batch->nr_jobs++;
+		job->limit = MACHINE_FOREVER;
+		if ((limit = strtok(NULL, " \t\r\n")) != NULL) {
+			job->limit = strtoull(limit, &end, 0);
+			if (*end != '\0' || strtok(NULL, " \t\r\n") != NULL) {
+				fprintf(stderr, "%s:%u: bad step limit\n",
+					path, lineno);
+				free(line);
+				fclose(input);
+				return -1;
+			}
+		}
+	}
+	free(line);
+	fclose(input);
+	return 0;
+nomem:
+	perror(path);
+	free(line);
+	fclose(input);
+	return -1;
+}
+
+/**
+ * run_batch(engine, path, nr_workers)
+ *
+ * run the images listed in manifest @path with @nr_workers threads
+ * (0: one per online CPU) and print one JSON result per line,
+ * in manifest order.
+ */
+static int run_batch(const char *engine, const char *path,
+		     int nr_workers)
+{
+	struct batch batch = { .engine = engine };
+	struct worker *w;
+	size_t i;
+	int ret = -1;
+
+	if (read_manifest(path, &batch))
+		goto out;
+	if (nr_workers <= 0)
+		nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_workers <= 0)
+		nr_workers = 1;
+	if (nr_workers > batch.nr_jobs)
+		nr_workers = batch.nr_jobs ? batch.nr_jobs : 1;
+
+	batch.nr_workers = nr_workers;
+	if ((batch.workers = calloc(nr_workers,
+				    sizeof(*batch.workers))) == NULL) {
+		perror("batch");
+		goto out;
+	}
+	for (i = 0; i < nr_workers; i++) {
+		w = &batch.workers[i];
+		pthread_mutex_init(&w->lock, NULL);
+		w->lo = batch.nr_jobs * i / nr_workers;
+		w->hi = batch.nr_jobs * (i + 1) / nr_workers;
+		w->batch = &batch;
+	}
+	/*
+	 * worker 0 is this thread; the jobs of a worker that cannot be
+	 * started are left to be stolen by the others.
+	 */
+	for (i = 1; i < nr_workers; i++)
+		batch.workers[i].started =
+			pthread_create(&batch.workers[i].thread, NULL,
+				       worker_main, &batch.workers[i]) == 0;
+	worker_main(&batch.workers[0]);
+	for (i = 1; i < nr_workers; i++)
+		if (batch.workers[i].started)
+			pthread_join(batch.workers[i].thread, NULL);
+
+	for (i = 0; i < batch.nr_jobs; i++)
+		if (batch.jobs[i].result != NULL)
+			fwrite(batch.jobs[i].result, 1, batch.jobs[i].len,
+			       stdout);
+		else
+			report_error(batch.jobs[i].image, batch.jobs[i].err,
+				     stdout);
+	for (i = 0; i < nr_workers; i++)
+		pthread_mutex_destroy(&batch.workers[i].lock);
+	free(batch.workers);
+	ret = 0;
+out:
+	for (i = 0; i < batch.nr_jobs; i++) {
+		free(batch.jobs[i].result);
+		free(batch.jobs[i].image);
+	}
+	free(batch.jobs);
+	return ret;
+}
+
+/**
+ * run_smp(path, engine, nr_cores, quantum, limit)
+ *
+ * run the image in @path on @nr_cores cores for at most @limit steps
+ * each, then print the state of every core and the changes to memory.
+ * Return 0 on success, or -1 with an error printed.
+ */
+static int run_smp(const char *path, const char *engine,
+		   unsigned int nr_cores, unsigned long long quantum,
+		   unsigned long long limit, int devices, const char *input)
+{
+	struct machine *m;
+	struct smp *s;
+	byte *image;
+	size_t len;
+	unsigned int i;
+
+	if ((image = read_image(path, &len)) == NULL) {
+		perror(path);
+		return -1;
+	}
+	s = smp_create(image, len, nr_cores);
+	free(image);
+	if (s == NULL) {
+		perror(path);
+		return -1;
+	}
+	for (i = 0; i < nr_cores; i++)
+		machine_set_engine(smp_core(s, i), engine);
+	if (devices && attach_devices(smp_core(s, 0), input)) {
+		smp_destroy(s);
+		return -1;
+	}
+	smp_run(s, limit, quantum);
+	for (i = 0; i < nr_cores; i++) {
+		m = smp_core(s, i);
+		printf("Core %u: ", i);
+		report_regs(m, i, stdout);
+		if (strcmp(engine, "pipe") == 0) {
+			report_pipe(m, stdout);
+			fputs("\n", stdout);
+		}
+	}
+	printf("Changes to memory:\n");
+	machine_changes(smp_core(s, 0), print_change, stdout);
+	smp_destroy(s);
+	return 0;
+}
+
+/* checkpoints kept for -u and -w */
+#define HISTORY_DEPTH 64
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-e engine] [-n steps] "
+			"[-s checkpoint [-p period]]\n"
+			"           [-H interval] [-u step | -w addr] "
+			"[-c cache[:key=value,...]]...\n"
+			"           [-P predictor[:key=value,...]]\n"
+			"           [-g] [-F folded] [-S symbols] "
+			"[-d] [-i input]\n"
+			"           {<input> | -r <checkpoint>}\n"
+			"       %s [-e engine] [-j jobs] -b <manifest>\n"
+			"       %s [-e engine] [-n steps] -C cores "
+			"[-q quantum | -T] [-d] [-i input] <input>\n"
+			"Engines:", prog, prog, prog);
+	for (unsigned int i = 0; machine_engine_name(i) != NULL; i++)
+		fprintf(stderr, " %s", machine_engine_name(i));
+	fputs("\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *engine = "seq";
+	const char *manifest = NULL;
+	const char *save = NULL, *resume = NULL;
+	unsigned long long limit = MACHINE_FOREVER, period = 0, steps;
+	unsigned long long interval = 0, back = 0;
+	struct machine *m;
+	unsigned int i;
+	int opt, jobs = 0, reverse = 0;
+	unsigned int cores = 0;
+	unsigned long long quantum = 1;
+	val_t watch = 0;
+	char *caches[NR_CACHES], *predictor = NULL;
+	int nr_caches = 0, profile = 0;
+	const char *folded = NULL, *input = NULL;
+	struct symtab symbols = { 0 };
+	int devices = 0;
+
+	while ((opt = getopt(argc, argv, "e:n:b:j:s:r:p:H:u:w:c:P:S:gF:C:q:Tdi:")) != -1) {
+		switch (opt) {
+		case 'e':
+			for (i = 0; machine_engine_name(i) != NULL; i++)
+				if (strcmp(machine_engine_name(i), optarg) == 0)
+					break;
+			if (machine_engine_name(i) == NULL) {
+				fprintf(stderr, "Unknown engine: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			engine = optarg;
 			break;
-		case I_IRMOVL:
-		case I_OPL:
-			dstE = rB;
+		case 'n':
+			limit = strtoull(optarg, NULL, 0);
 			break;
-		case I_PUSHL:
-		case I_POPL:
-		case I_CALL:
-		case I_RET:
-			dstE = R_ESP;
+		case 'b':
+			manifest = optarg;
 			break;
-		default:
-			dstE = R_NONE;
-		}
-
-		/* execute */
-		/*
-		 * int aluA = [
-		 * 	icode in { I_RRMOVL, I_OPL } : valA;
-		 * 	icode in { I_IRMOVL, I_RMMOVL, I_MRMOVL } : valC;
-		 * 	icode in { I_CALL, I_PUSHL } : -4;
-		 * 	icode in { I_RET, I_POPL } : 4;
-		 * ];
-		 */
-		switch (icode) {
-		case I_RRMOVL:
-		case I_OPL:
-			aluA = valA;
+		case 'j':
+			jobs = atoi(optarg);
 			break;
-		case I_IRMOVL:
-		case I_RMMOVL:
-		case I_MRMOVL:
-			aluA = valC;
+		case 's':
+			save = optarg;
 			break;
-		case I_CALL:
-		case I_PUSHL:
-			aluA = -4;
+		case 'r':
+			resume = optarg;
 			break;
-		case I_RET:
-		case I_POPL:
-			aluA = 4;
+		case 'p':
+			period = strtoull(optarg, NULL, 0);
 			break;
-		default:
-			;
-		}
-
-		/**
-		 * int aluB = [
-		 * 	icode in {I_RRMOVL, I_IRMOVL} : 0;
-		 * 	icode in {I_RMMOVL, I_MRMOVL, I_OPL,
-		 * 		  I_PUSHL, I_POPL, I_CALL, I_RET} : valB;
-		 * ];
-		 */
-		switch (icode) {
-		case I_RRMOVL:
-		case I_IRMOVL:
-			aluB = 0;
+		case 'H':
+			interval = strtoull(optarg, NULL, 0);
 			break;
-		case I_RMMOVL:
-		case I_MRMOVL:
-		case I_OPL:
-		case I_PUSHL:
-		case I_POPL:
-		case I_CALL:
-		case I_RET:
-			aluB = valB;
+		case 'u':
+			back = strtoull(optarg, NULL, 0);
+			reverse = 'u';
 			break;
-		default:
-			;
-		}
-
-		/**
-		 * int alufun = [
-		 * 	icode == I_OPL : ifun;
-		 * 	1 : A_ADD;
-		 * ];
-		 */
-		switch (icode) {
-		case I_OPL:
-			alufun = ifun;
+		case 'w':
+			watch = strtoul(optarg, NULL, 0);
+			reverse = 'w';
 			break;
-		default:
-			alufun = A_ADD;
-		}
-
-		/**
-		 * bool set_cc = icode in { I_OPL };
-		 */
-		set_cc = (icode == I_OPL);
-
-		/* ALU */
-		valE = alu(alufun, aluA, aluB, set_cc);
-
-		/* memory */
-		/**
-		 * int mem_addr = [
-		 * 	icode in { I_RMMOVL, I_PUSHL, I_CALL, I_MRMOVL } : valE;
-		 * 	icode in { I_POPL, I_RET } : valA;
-		 * ];
-		 */
-		switch (icode) {
-		case I_RMMOVL:
-		case I_PUSHL:
-		case I_CALL:
-		case I_MRMOVL:
-			mem_addr = valE;
+		case 'c':
+			if (nr_caches == NR_CACHES)
+				usage(argv[0]);
+			caches[nr_caches++] = optarg;
 			break;
-		case I_POPL:
-		case I_RET:
-			mem_addr = valA;
+		case 'P':
+			predictor = optarg;
 			break;
-		default:
-			;
-		}
-
-		/**
-		 * int mem_read = icode in { I_MRMOVL, I_POPL, I_RET };
-		 */
-		switch (icode) {
-		case I_MRMOVL:
-		case I_POPL:
-		case I_RET:
-			mem_read = 1;
+		case 'S':
+			if (read_symbols(optarg, &symbols))
+				exit(EXIT_FAILURE);
 			break;
-		default:
-			mem_read = 0;
-		}
-
-		/**
-		 * int mem_write = icode in { I_RMMOVL, I_PUSHL, I_CALL };
-		 */
-		switch (icode) {
-		case I_RMMOVL:
-		case I_PUSHL:
-			valM = valA;
-			mem_write = 1;
+		case 'g':
+			profile = 1;
 			break;
-		case I_CALL:
-			valM = valP;
-			mem_write = 1;
+		case 'F':
+			folded = optarg;
 			break;
-		default:
-			mem_write = 0;
-		}
-
-		if (memory(mem_addr, mem_read, mem_write, &valM)) {
-			Stat = S_ADR;
-			return;
-		}
-
-		/* write_back */
-		if (dstE != R_NONE) {
-			R[dstE] = valE;
-		}
-		switch (icode) {
-		case I_MRMOVL:
-		case I_POPL:
-			R[rA] = valM;
+		case 'C':
+			cores = strtoul(optarg, NULL, 0);
+			if (cores == 0)
+				usage(argv[0]);
 			break;
-		default:
-			;
-		}
-
-		/* PC_update */
-		/**
-		 * int new_pc = [
-		 * 	icode == I_CALL : valC;
-		 * 	icode == I_JXX && Cnd : valC;
-		 * 	icode == I_RET : valM;
-		 * 	1 : valP;
-		 * ];
-		 */
-		switch (icode) {
-		case I_CALL:
-			PC = valC;
+		case 'q':
+			quantum = strtoull(optarg, NULL, 0);
+			if (quantum == 0)
+				usage(argv[0]);
+			break;
+		case 'T':
+			quantum = SMP_THREADS;
 			break;
-		case I_JXX:
-			Cnd = cond(ifun);
-			PC = Cnd ? valC : valP;
+		case 'd':
+			devices = 1;
 			break;
-		case I_RET:
-			PC = valM;
+		case 'i':
+			input = optarg;
+			devices = 1;
 			break;
 		default:
-			PC = valP;
+			usage(argv[0]);
 		}
 	}
-}
 
-int main(int argc, char *argv[])
-{
-	FILE *input;
-	int zf, sf, of;
-	size_t n;
-	val_t now, orig;
+	if (cores > 0) {
+		if (optind != argc - 1 || manifest != NULL || save != NULL
+		    || resume != NULL || period || interval != 0 || reverse
+		    || nr_caches || predictor != NULL || profile
+		    || folded != NULL || symbols.nr_syms > 0)
+			usage(argv[0]);
+		exit(run_smp(argv[optind], engine, cores, quantum, limit,
+			     devices, input) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	if (quantum != 1 || (devices && (interval != 0 || reverse)))
+		usage(argv[0]);
+	if (manifest != NULL) {
+		if (optind != argc || save != NULL || resume != NULL || devices
+		    || interval != 0 || reverse || nr_caches
+		    || predictor != NULL || profile || folded != NULL)
+			usage(argv[0]);
+		exit(run_batch(engine, manifest, jobs) ? EXIT_FAILURE
+						       : EXIT_SUCCESS);
+	}
+	if (optind != argc - (resume == NULL) || (period && save == NULL))
+		usage(argv[0]);
 
-	if (argc < 2 || argc > 3) {
-		fprintf(stderr, "Usage: %s <input>\n", argv[0]);
+	if (resume != NULL)
+		m = resume_file(resume, engine);
+	else
+		m = load_file(argv[optind], engine);
+	if (m == NULL) {
+		perror(resume != NULL ? resume : argv[optind]);
 		exit(EXIT_FAILURE);
 	}
-
-	input = fopen(argv[1], "r");
-	n = fread(M, sizeof(byte), MAXMEM, input);
-	memcpy(origM, M, n);
-	fclose(input);
-
-	run();
-
-	getCC(CC, of, sf, zf);
-	printf("Stopped in %u steps at PC = 0x%x. ", Step, PC);
-	printf("Status '%s', ", stat_name[Stat]);
-	printf("CC Z=%d, S=%d, O=%d\n", zf, sf, of);
-	printf("Changes to registers:\n");
-	for (int i = 0; i < 8; i++)
-		if (R[i] != 0)
-			printf("%s:\t0x%08x\t0x%08x\n", regid_name(i), 0, R[i]);
-	puts("");
-	printf("Changes to memory:\n");
-	for (int i = 0; i < MAXMEM; i += sizeof(val_t)) {
-		now = *(val_t *)&M[i];
-		orig = *(val_t *)&origM[i];
-		if (now != orig) {
-			printf("0x%04x:\t0x%08x\t0x%08x\n", i, orig, now);
-		}
+	for (i = 0; i < nr_caches; i++)
+		if (parse_cache(m, caches[i]))
+			exit(EXIT_FAILURE);
+	if (predictor != NULL && parse_predictor(m, predictor))
+		exit(EXIT_FAILURE);
+	if ((profile || folded != NULL) && machine_set_profile(m, 1)) {
+		perror("profile");
+		exit(EXIT_FAILURE);
+	}
+	if (devices && attach_devices(m, input))
+		exit(EXIT_FAILURE);
+	if (reverse && interval == 0)
+		interval = 1 << 20;
+	if (interval != 0 && machine_record(m, interval, HISTORY_DEPTH)) {
+		perror("history");
+		exit(EXIT_FAILURE);
 	}
+	/* with -p, stop every @period steps to save a checkpoint */
+	while (limit > 0) {
+		steps = period && period < limit ? period : limit;
+		if (machine_run(m, steps) != S_AOK || (limit -= steps) == 0)
+			break;
+		if (save != NULL && checkpoint(m, save))
+			exit(EXIT_FAILURE);
+	}
+	if (reverse == 'u' && machine_reverse(m, back))
+		fprintf(stderr, "Step %llu is out of history [%llu, %llu]\n",
+			back, machine_history(m), machine_steps(m));
+	if (reverse == 'w' && machine_reverse_write(m, watch, sizeof(val_t)))
+		fprintf(stderr, "No write to 0x%x since step %llu\n",
+			watch, machine_history(m));
+	if (save != NULL && checkpoint(m, save))
+		exit(EXIT_FAILURE);
+	report(m, stdout);
+	if (nr_caches > 0) {
+		fputs("\n", stdout);
+		report_caches(m, stdout);
+	}
+	if (predictor != NULL) {
+		fputs("\n", stdout);
+		report_predictor(m, stdout);
+	}
+	if (profile) {
+		fputs("\n", stdout);
+		report_profile(m, &symbols, stdout);
+	}
+	if (folded != NULL && write_folded(m, &symbols, folded))
+		exit(EXIT_FAILURE);
+	if (strcmp(engine, "pipe") == 0)
+		report_pipe(m, stdout);
+	machine_destroy(m);
 	exit(EXIT_SUCCESS);
 }
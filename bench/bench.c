@@ -0,0 +1,271 @@
+#include "../lib/machine.h"
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Time Y86asm on every source given, then every engine of the
+ * simulator on the image it made.  Each measure is repeated after one
+ * run to warm up, and printed as one line with its median, mean and
+ * coefficient of variation:
+ *
+ *	<kind> <workload> <engine> <unit> <median> <mean> <cv%> <runs> <detail>
+ *
+ * The lines come in a fixed order and only the numbers move between
+ * runs, so results of two versions can be diffed.  The details (lines
+ * of a source, steps and final status of a run) must not change at all.
+ */
+#define FORMAT_VERSION 1
+
+struct stats {
+	double median, mean, cv;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* summarize the @n samples of @x, sorting them */
+static void summarize(double *x, unsigned int n, struct stats *s)
+{
+	double sum = 0, var = 0;
+	unsigned int i;
+
+	qsort(x, n, sizeof(*x), double_cmp);
+	for (i = 0; i < n; i++)
+		sum += x[i];
+	s->mean = sum / n;
+	s->median = n % 2 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+	for (i = 0; i < n; i++)
+		var += (x[i] - s->mean) * (x[i] - s->mean);
+	s->cv = n > 1 && s->mean > 0
+		? 100 * sqrt(var / (n - 1)) / s->mean : 0;
+}
+
+static void print_stats(const char *kind, const char *workload,
+			const char *engine, const char *unit,
+			const struct stats *s, unsigned int runs,
+			const char *detail)
+{
+	printf("%-4s %-12s %-9s %-8s %14.0f %14.0f %6.2f%% %3u %s\n",
+	       kind, workload, engine, unit, s->median, s->mean, s->cv,
+	       runs, detail);
+	fflush(stdout);
+}
+
+/* run @as on @src, writing @out, return its wall time or -1 */
+static double assemble(const char *as, const char *src, const char *out)
+{
+	double start = now();
+	pid_t pid;
+	int status;
+
+	if ((pid = fork()) == -1)
+		return -1;
+	if (pid == 0) {
+		execl(as, as, src, out, (char *)NULL);
+		perror(as);
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			return -1;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1;
+	return now() - start;
+}
+
+/* return the contents of @path, and store its size in *@sizep, or NULL */
+static byte *read_file(const char *path, size_t *sizep)
+{
+	byte *buf = NULL, *p;
+	size_t size = 0, cap = 0, n;
+	FILE *in;
+
+	if ((in = fopen(path, "rb")) == NULL)
+		return NULL;
+	do {
+		if (size == cap) {
+			cap = cap ? 2 * cap : 1 << 16;
+			if ((p = realloc(buf, cap)) == NULL) {
+				free(buf);
+				fclose(in);
+				return NULL;
+			}
+			buf = p;
+		}
+		n = fread(buf + size, 1, cap - size, in);
+		size += n;
+	} while (n > 0);
+	fclose(in);
+	*sizep = size;
+	return buf;
+}
+
+static unsigned long count_lines(const byte *buf, size_t size)
+{
+	unsigned long lines = 0;
+	const byte *p = buf, *end = buf + size;
+
+	while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+		lines++;
+		p++;
+	}
+	return size > 0 && buf[size - 1] != '\n' ? lines + 1 : lines;
+}
+
+/**
+ * bench_asm(as, src, out, name, runs)
+ *
+ * time assembling @src into @out, return -1 if it fails.
+ */
+static int bench_asm(const char *as, const char *src, const char *out,
+		     const char *name, unsigned int runs)
+{
+	double samples[runs], t;
+	unsigned long lines;
+	struct stats s;
+	char detail[64];
+	size_t size;
+	byte *buf;
+	unsigned int i;
+
+	if ((buf = read_file(src, &size)) == NULL) {
+		perror(src);
+		return -1;
+	}
+	lines = count_lines(buf, size);
+	free(buf);
+
+	for (i = 0; i <= runs; i++) {
+		if ((t = assemble(as, src, out)) < 0) {
+			fprintf(stderr, "%s: cannot assemble %s\n", as, src);
+			return -1;
+		}
+		if (i > 0)
+			samples[i - 1] = lines / t;
+	}
+	summarize(samples, runs, &s);
+	snprintf(detail, sizeof(detail), "lines=%lu", lines);
+	print_stats("asm", name, "-", "lines/s", &s, runs, detail);
+	return 0;
+}
+
+/**
+ * bench_sim(image, len, name, engine, runs)
+ *
+ * time running @image on @engine to the end, return -1 if there is no
+ * such engine here.
+ */
+static int bench_sim(const byte *image, size_t len, const char *name,
+		     const char *engine, unsigned int runs)
+{
+	double samples[runs], start, t;
+	unsigned long long steps = 0;
+	enum stat stat = S_AOK;
+	struct machine *m;
+	struct stats s;
+	char detail[64];
+	unsigned int i;
+
+	for (i = 0; i <= runs; i++) {
+		if ((m = machine_create(image, len)) == NULL)
+			return -1;
+		if (machine_set_engine(m, engine) != 0) {
+			machine_destroy(m);
+			return -1;
+		}
+		start = now();
+		stat = machine_run(m, MACHINE_FOREVER);
+		t = now() - start;
+		steps = machine_steps(m);
+		machine_destroy(m);
+		if (i > 0)
+			samples[i - 1] = steps / t;
+	}
+	summarize(samples, runs, &s);
+	snprintf(detail, sizeof(detail), "steps=%llu stat=%s", steps,
+		 stat_name(stat));
+	print_stats("sim", name, engine, "insns/s", &s, runs, detail);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-a <Y86asm>] [-r <runs>] [-e <engine>] "
+			"<source>...\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *as = "./Y86asm", *engine = NULL, *src, *name, *e;
+	unsigned int i, runs = 5;
+	char *out;
+	size_t len;
+	byte *image;
+	int opt, failed = 0;
+
+	while ((opt = getopt(argc, argv, "a:r:e:")) != -1) {
+		switch (opt) {
+		case 'a':
+			as = optarg;
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'e':
+			engine = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc || runs == 0)
+		usage(argv[0]);
+
+	printf("# Y86 bench %d: kind workload engine unit "
+	       "median mean cv runs detail\n", FORMAT_VERSION);
+	for (; optind < argc; optind++) {
+		src = argv[optind];
+		name = strrchr(src, '/') ? strrchr(src, '/') + 1 : src;
+		len = strlen(src);
+		if ((out = malloc(len + 4)) == NULL) {
+			perror(src);
+			return EXIT_FAILURE;
+		}
+		strcpy(out, src);
+		if (len > 3 && strcmp(out + len - 3, ".ys") == 0)
+			out[len - 3] = '\0';
+		strcat(out, ".yo");
+
+		if (bench_asm(as, src, out, name, runs) != 0
+		    || (image = read_file(out, &len)) == NULL) {
+			failed = 1;
+			free(out);
+			continue;
+		}
+		for (i = 0; (e = machine_engine_name(i)) != NULL; i++)
+			if (engine == NULL || strcmp(engine, e) == 0)
+				bench_sim(image, len, name, e, runs);
+		free(image);
+		free(out);
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
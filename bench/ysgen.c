@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Write a synthetic Y86 source of about the given number of lines to
+ * stdout, the same one for the same seed.  It has every kind of line
+ * the assembler knows: labels, comments, instructions with registers,
+ * constants, memory operands and symbols, and data.  It also runs and
+ * halts: jumps only go forward, memory is only written at Scratch, past
+ * the code, and pushes are popped right away.
+ */
+
+static unsigned long long state;
+
+/* xorshift64* */
+static unsigned int rnd(unsigned int n)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return (state * 2685821657736338717ULL >> 32) % n;
+}
+
+static const char *regs[] = {	/* %esp and %ebp are kept */
+	"%eax", "%ecx", "%edx", "%ebx", "%esi", "%edi",
+};
+
+static const char *ops[] = { "addl", "subl", "andl", "xorl" };
+static const char *jumps[] = {
+	"jmp", "jle", "jl", "je", "jne", "jge", "jg",
+};
+static const char *moves[] = {
+	"rrmovl", "cmovle", "cmovl", "cmove", "cmovne", "cmovge", "cmovg",
+};
+
+#define REG regs[rnd(6)]
+
+static unsigned int label, max_ref;	/* last label defined, referred */
+
+static unsigned int forward(void)
+{
+	unsigned int to = label + 1 + rnd(16);
+
+	if (to > max_ref)
+		max_ref = to;
+	return to;
+}
+
+static void instruction(void)
+{
+	switch (rnd(16)) {
+	case 0:
+	case 1:
+		printf("\tirmovl $%d,%s\n", (int)rnd(2001) - 1000, REG);
+		break;
+	case 2:
+		printf("\tirmovl 0x%x,%s\n", rnd(1 << 16), REG);
+		break;
+	case 3:
+		printf("\tirmovl L%u,%s\n", rnd(label + 1), REG);
+		break;
+	case 4:
+		printf("\t%s %s,%s\n", moves[rnd(7)], REG, REG);
+		break;
+	case 5:
+	case 6:
+	case 7:
+		printf("\t%s %s,%s\n", ops[rnd(4)], REG, REG);
+		break;
+	case 8:
+		printf("\trmmovl %s,%u(%%ebp)\n", REG, 4 * rnd(1024));
+		break;
+	case 9:
+	case 10:
+		printf("\tmrmovl %u(%%ebp),%s\n", 4 * rnd(1024), REG);
+		break;
+	case 11:
+		printf("\t%s L%u\n", jumps[rnd(7)], forward());
+		break;
+	case 12:
+		printf("\tpushl %s\n\tpopl %s\n", REG, REG);
+		break;
+	case 13:
+		printf("\tcall Leaf\n");
+		break;
+	case 14:
+		printf("\tnop\n");
+		break;
+	default:
+		printf("\t%s %s,%s\t# %u\n", ops[rnd(4)], REG, REG, rnd(1000));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long lines, i;
+	int opt;
+
+	state = 88172645463325252ULL;
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		if (opt != 's')
+			goto usage;
+		state += strtoull(optarg, NULL, 0);
+	}
+	if (argc - optind != 1)
+		goto usage;
+	lines = strtoul(argv[optind], NULL, 0);
+
+	printf("# generated by ysgen %lu\n\t.pos 0\n", lines);
+	/* the stack grows down from the end of Scratch */
+	printf("\tirmovl Scratch,%%ebp\n\tirmovl $0x2000,%%esp\n"
+	       "\taddl %%ebp,%%esp\n");
+	printf("L0:\n");
+	for (i = 0; i < lines; i++) {
+		if (rnd(8) == 0) {
+			printf("L%u:", ++label);
+			if (rnd(2) == 0) {
+				putchar('\n');
+				continue;
+			}
+		}
+		if (rnd(32) == 0)
+			printf(rnd(2) ? "\n" : "\t# block %u\n", label);
+		else
+			instruction();
+	}
+	while (label < max_ref)
+		printf("L%u:\n", ++label);
+	printf("\thalt\nLeaf:\tret\n\n\t.align 4\nTable:\n");
+	for (i = 0; i < 64; i++)
+		printf("\t.long L%u\n", rnd(label + 1));
+	printf("\t.align 0x1000\nScratch:\n");
+	return 0;
+usage:
+	fprintf(stderr, "Usage: %s [-s <seed>] <lines>\n", argv[0]);
+	return 1;
+}
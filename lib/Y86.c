@@ -1,4 +1,5 @@
 #include "Y86.h"
+#include "Y86tab.h"
 #include <string.h>
 
 struct ins_dict {
@@ -7,56 +8,65 @@ struct ins_dict {
 };
 
 static const struct ins_dict Y86_INS_DICT[] = {
-	{"halt",   pack_ins(I_HALT, C_ALL)  },
-	{"nop",    pack_ins(I_NOP, C_ALL)   },
-	{"rrmovl", pack_ins(I_RRMOVL, C_ALL)},
-	{"cmovle", pack_ins(I_RRMOVL, C_LE) },
-	{"cmovl",  pack_ins(I_RRMOVL, C_L)  },
-	{"cmove",  pack_ins(I_RRMOVL, C_E)  },
-	{"cmovne", pack_ins(I_RRMOVL, C_NE) },
-	{"cmovge", pack_ins(I_RRMOVL, C_GE) },
-	{"cmovg",  pack_ins(I_RRMOVL, C_G)  },
-	{"irmovl", pack_ins(I_IRMOVL, C_ALL)},
-	{"rmmovl", pack_ins(I_RMMOVL, C_ALL)},
-	{"mrmovl", pack_ins(I_MRMOVL, C_ALL)},
-	{"addl",   pack_ins(I_OPL, A_ADD)   },
-	{"subl",   pack_ins(I_OPL, A_SUB)   },
-	{"andl",   pack_ins(I_OPL, A_AND)   },
-	{"xorl",   pack_ins(I_OPL, A_XOR)   },
-	{"jmp",    pack_ins(I_JXX, C_ALL)   },
-	{"jle",    pack_ins(I_JXX, C_LE)    },
-	{"jl",     pack_ins(I_JXX, C_L)     },
-	{"je",     pack_ins(I_JXX, C_E)     },
-	{"jne",    pack_ins(I_JXX, C_NE)    },
-	{"jge",    pack_ins(I_JXX, C_GE)    },
-	{"jg",     pack_ins(I_JXX, C_G)     },
-	{"call",   pack_ins(I_CALL, C_ALL)  },
-	{"ret",    pack_ins(I_RET, C_ALL)   },
-	{"pushl",  pack_ins(I_PUSHL, C_ALL) },
-	{"popl",   pack_ins(I_POPL, C_ALL)  },
-	{NULL,     pack_ins(I_ERR, C_ERR)   },
+#define INS(name, icode, ifun) {name, pack_ins(icode, ifun)},
+#include "Y86.def"
 };
 
-ins_t parse_ins(const char *str)
+/* instructions by ins byte, len is 0 if the byte is none */
+struct ins_info {
+	const char *str;
+	byte len;
+};
+
+enum {
+#define ICODE(icode, reg, val) \
+	LEN_##icode = sizeof(ins_t) + (reg) * sizeof(reg_t) \
+		      + (val) * sizeof(val_t),
+#include "Y86.def"
+};
+
+static const struct ins_info Y86_INS_INFO[256] = {
+#define INS(name, icode, ifun) [pack_ins(icode, ifun)] = {name, LEN_##icode},
+#include "Y86.def"
+};
+
+static const byte Y86_NEED_REG[16] = {
+#define ICODE(icode, reg, val) [icode] = reg,
+#include "Y86.def"
+};
+
+static const byte Y86_NEED_VAL[16] = {
+#define ICODE(icode, reg, val) [icode] = val,
+#include "Y86.def"
+};
+
+/* like parse_ins(), for the @len characters at @str */
+ins_t parse_ins_n(const char *str, size_t len)
 {
-	const struct ins_dict *ptr;
+	int i = Y86_INS_HASH[str_hash(str, len, Y86_INS_HASH_SEED)
+			     & (Y86_INS_HASH_SIZE - 1)];
 
-	for (ptr = Y86_INS_DICT; ptr->str != NULL; ptr++)
-		if (strcmp(ptr->str, str) == 0)
-			break;
+	if (i < 0 || strlen(Y86_INS_DICT[i].str) != len
+	    || memcmp(Y86_INS_DICT[i].str, str, len) != 0)
+		return pack_ins(I_ERR, C_ERR);
 
-	return ptr->ins;
+	return Y86_INS_DICT[i].ins;
 }
 
-const char *ins_name(ins_t ins)
+ins_t parse_ins(const char *str)
 {
-	const struct ins_dict *ptr;
+	return parse_ins_n(str, strlen(str));
+}
 
-	for (ptr = Y86_INS_DICT; ptr->str != NULL; ptr++)
-		if (ptr->ins == ins)
-			return ptr->str;
+const char *ins_name(ins_t ins)
+{
+	return Y86_INS_INFO[ins].str;
+}
 
-	return NULL;
+/* return the length of instructions starting with @ins, 0 if invalid */
+int ins_len(ins_t ins)
+{
+	return Y86_INS_INFO[ins].len;
 }
 
 struct regid_dict {
@@ -65,65 +75,44 @@ struct regid_dict {
 };
 
 static const struct regid_dict Y86_REGID_DICT[] = {
-	{"%eax", R_EAX},
-	{"%ecx", R_ECX},
-	{"%edx", R_EDX},
-	{"%ebx", R_EBX},
-	{"%esp", R_ESP},
-	{"%ebp", R_EBP},
-	{"%esi", R_ESI},
-	{"%edi", R_EDI},
-	{NULL,   R_ERR},
+#define REG(name, regid) {name, regid},
+#include "Y86.def"
 };
 
-regid_t parse_regid(const char *str)
+static const char *const Y86_REGID_NAME[16] = {
+#define REG(name, regid) [regid] = name,
+#include "Y86.def"
+};
+
+/* like parse_regid(), for the @len characters at @str */
+regid_t parse_regid_n(const char *str, size_t len)
 {
-	const struct regid_dict *ptr;
+	int i = Y86_REGID_HASH[str_hash(str, len, Y86_REGID_HASH_SEED)
+			       & (Y86_REGID_HASH_SIZE - 1)];
 
-	for (ptr = Y86_REGID_DICT; ptr->str != NULL; ptr++)
-		if (strcmp(ptr->str, str) == 0)
-			break;
+	if (i < 0 || strlen(Y86_REGID_DICT[i].str) != len
+	    || memcmp(Y86_REGID_DICT[i].str, str, len) != 0)
+		return R_ERR;
 
-	return ptr->regid;
+	return Y86_REGID_DICT[i].regid;
 }
 
-const char *regid_name(regid_t regid)
+regid_t parse_regid(const char *str)
 {
-	const struct regid_dict *ptr;
-
-	for (ptr = Y86_REGID_DICT; ptr->str != NULL; ptr++)
-		if (ptr->regid == regid)
-			return ptr->str;
+	return parse_regid_n(str, strlen(str));
+}
 
-	return NULL;
+const char *regid_name(regid_t regid)
+{
+	return Y86_REGID_NAME[regid & 0xF];
 }
 
 int need_reg(icode_t icode)
 {
-	switch (icode) {
-	case I_RRMOVL:
-	case I_IRMOVL:
-	case I_RMMOVL:
-	case I_MRMOVL:
-	case I_OPL:
-	case I_PUSHL:
-	case I_POPL:
-		return 1;
-	default:
-		return 0;
-	}
+	return Y86_NEED_REG[icode & 0xF];
 }
 
 int need_val(icode_t icode)
 {
-	switch (icode) {
-	case I_IRMOVL:
-	case I_RMMOVL:
-	case I_MRMOVL:
-	case I_JXX:
-	case I_CALL:
-		return 1;
-	default:
-		return 0;
-	}
+	return Y86_NEED_VAL[icode & 0xF];
 }
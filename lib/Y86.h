@@ -1,6 +1,8 @@
 #ifndef _Y86ASM_
 #define _Y86ASM_
 
+#include <stddef.h>
+
 typedef int sval_t;
 typedef unsigned int val_t;
 typedef unsigned char reg_t;
@@ -33,6 +35,7 @@ typedef enum icode {
 	I_RET		= 0x9,
 	I_PUSHL		= 0xA,
 	I_POPL		= 0xB,
+	I_XCHGL		= 0xC,
 	I_ERR		= 0xE,
 } icode_t;
 
@@ -66,11 +69,27 @@ typedef enum ifun {
 #define reg_rA(reg) unpack_h(reg)
 #define reg_rB(reg) unpack_l(reg)
 
+/*
+ * FNV-1a of the @len characters at @str, starting from @seed.  The high
+ * bits are folded into the low ones, which alone depend on nothing but
+ * the low bits of the characters and of @seed.
+ */
+static inline unsigned int str_hash(const char *str, size_t len,
+				    unsigned int seed)
+{
+	while (len-- > 0)
+		seed = (seed ^ (unsigned char)*str++) * 16777619U;
+	return seed ^ (seed >> 16);
+}
+
 extern regid_t parse_regid(const char *str);
+extern regid_t parse_regid_n(const char *str, size_t len);
 extern const char *regid_name(regid_t regid);
 
 extern ins_t parse_ins(const char *str);
+extern ins_t parse_ins_n(const char *str, size_t len);
 extern const char *ins_name(ins_t ins);
+extern int ins_len(ins_t ins);
 
 extern int need_val(icode_t icode);
 extern int need_reg(icode_t icode);
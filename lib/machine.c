@@ -0,0 +1,4416 @@
+#include "machine.h"
+#include "list.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+#define JIT
+#include <stdint.h>
+#include <sys/mman.h>
+#endif
+
+static const char *stat_names[] = { NULL, "AOK", "HLT", "ADR", "INS" };
+
+/*
+ * Guest memory.
+ *
+ * The whole 32-bit address space is backed by a two-level page table
+ * whose pages are allocated on first write; absent pages read as
+ * zeros.  A page holding code also carries its part of the code_map
+ * (see fetch()).
+ *
+ * The contents of a page live in a reference-counted page_data that
+ * snapshots and forked machines share copy-on-write.  A page is
+ * writable once it owns its data alone and its original contents are
+ * kept for machine_changes(); the first store to any other page goes
+ * through page_own().
+ */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define TABLE_SHIFT 10
+#define TABLE_SIZE (1 << TABLE_SHIFT)
+#define DIR_SHIFT (PAGE_SHIFT + TABLE_SHIFT)
+#define DIR_SIZE (1 << (32 - DIR_SHIFT))
+
+struct page_data {
+	byte bytes[PAGE_SIZE];
+	atomic_uint refs;
+};
+
+struct page {
+	struct page_data *data;
+	struct page_data *orig;	/* data before the first store, or NULL */
+	byte *code;		/* code_map of the page, or NULL */
+	byte writable;		/* orig is kept and data is not shared */
+	val_t base;
+	struct list_head dirty;	/* on memory.dirty if orig is kept */
+};
+
+/*
+ * The pages of a machine, or of all the cores of an smp.  Cores look
+ * pages up without a lock while others may insert new ones, so tables
+ * and pages are published with release stores and found with acquire
+ * loads, and the pages of an smp are always writable: their data never
+ * changes under a core that found them.  Inserting takes the lock.
+ */
+struct memory {
+	struct page **dir[DIR_SIZE];
+	size_t nr_pages;
+	struct list_head dirty;	/* pages with a non-NULL orig */
+	size_t nr_dirty;
+	struct smp *smp;	/* sharing it, or NULL */
+	pthread_mutex_t lock;	/* held to insert pages or code maps of an smp */
+	int devices;		/* see machine_set_devices() */
+	FILE *dev_out, *dev_in;
+};
+
+/* cores sharing a memory, see smp_create() */
+struct smp {
+	struct machine **cores;
+	unsigned int nr_cores;
+	int threads;		/* the cores run on threads of their own */
+};
+
+/*
+ * Predecoded instruction cache.
+ *
+ * Everything the SEQ fetch and decode stages derive from the bytes at
+ * PC (register ids, constant, next PC and the control signals of the
+ * datapath) depends only on those bytes, so it is computed once per
+ * address and cached in a direct-mapped table keyed by PC.  A store
+ * into a cached instruction invalidates its entry.
+ */
+#define DCACHE_SIZE 4096	/* power of 2 */
+#define MAXINSLEN (sizeof(ins_t) + sizeof(reg_t) + sizeof(val_t))
+
+/* one handler per valid opcode/ifun pair */
+enum op {
+	OP_HALT, OP_NOP,
+	OP_RRMOVL, OP_CMOVLE, OP_CMOVL, OP_CMOVE, OP_CMOVNE, OP_CMOVGE, OP_CMOVG,
+	OP_IRMOVL, OP_RMMOVL, OP_MRMOVL,
+	OP_ADDL, OP_SUBL, OP_ANDL, OP_XORL,
+	OP_JMP, OP_JLE, OP_JL, OP_JE, OP_JNE, OP_JGE, OP_JG,
+	OP_CALL, OP_RET, OP_PUSHL, OP_POPL, OP_XCHGL,
+	NR_OPS,
+};
+
+/* op = op_base[icode] + ifun */
+static const byte op_base[] = {
+	OP_HALT, OP_NOP, OP_RRMOVL, OP_IRMOVL, OP_RMMOVL, OP_MRMOVL,
+	OP_ADDL, OP_JMP, OP_CALL, OP_RET, OP_PUSHL, OP_POPL, OP_XCHGL,
+};
+
+struct decoded {
+	const void *handler;	/* set by run_threaded(), NULL if !valid */
+	val_t pc;		/* tag */
+	val_t valC;
+	val_t valP;
+	val_t aluK;		/* constant aluA: valC, -4 or 4 */
+	byte valid;
+	byte len;		/* valP - pc */
+	byte op;
+	ins_t ins;
+	reg_t rA, rB;
+	reg_t srcA, srcB, dstE, dstM;
+	byte alufun;
+	byte set_cc;
+	byte mem_read, mem_write;
+	byte aluA_valA;		/* aluA = valA instead of aluK */
+	byte aluB_valB;		/* aluB = valB instead of 0 */
+	byte addr_valA;		/* mem_addr = valA instead of valE */
+	byte data_valP;		/* written value is valP instead of valA */
+};
+
+/*
+ * Basic-block translation cache.
+ *
+ * A block is a run of instructions ending at jXX, call, ret or halt,
+ * translated into an array of micro-ops that always ends with a
+ * control transfer (OP_CHAIN falls through to the next block when the
+ * block was cut short).  Blocks remember their successors, so only
+ * ret and cold edges go through the hash table.  A store into a block
+ * invalidates it.  Blocks and micro-ops live in arenas that are
+ * flushed when full.
+ */
+#define OP_CHAIN NR_OPS
+#define MAXBLOCKLEN 64
+#define MAXBLOCKS 4096
+#define MAXUOPS (MAXBLOCKS * 16)
+#define BLOCK_HASH 4096
+
+struct uop {
+	const void *handler;	/* set by run_block() */
+	byte op;
+	reg_t rA, rB;
+	val_t pc;
+	val_t valC;
+	val_t valP;
+};
+
+struct block {
+	val_t pc, end;		/* guest range [pc, end) */
+	unsigned int n;		/* number of instructions */
+	int valid;
+	struct uop *uops;
+	struct block *next[2];	/* successors: not taken, taken */
+	struct block *hash_next;
+	unsigned int count;	/* times entered by the interpreter */
+	void *native;		/* compiled code, see jit_compile() */
+};
+
+#ifdef JIT
+struct jit_frame;
+#endif
+
+/*
+ * Cache, branch predictor and profile models, see step_model().
+ */
+struct cache_line {
+	val_t block;		/* address >> block_shift */
+	byte valid, dirty;
+	unsigned long long stamp;	/* last use (LRU) or fill (FIFO) */
+};
+
+struct cache {
+	struct cache_config cfg;
+	unsigned int block_shift;
+	unsigned int nr_sets;
+	unsigned long long clock;
+	unsigned int seed;	/* CACHE_RANDOM */
+	struct cache_stats stats;
+	struct cache_line lines[];	/* nr_sets * cfg.assoc */
+};
+
+enum outcome {
+	PREDICT_NONE,		/* not predicted */
+	PREDICT_HIT,
+	PREDICT_MISS,
+};
+
+/* counters of one pc, in a table with open addressing on pc */
+struct site {
+	val_t pc;
+	byte used;
+	byte is_ret;		/* predictor: a ret, else a jXX */
+	byte leader;		/* profile: starts a basic block */
+	unsigned long long count, misses;
+};
+
+struct site_table {
+	struct site *sites;
+	size_t nr_sites, size;
+};
+
+struct predictor {
+	struct predictor_config cfg;
+	struct predictor_stats stats;
+	enum outcome outcome;	/* of the last step */
+	val_t history;		/* PREDICT_GSHARE */
+	val_t *ras;		/* circular, ras_top entries pushed */
+	unsigned long long ras_top;
+	struct site_table sites;
+	byte counters[];	/* 2-bit, 1 << cfg.bits of them */
+};
+
+#define PROFILE_DEPTH 1024	/* deeper calls are not told apart */
+
+/* a function called through a chain of calls, see profile_step() */
+struct call_node {
+	val_t pc;			/* entry of the function */
+	unsigned long long self;	/* instructions executed in it */
+	struct call_node *parent, *child, *next;	/* next: sibling */
+};
+
+struct profile {
+	struct site_table pcs;
+	int leader;		/* the next instruction starts a block */
+	struct call_node root, *node;
+	unsigned int depth;	/* of node, root is 0 */
+	unsigned int lost;	/* calls pending past PROFILE_DEPTH */
+};
+
+/*
+ * PIPE timing model, see run_pipe().
+ */
+enum pipe_kind {
+	P_EMPTY = 0,	/* nothing yet, or drained */
+	P_INSN,		/* an instruction of the program */
+	P_WRONG,	/* fetched after a mispredicted jXX, never retires */
+	P_BUBBLE,	/* an inserted bubble */
+};
+
+struct pipe_reg {
+	byte kind;
+	ins_t ins;		/* P_BUBBLE: ins that caused it */
+	reg_t srcA, srcB, dstM;
+	byte cause;		/* P_BUBBLE: enum pipe_cause */
+	byte mispredicted;	/* jXX that went the other way */
+	byte predicted;		/* ret whose address was predicted */
+	byte last;		/* the machine stops after it */
+};
+
+struct pipe {
+	struct pipe_reg D, E, M, W;
+	int wrong;		/* fetching down a mispredicted path */
+	int stopping;		/* the last instruction has been fetched */
+	struct pipe_stats stats;
+};
+
+/*
+ * Reverse execution.
+ *
+ * While recording, machine_run() takes a checkpoint (a snapshot) every
+ * ckpt_interval steps, which costs little more than the pages copied
+ * on write afterwards.  Going back to an earlier step restores the
+ * last checkpoint before it and replays the steps in between through
+ * step_undo(), which logs what each step overwrites, so that going
+ * further back in the same interval just applies the log backwards.
+ * When all checkpoints are in use, every other one is dropped and the
+ * interval doubles, so the whole run stays reachable.
+ */
+#define UNDO_MAX (1 << 20)	/* undo records kept */
+
+#define UNDO_CC		0x1	/* cc is valid */
+#define UNDO_MEM	0x2	/* addr and mem are valid */
+
+struct undo {
+	val_t PC;
+	val_t val[2];		/* old values of registers reg[] */
+	val_t addr, mem;	/* old word at addr */
+	regid_t reg[2];		/* R_NONE if unused */
+	byte cc;
+	byte flags;
+};
+
+/*
+ * The state of one machine.  Nothing lives outside of it, so several
+ * machines may run at the same time in different threads.
+ */
+struct machine {
+	val_t PC, CC, R[16];	/* decode() lets only R[0..7] change */
+	unsigned long long Step;
+	unsigned long long limit;	/* stop with S_AOK after limit steps */
+	enum stat Stat;
+	void (*run)(struct machine *m);	/* the engine */
+
+	/* lazy condition codes, see getcc() */
+	int cc_op;
+	sval_t cc_aluA, cc_aluB, cc_aluE;
+
+	struct memory *mem;
+	struct page ***page_dir;	/* mem->dir */
+
+	struct pipe pipe;
+
+	struct cache *caches[NR_CACHES];
+	struct predictor *predictor;
+	struct profile *profile;
+	int nr_models;		/* caches, predictor and profile */
+	unsigned long long cache_stall;	/* cycles not yet accounted for */
+
+	/* reverse execution, see machine_record() */
+	struct snapshot **ckpts;	/* oldest first */
+	unsigned int nr_ckpts, max_ckpts;
+	unsigned long long ckpt_interval;
+	struct undo *undo;	/* undo[i] reverts step undo_step + i + 1 */
+	size_t nr_undo;
+	unsigned long long undo_step;
+
+	struct decoded dcache[DCACHE_SIZE];
+
+	struct block blocks[MAXBLOCKS], *block_hash[BLOCK_HASH];
+	struct uop uops[MAXUOPS];
+	unsigned int nr_blocks, nr_uops;
+	unsigned int block_flushes;	/* bumped by block_flush() */
+	int block_dirty;		/* some block was invalidated */
+
+#ifdef JIT
+	byte *jit_base, *jit_ptr;	/* block code area, see jit_init() */
+	int jit_full;			/* flush before compiling again */
+	void (*jit_enter)(struct jit_frame *frame, void *code);
+	byte *jit_leave;		/* common epilogue */
+#endif
+};
+
+static inline struct page *page_find(struct machine *m, val_t addr)
+{
+	struct page **table;
+
+	table = __atomic_load_n(&m->page_dir[addr >> DIR_SHIFT],
+				__ATOMIC_ACQUIRE);
+	if (table == NULL)
+		return NULL;
+	return __atomic_load_n(&table[(addr >> PAGE_SHIFT) & (TABLE_SIZE - 1)],
+			       __ATOMIC_ACQUIRE);
+}
+
+static void mem_lock(struct machine *m)
+{
+	if (m->mem->smp != NULL)
+		pthread_mutex_lock(&m->mem->lock);
+}
+
+static void mem_unlock(struct machine *m)
+{
+	if (m->mem->smp != NULL)
+		pthread_mutex_unlock(&m->mem->lock);
+}
+
+/* a zero-filled page_data with one reference, or NULL */
+static struct page_data *data_alloc()
+{
+	struct page_data *data = calloc(1, sizeof(*data));
+
+	if (data != NULL)
+		atomic_init(&data->refs, 1);
+	return data;
+}
+
+static struct page_data *data_get(struct page_data *data)
+{
+	if (data != NULL)
+		atomic_fetch_add(&data->refs, 1);
+	return data;
+}
+
+static void data_put(struct page_data *data)
+{
+	if (data != NULL && atomic_fetch_sub(&data->refs, 1) == 1)
+		free(data);
+}
+
+/* the table slot of @addr, allocating the table if absent, or NULL */
+static struct page **page_slot(struct machine *m, val_t addr)
+{
+	struct page ***tablep = &m->page_dir[addr >> DIR_SHIFT];
+	struct page **table;
+
+	if (*tablep == NULL) {
+		if ((table = calloc(TABLE_SIZE, sizeof(*table))) == NULL)
+			return NULL;
+		__atomic_store_n(tablep, table, __ATOMIC_RELEASE);
+	}
+	return &(*tablep)[(addr >> PAGE_SHIFT) & (TABLE_SIZE - 1)];
+}
+
+/*
+ * enter a page at @base holding @data (not referenced), writable with
+ * zeros for original contents if @own; return NULL if out of memory,
+ * with @data left to the caller
+ */
+static struct page *page_insert(struct machine *m, val_t base,
+				struct page_data *data, int own)
+{
+	struct page **slot = page_slot(m, base);
+	struct page *p;
+
+	if (slot == NULL || (p = calloc(1, sizeof(*p))) == NULL)
+		return NULL;
+	if (own && (p->orig = data_alloc()) == NULL) {
+		free(p);
+		return NULL;
+	}
+	p->data = data;
+	p->base = base;
+	INIT_LIST_HEAD(&p->dirty);
+	if (own) {
+		p->writable = 1;
+		list_add(&p->dirty, &m->mem->dirty);
+		m->mem->nr_dirty++;
+	}
+	__atomic_store_n(slot, p, __ATOMIC_RELEASE);
+	m->mem->nr_pages++;
+	return p;
+}
+
+/* drop page @p from the table and free it */
+static void page_remove(struct machine *m, struct page *p)
+{
+	*page_slot(m, p->base) = NULL;
+	if (p->orig != NULL) {
+		list_del(&p->dirty);
+		m->mem->nr_dirty--;
+	}
+	data_put(p->data);
+	data_put(p->orig);
+	free(p->code);
+	free(p);
+	m->mem->nr_pages--;
+}
+
+/* find the page of @addr, allocating it if absent, or NULL */
+static struct page *page_get(struct machine *m, val_t addr)
+{
+	struct page *p = page_find(m, addr);
+	struct page_data *data;
+
+	if (p != NULL)
+		return p;
+	mem_lock(m);
+	if ((p = page_find(m, addr)) == NULL
+	    && (data = data_alloc()) != NULL
+	    && (p = page_insert(m, addr & ~PAGE_MASK, data,
+				m->mem->smp != NULL)) == NULL)
+		data_put(data);
+	mem_unlock(m);
+	return p;
+}
+
+/*
+ * make @p writable: keep its current data as the original contents if
+ * this is its first store, and copy the data if it is shared.  Return
+ * -1 if out of memory.
+ */
+static int page_own(struct machine *m, struct page *p)
+{
+	struct page_data *copy;
+
+	if (p->orig == NULL) {
+		p->orig = data_get(p->data);
+		list_add(&p->dirty, &m->mem->dirty);
+		m->mem->nr_dirty++;
+	}
+	if (atomic_load(&p->data->refs) > 1) {
+		if ((copy = malloc(sizeof(*copy))) == NULL)
+			return -1;
+		memcpy(copy->bytes, p->data->bytes, PAGE_SIZE);
+		atomic_init(&copy->refs, 1);
+		data_put(p->data);
+		p->data = copy;
+	}
+	p->writable = 1;
+	return 0;
+}
+
+/* find the page of @addr for a store, or NULL if out of memory */
+static inline struct page *page_store(struct machine *m, val_t addr)
+{
+	struct page *p = page_get(m, addr);
+
+	if (p != NULL && !p->writable && page_own(m, p))
+		return NULL;
+	return p;
+}
+
+static byte mem_byte(struct machine *m, val_t addr)
+{
+	struct page *p = page_find(m, addr);
+
+	return p == NULL ? 0 : p->data->bytes[addr & PAGE_MASK];
+}
+
+/* copy @len bytes from @buf to guest memory at @addr, -1 if no memory */
+static int load(struct machine *m, val_t addr, const byte *buf, size_t len)
+{
+	struct page *p;
+	size_t n;
+
+	for (; len > 0; addr += n, buf += n, len -= n) {
+		n = PAGE_SIZE - (addr & PAGE_MASK);
+		if (n > len)
+			n = len;
+		if ((p = page_get(m, addr)) == NULL)
+			return -1;
+		memcpy(&p->data->bytes[addr & PAGE_MASK], buf, n);
+	}
+	return 0;
+}
+
+static int cc_cond(val_t cc, ifun_t ifun)
+{
+	int of, sf, zf;
+
+	getCC(cc, of, sf, zf);
+	switch (ifun) {
+	case C_LE:
+		return (sf != of) || (zf);
+	case C_L:
+		return sf != of;
+	case C_E:
+		return zf;
+	case C_NE:
+		return !zf;
+	case C_GE:
+		return !(sf != of);
+	case C_G:
+		return !(sf != of) && !zf;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Lazy condition codes.
+ *
+ * Most flags set by OPl are overwritten before anything reads them,
+ * so alu() only records the operation, its operands and its result;
+ * the flags are worked out when cond() or the final report needs them.
+ * CC holds the flags while cc_op is CC_NONE.
+ */
+#define CC_NONE (-1)
+
+/**
+ * getcc(m)
+ *
+ * return the packed flags of the last OPl.
+ */
+static val_t getcc(struct machine *m)
+{
+	int zf, sf, of;
+
+	if (m->cc_op == CC_NONE)
+		return m->CC;
+
+	switch (m->cc_op) {
+	case A_ADD:
+		of = (((m->cc_aluA < 0) == (m->cc_aluB < 0))
+		   && ((m->cc_aluE < 0) != (m->cc_aluA < 0)));
+		break;
+	case A_SUB:
+		of = (((m->cc_aluA < 0) != (m->cc_aluB < 0))
+		   && ((m->cc_aluE < 0) != (m->cc_aluA < 0)));
+		break;
+	default:
+		of = 0;
+	}
+
+	zf = (m->cc_aluE == 0);
+	sf = (m->cc_aluE < 0);
+
+	setCC(m->CC, of, sf, zf);
+	m->cc_op = CC_NONE;
+	return m->CC;
+}
+
+static void setcc(struct machine *m, val_t cc)
+{
+	m->CC = cc;
+	m->cc_op = CC_NONE;
+}
+
+static inline int cond(struct machine *m, ifun_t ifun)
+{
+	if (m->cc_op != CC_NONE) {
+		/* conditions that need neither OF nor an earlier OPl */
+		switch (ifun) {
+		case C_ALL:
+			return 1;
+		case C_E:
+			return m->cc_aluE == 0;
+		case C_NE:
+			return m->cc_aluE != 0;
+		case C_L:
+			if (m->cc_op == A_AND || m->cc_op == A_XOR)
+				return m->cc_aluE < 0;
+			break;
+		case C_GE:
+			if (m->cc_op == A_AND || m->cc_op == A_XOR)
+				return m->cc_aluE >= 0;
+			break;
+		default:
+			;
+		}
+	}
+	return cc_cond(getcc(m), ifun);
+}
+
+static inline sval_t alu(struct machine *m, alu_t alufun,
+			 sval_t aluA, sval_t aluB, int set_cc)
+{
+	sval_t aluE;
+
+	switch (alufun) {
+	default:	/* decode() gives no other function */
+	case A_ADD:
+		aluE = (aluB + aluA);
+		break;
+	case A_SUB:
+		aluE = (aluB - aluA);
+		break;
+	case A_AND:
+		aluE = (aluB & aluA);
+		break;
+	case A_XOR:
+		aluE = (aluB ^ aluA);
+		break;
+	}
+
+	if (set_cc) {
+		m->cc_op = alufun;
+		m->cc_aluA = aluA;
+		m->cc_aluB = aluB;
+		m->cc_aluE = aluE;
+	}
+
+	return aluE;
+}
+
+/* whether [@addr, @addr + @len) touches the device page, if attached */
+static inline int is_device(struct machine *m, val_t addr, size_t len)
+{
+	return (unsigned long long)addr + len > DEV_BASE && m->mem->devices;
+}
+
+/*
+ * The code_map marks the bytes some cached translation was built from
+ * (dcache entries and blocks); stores there go through smc().  Marks
+ * of dropped entries may linger, which only costs a needless check.
+ * Marking returns -1 if out of memory.
+ */
+static int code_mark(struct machine *m, val_t addr, val_t len)
+{
+	struct page *p;
+	byte *code;
+
+	for (; len > 0; addr++, len--) {
+		if ((p = page_get(m, addr)) == NULL)
+			return -1;
+		if (__atomic_load_n(&p->code, __ATOMIC_ACQUIRE) == NULL) {
+			mem_lock(m);
+			if (p->code == NULL
+			    && (code = calloc(PAGE_SIZE, sizeof(byte))) != NULL)
+				__atomic_store_n(&p->code, code,
+						 __ATOMIC_RELEASE);
+			mem_unlock(m);
+			if (p->code == NULL)
+				return -1;
+		}
+		p->code[addr & PAGE_MASK] = 1;
+	}
+	return 0;
+}
+
+static void code_clear(struct machine *m, val_t addr, val_t len)
+{
+	struct page *p;
+
+	for (; len > 0; addr++, len--)
+		if ((p = page_find(m, addr)) != NULL && p->code != NULL)
+			p->code[addr & PAGE_MASK] = 0;
+}
+
+static int is_code(struct machine *m, val_t addr, val_t len)
+{
+	struct page *p;
+
+	for (; len > 0; addr++, len--)
+		if ((p = page_find(m, addr)) != NULL && p->code != NULL
+		    && p->code[addr & PAGE_MASK])
+			return 1;
+	return 0;
+}
+
+/**
+ * decode(m, pc, d)
+ *
+ * @pc: address of the instruction.
+ * @d: record to fill.
+ *
+ * run the fetch and decode logic of SEQ on the instruction at @pc,
+ * return 0 on success, or the status the machine stops with.
+ */
+static enum stat decode(struct machine *m, val_t pc, struct decoded *d)
+{
+	icode_t icode;
+	ifun_t ifun;
+	reg_t reg;
+	val_t valP = pc, len;
+	int i;
+
+	/* fetch */
+	d->ins = mem_byte(m, valP);
+	if ((len = ins_len(d->ins)) == 0)
+		return S_INS;
+	valP += sizeof(ins_t);
+	icode = ins_icode(d->ins);
+	ifun = ins_ifun(d->ins);
+	d->rA = d->rB = R_NONE;
+	d->valC = 0;
+	if (pc > (val_t)-len)	/* wraps around the address space */
+		return S_ADR;
+	if (is_device(m, pc, len))
+		return S_ADR;
+	if (need_reg(icode)) {
+		reg = mem_byte(m, valP);
+		d->rA = reg_rA(reg);
+		d->rB = reg_rB(reg);
+		valP += sizeof(reg);
+	}
+	if (need_val(icode)) {
+		for (i = sizeof(val_t); i-- > 0; )
+			d->valC = (d->valC << 8) | mem_byte(m, valP + i);
+		valP += sizeof(val_t);
+	}
+	d->handler = NULL;
+	d->op = op_base[icode] + ifun;
+	d->pc = pc;
+	d->valP = valP;
+	d->len = valP - pc;
+
+	/* decode */
+	/**
+	 * int srcA = [
+	 * 	icode in { I_RRMOVL, I_IMMOVL, I_OPL, I_PUSHL, I_XCHGL } : rA;
+	 * 	icode in { I_POPL, I_RET } : R_ESP;
+	 * 	1 : R_NONE;
+	 * ];
+	 */
+	switch(icode) {
+	case I_RRMOVL:
+	case I_RMMOVL:
+	case I_OPL:
+	case I_PUSHL:
+	case I_XCHGL:
+		d->srcA = d->rA;
+		break;
+	case I_POPL:
+	case I_RET:
+		d->srcA = R_ESP;
+		break;
+	default:
+		d->srcA = R_NONE;
+	}
+
+	/**
+	 * int srcB = [
+	 * 	icode in { I_RMMOVL, I_MRMOVL, I_OPL, I_XCHGL } : rB;
+	 * 	icode in { I_PUSHL, I_POPL, I_CALL, I_RET } : R_ESP;
+	 * 	1 : R_NONE;
+	 * ];
+	 */
+	switch(icode) {
+	case I_RMMOVL:
+	case I_MRMOVL:
+	case I_OPL:
+	case I_XCHGL:
+		d->srcB = d->rB;
+		break;
+	case I_PUSHL:
+	case I_POPL:
+	case I_CALL:
+	case I_RET:
+		d->srcB = R_ESP;
+		break;
+	default:
+		d->srcB = R_NONE;
+	}
+
+	/**
+	 * int dstE = [
+	 * 	icode == I_RRMOVL && Cnd : rB;
+	 * 	icode in { I_IRMOVL, I_OPL } : rB;
+	 * 	icode in { I_PUSHL, I_POPL, I_CALL, I_RET } : R_ESP;
+	 * 	1 : R_NONE;
+	 * ];
+	 *
+	 * Cnd is only known at run time, run() drops dstE of rrmovl.
+	 */
+	switch(icode) {
+	case I_RRMOVL:
+	case I_IRMOVL:
+	case I_OPL:
+		d->dstE = d->rB;
+		break;
+	case I_PUSHL:
+	case I_POPL:
+	case I_CALL:
+	case I_RET:
+		d->dstE = R_ESP;
+		break;
+	default:
+		d->dstE = R_NONE;
+	}
+
+	/**
+	 * int dstM = icode in { I_MRMOVL, I_POPL, I_XCHGL } : rA;
+	 */
+	switch (icode) {
+	case I_MRMOVL:
+	case I_POPL:
+	case I_XCHGL:
+		d->dstM = d->rA;
+		break;
+	default:
+		d->dstM = R_NONE;
+	}
+
+	/*
+	 * The register fields an instruction uses must name one of the
+	 * eight registers: R_NONE there would be read as a register and
+	 * written as none, and the engines only keep the eight.
+	 */
+	switch (icode) {
+	case I_RRMOVL:
+	case I_RMMOVL:
+	case I_MRMOVL:
+	case I_OPL:
+	case I_XCHGL:
+		if (d->rA > R_EDI || d->rB > R_EDI)
+			return S_INS;
+		break;
+	case I_IRMOVL:
+		if (d->rB > R_EDI)
+			return S_INS;
+		break;
+	case I_PUSHL:
+	case I_POPL:
+		if (d->rA > R_EDI)
+			return S_INS;
+		break;
+	default:
+		break;
+	}
+
+	/* execute */
+	/*
+	 * int aluA = [
+	 * 	icode in { I_RRMOVL, I_OPL } : valA;
+	 * 	icode in { I_IRMOVL, I_RMMOVL, I_MRMOVL, I_XCHGL } : valC;
+	 * 	icode in { I_CALL, I_PUSHL } : -4;
+	 * 	icode in { I_RET, I_POPL } : 4;
+	 * ];
+	 */
+	d->aluA_valA = 0;
+	switch (icode) {
+	case I_RRMOVL:
+	case I_OPL:
+		d->aluA_valA = 1;
+		d->aluK = 0;
+		break;
+	case I_IRMOVL:
+	case I_RMMOVL:
+	case I_MRMOVL:
+	case I_XCHGL:
+		d->aluK = d->valC;
+		break;
+	case I_CALL:
+	case I_PUSHL:
+		d->aluK = -4;
+		break;
+	case I_RET:
+	case I_POPL:
+		d->aluK = 4;
+		break;
+	default:
+		d->aluK = 0;
+	}
+
+	/**
+	 * int aluB = [
+	 * 	icode in {I_RRMOVL, I_IRMOVL} : 0;
+	 * 	icode in {I_RMMOVL, I_MRMOVL, I_OPL,
+	 * 		  I_PUSHL, I_POPL, I_CALL, I_RET, I_XCHGL} : valB;
+	 * ];
+	 */
+	switch (icode) {
+	case I_RMMOVL:
+	case I_MRMOVL:
+	case I_OPL:
+	case I_XCHGL:
+	case I_PUSHL:
+	case I_POPL:
+	case I_CALL:
+	case I_RET:
+		d->aluB_valB = 1;
+		break;
+	default:
+		d->aluB_valB = 0;
+	}
+
+	/**
+	 * int alufun = [
+	 * 	icode == I_OPL : ifun;
+	 * 	1 : A_ADD;
+	 * ];
+	 */
+	switch (icode) {
+	case I_OPL:
+		d->alufun = ifun;
+		break;
+	default:
+		d->alufun = A_ADD;
+	}
+
+	/**
+	 * bool set_cc = icode in { I_OPL };
+	 */
+	d->set_cc = (icode == I_OPL);
+
+	/* memory */
+	/**
+	 * int mem_addr = [
+	 * 	icode in { I_RMMOVL, I_PUSHL, I_CALL, I_MRMOVL, I_XCHGL } : valE;
+	 * 	icode in { I_POPL, I_RET } : valA;
+	 * ];
+	 */
+	switch (icode) {
+	case I_POPL:
+	case I_RET:
+		d->addr_valA = 1;
+		break;
+	default:
+		d->addr_valA = 0;
+	}
+
+	/**
+	 * int mem_read = icode in { I_MRMOVL, I_POPL, I_RET, I_XCHGL };
+	 */
+	switch (icode) {
+	case I_MRMOVL:
+	case I_POPL:
+	case I_RET:
+	case I_XCHGL:
+		d->mem_read = 1;
+		break;
+	default:
+		d->mem_read = 0;
+	}
+
+	/**
+	 * int mem_write = icode in { I_RMMOVL, I_PUSHL, I_CALL, I_XCHGL };
+	 *
+	 * xchgl reads the old word and writes valA in one atomic access,
+	 * see exchange().
+	 */
+	d->data_valP = 0;
+	switch (icode) {
+	case I_RMMOVL:
+	case I_PUSHL:
+	case I_XCHGL:
+		d->mem_write = 1;
+		break;
+	case I_CALL:
+		d->data_valP = 1;
+		d->mem_write = 1;
+		break;
+	default:
+		d->mem_write = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * fetch(m, pc, statp)
+ *
+ * return the decoded instruction at @pc, decoding it on a cache miss,
+ * or NULL with *@statp set if it cannot be fetched.
+ */
+static struct decoded *fetch(struct machine *m, val_t pc, enum stat *statp)
+{
+	struct decoded *d = &m->dcache[pc & (DCACHE_SIZE - 1)];
+	enum stat stat;
+
+	if (d->valid && d->pc == pc)
+		return d;
+
+	d->valid = 0;
+	d->handler = NULL;
+	if ((stat = decode(m, pc, d)) != 0) {
+		*statp = stat;
+		return NULL;
+	}
+	if (code_mark(m, pc, d->len)) {
+		*statp = S_ADR;		/* out of memory */
+		return NULL;
+	}
+	d->valid = 1;
+	return d;
+}
+
+/**
+ * dcache_invalidate(m, addr, len)
+ *
+ * drop the cached instructions overlapping [@addr, @addr + @len).
+ */
+static void dcache_invalidate(struct machine *m, val_t addr, val_t len)
+{
+	struct decoded *d;
+	unsigned long long pc;
+
+	pc = addr < MAXINSLEN ? 0 : addr - (MAXINSLEN - 1);
+	for (; pc < (unsigned long long)addr + len; pc++) {
+		d = &m->dcache[pc & (DCACHE_SIZE - 1)];
+		if (d->valid && d->pc == pc && d->valP > addr) {
+			d->valid = 0;
+			d->handler = NULL;
+		}
+	}
+}
+
+#define block_hashfn(pc) ((pc) & (BLOCK_HASH - 1))
+
+static void block_flush(struct machine *m)
+{
+	m->nr_blocks = 0;
+	m->nr_uops = 0;
+	memset(m->block_hash, 0, sizeof(m->block_hash));
+	m->block_flushes++;
+#ifdef JIT
+	m->jit_ptr = m->jit_base;
+	m->jit_full = 0;
+#endif
+}
+
+static struct block *block_lookup(struct machine *m, val_t pc)
+{
+	struct block *b;
+
+	for (b = m->block_hash[block_hashfn(pc)]; b != NULL; b = b->hash_next)
+		if (b->pc == pc)
+			return b;
+	return NULL;
+}
+
+/**
+ * translate(m, pc, statp)
+ *
+ * @pc: address of the first instruction of the block.
+ * @statp: where to store the status if nothing can be fetched at @pc.
+ *
+ * translate the block starting at @pc and enter it in the cache.
+ */
+static struct block *translate(struct machine *m, val_t pc, enum stat *statp)
+{
+	struct block *b;
+	struct decoded *d;
+	struct uop *u;
+	enum stat stat;
+	val_t end = pc;
+	icode_t icode;
+
+	if (m->nr_blocks == MAXBLOCKS || m->nr_uops + MAXBLOCKLEN + 1 > MAXUOPS)
+		block_flush(m);
+#ifdef JIT
+	if (m->jit_full)
+		block_flush(m);
+#endif
+
+	b = &m->blocks[m->nr_blocks];
+	b->pc = pc;
+	b->n = 0;
+	b->uops = u = &m->uops[m->nr_uops];
+	do {
+		if ((d = fetch(m, end, &stat)) == NULL) {
+			if (b->n == 0) {
+				*statp = stat;
+				return NULL;
+			}
+			/* let the next block report the fault */
+			break;
+		}
+		u->handler = NULL;
+		u->op = d->op;
+		u->rA = d->rA;
+		u->rB = d->rB;
+		u->pc = end;
+		u->valC = d->valC;
+		u->valP = d->valP;
+		u++;
+		b->n++;
+		end = d->valP;
+		icode = ins_icode(d->ins);
+	} while (icode != I_JXX && icode != I_CALL && icode != I_RET
+		 && icode != I_HALT && b->n < MAXBLOCKLEN);
+
+	if (icode != I_JXX && icode != I_CALL && icode != I_RET
+	    && icode != I_HALT) {
+		u->handler = NULL;
+		u->op = OP_CHAIN;
+		u->pc = u->valP = end;
+		u++;
+	}
+
+	b->end = end;
+	b->valid = 1;
+	b->next[0] = b->next[1] = NULL;
+	b->count = 0;
+	b->native = NULL;
+	b->hash_next = m->block_hash[block_hashfn(pc)];
+	m->block_hash[block_hashfn(pc)] = b;
+	m->nr_blocks++;
+	m->nr_uops = u - m->uops;
+	return b;
+}
+
+/**
+ * block_invalidate(m, addr, len)
+ *
+ * drop the blocks overlapping [@addr, @addr + @len).
+ */
+static void block_invalidate(struct machine *m, val_t addr, val_t len)
+{
+	struct block *b, **pp;
+	unsigned int i;
+
+	for (i = 0; i < m->nr_blocks; i++) {
+		b = &m->blocks[i];
+		if (!b->valid || b->end <= addr
+		    || b->pc >= (unsigned long long)addr + len)
+			continue;
+		b->valid = 0;
+		for (pp = &m->block_hash[block_hashfn(b->pc)]; *pp != b;
+		     pp = &(*pp)->hash_next)
+			;
+		*pp = b->hash_next;
+		m->block_dirty = 1;
+	}
+}
+
+/**
+ * smc(m, addr, len)
+ *
+ * drop every translation of the code in [@addr, @addr + @len),
+ * which has just been overwritten.  The cores of an smp drop theirs
+ * too, unless they run on threads of their own: then only @m does, and
+ * the code maps keep their marks for the others.
+ */
+static void smc(struct machine *m, val_t addr, val_t len)
+{
+	struct smp *s = m->mem->smp;
+
+	if (s != NULL && s->threads) {
+		dcache_invalidate(m, addr, len);
+		block_invalidate(m, addr, len);
+		return;
+	}
+	if (s == NULL) {
+		dcache_invalidate(m, addr, len);
+		block_invalidate(m, addr, len);
+	} else {
+		for (unsigned int i = 0; i < s->nr_cores; i++) {
+			dcache_invalidate(s->cores[i], addr, len);
+			block_invalidate(s->cores[i], addr, len);
+		}
+	}
+	code_clear(m, addr, len);
+}
+
+/* memory() for words that straddle two pages */
+static int memory_split(struct machine *m, val_t addr,
+			int mem_read, int mem_write, val_t *valp)
+{
+	byte *bytes = (byte *)valp;
+	struct page *p;
+	int i;
+
+	if (mem_write) {
+		for (i = 0; i < sizeof(*valp); i++) {
+			if ((p = page_store(m, addr + i)) == NULL)
+				return -1;
+			p->data->bytes[(addr + i) & PAGE_MASK] = bytes[i];
+		}
+		if (is_code(m, addr, sizeof(*valp)))
+			smc(m, addr, sizeof(*valp));
+	}
+	if (mem_read)
+		for (i = 0; i < sizeof(*valp); i++)
+			bytes[i] = mem_byte(m, addr + i);
+	return 0;
+}
+
+/* whether the word at @off of page @p holds code */
+static inline int is_code_word(struct page *p, val_t off)
+{
+	byte *code = __atomic_load_n(&p->code, __ATOMIC_ACQUIRE);
+
+	return code != NULL && (code[off] | code[off + 1]
+				| code[off + 2] | code[off + 3]);
+}
+
+/**
+ * device(m, addr, mem_read, mem_write, valp)
+ *
+ * memory() for the device page.  Output goes through the stdio buffer
+ * of dev_out, input through the one of dev_in, so that the guest does
+ * not make a system call per word.
+ */
+static int device(struct machine *m, val_t addr,
+		  int mem_read, int mem_write, val_t *valp)
+{
+	struct memory *mem = m->mem;
+	int c;
+
+	if (addr % sizeof(*valp) != 0)
+		return -1;
+	if (mem_write && mem->dev_out != NULL) {
+		if (addr == DEV_PUTC)
+			putc(*valp & 0xFF, mem->dev_out);
+		else if (addr == DEV_PUTD)
+			fprintf(mem->dev_out, "%d", (sval_t)*valp);
+	}
+	if (mem_read) {
+		switch (addr) {
+		case DEV_GETC:
+			c = mem->dev_in != NULL ? getc(mem->dev_in) : EOF;
+			*valp = c == EOF ? (val_t)-1 : (val_t)c;
+			break;
+		case DEV_CYCLES:
+			*valp = m->Step;
+			break;
+		case DEV_CYCLES_HI:
+			*valp = m->Step >> 32;
+			break;
+		default:
+			*valp = 0;
+		}
+	}
+	return 0;
+}
+
+/**
+ * mem_access(m, addr, mem_read, mem_write, valp, defer)
+ *
+ * memory(), except that with @defer an access to a device is not made
+ * and 1 is returned instead.
+ */
+static inline int mem_access(struct machine *m, val_t addr, int mem_read,
+			     int mem_write, val_t *valp, int defer)
+{
+	val_t off = addr & PAGE_MASK;
+	struct page *p;
+
+	if (!mem_read && !mem_write)
+		return 0;
+	if (addr > DEV_BASE - sizeof(*valp)) {
+		if (addr > (val_t)-sizeof(*valp))	/* wraps around */
+			return -1;
+		if (m->mem->devices)
+			return defer ? 1 : device(m, addr, mem_read,
+						  mem_write, valp);
+	}
+
+	if (off > PAGE_SIZE - sizeof(*valp))
+		return memory_split(m, addr, mem_read, mem_write, valp);
+	if (mem_write) {
+		if ((p = page_store(m, addr)) == NULL)
+			return -1;
+		*(val_t *)&p->data->bytes[off] = *valp;
+		if (is_code_word(p, off))
+			smc(m, addr, sizeof(*valp));
+	}
+	if (mem_read) {
+		p = page_find(m, addr);
+		*valp = p == NULL ? 0 : *(val_t *)&p->data->bytes[off];
+	}
+	return 0;
+}
+
+static inline int memory(struct machine *m, val_t addr,
+			 int mem_read, int mem_write, val_t *valp)
+{
+	return mem_access(m, addr, mem_read, mem_write, valp, 0);
+}
+
+/**
+ * exchange(m, addr, valp)
+ *
+ * store *@valp at @addr and return the word it replaces in *@valp, in
+ * one atomic access that is also a full barrier: see smp_run().
+ * Return -1 if @addr is not aligned or is a device, or if out of memory.
+ */
+static int exchange(struct machine *m, val_t addr, val_t *valp)
+{
+	val_t off = addr & PAGE_MASK;
+	struct page *p;
+
+	if (addr % sizeof(*valp) != 0 || is_device(m, addr, sizeof(*valp))
+	    || (p = page_store(m, addr)) == NULL)
+		return -1;
+	*valp = __atomic_exchange_n((val_t *)&p->data->bytes[off], *valp,
+				    __ATOMIC_SEQ_CST);
+	if (is_code_word(p, off))
+		smc(m, addr, sizeof(*valp));
+	return 0;
+}
+
+/**
+ * step(m)
+ *
+ * execute one instruction through the SEQ datapath,
+ * return 0 if the machine keeps running.
+ */
+static inline int step(struct machine *m)
+{
+	const struct decoded *d;
+	regid_t dstE;
+	val_t valA, valB, valE, valM, mem_addr;
+	sval_t aluA, aluB;
+
+	m->Step++;
+	/* fetch and decode */
+	if ((d = fetch(m, m->PC, &m->Stat)) == NULL)
+		return -1;
+	if (ins_icode(d->ins) == I_HALT) {
+		m->Stat = S_HLT;
+		return -1;
+	}
+	valA = m->R[d->srcA];
+	valB = m->R[d->srcB];
+	dstE = d->dstE;
+	if (ins_icode(d->ins) == I_RRMOVL && !cond(m, ins_ifun(d->ins)))
+		dstE = R_NONE;
+
+	/* execute */
+	aluA = d->aluA_valA ? valA : d->aluK;
+	aluB = d->aluB_valB ? valB : 0;
+	valE = alu(m, d->alufun, aluA, aluB, d->set_cc);
+
+	/* memory */
+	mem_addr = d->addr_valA ? valA : valE;
+	valM = d->data_valP ? d->valP : valA;
+	if (ins_icode(d->ins) == I_XCHGL ? exchange(m, mem_addr, &valM)
+	    : memory(m, mem_addr, d->mem_read, d->mem_write, &valM)) {
+		m->Stat = S_ADR;
+		return -1;
+	}
+
+	/* write_back */
+	if (dstE != R_NONE)
+		m->R[dstE] = valE;
+	if (d->dstM != R_NONE)
+		m->R[d->dstM] = valM;
+
+	/* PC_update */
+	/**
+	 * int new_pc = [
+	 * 	icode == I_CALL : valC;
+	 * 	icode == I_JXX && Cnd : valC;
+	 * 	icode == I_RET : valM;
+	 * 	1 : valP;
+	 * ];
+	 */
+	switch (ins_icode(d->ins)) {
+	case I_CALL:
+		m->PC = d->valC;
+		break;
+	case I_JXX:
+		m->PC = cond(m, ins_ifun(d->ins)) ? d->valC : d->valP;
+		break;
+	case I_RET:
+		m->PC = valM;
+		break;
+	default:
+		m->PC = d->valP;
+	}
+	return 0;
+}
+
+/* the address the memory stage of @d accesses, alufun is always A_ADD */
+static inline val_t mem_addr(struct machine *m, const struct decoded *d)
+{
+	if (d->addr_valA)
+		return m->R[d->srcA];
+	return (d->aluA_valA ? m->R[d->srcA] : d->aluK)
+	     + (d->aluB_valB ? m->R[d->srcB] : 0);
+}
+
+/*
+ * Cache simulator.
+ *
+ * The I-cache sees every instruction fetch and the D-cache every data
+ * access of step_model(), with an optional L2 behind both; a missing
+ * L1 sends its accesses straight to the L2.  Caches only keep tags.
+ * An access costs hit_time cycles at each level it reaches, plus
+ * miss_time when the last level misses; writes to memory are buffered
+ * and cost nothing.  Write-back caches allocate on write misses,
+ * write-through caches do not.
+ */
+static struct cache_line *cache_victim(struct cache *c, struct cache_line *set)
+{
+	struct cache_line *l, *victim = set;
+
+	for (l = set; l < set + c->cfg.assoc; l++)
+		if (!l->valid)
+			return l;
+	if (c->cfg.policy == CACHE_RANDOM) {
+		c->seed ^= c->seed << 13;
+		c->seed ^= c->seed >> 17;
+		c->seed ^= c->seed << 5;
+		return &set[c->seed % c->cfg.assoc];
+	}
+	for (l = set; l < set + c->cfg.assoc; l++)
+		if (l->stamp < victim->stamp)
+			victim = l;
+	return victim;
+}
+
+/**
+ * cache_access(m, id, addr, type)
+ *
+ * access the block of @addr in cache @id, return the cycles it takes.
+ */
+static unsigned int cache_access(struct machine *m, enum cache_id id,
+				 val_t addr, enum cache_access type)
+{
+	struct cache *c = m->caches[id];
+	struct cache *next = id == CACHE_L2 ? NULL : m->caches[CACHE_L2];
+	val_t block = addr >> c->block_shift;
+	struct cache_line *set, *l;
+	unsigned int cycles = c->cfg.hit_time;
+
+	set = &c->lines[(block & (c->nr_sets - 1)) * c->cfg.assoc];
+	c->clock++;
+	for (l = set; l < set + c->cfg.assoc; l++)
+		if (l->valid && l->block == block)
+			break;
+	if (l < set + c->cfg.assoc) {
+		c->stats.hits[type]++;
+		if (c->cfg.policy == CACHE_LRU)
+			l->stamp = c->clock;
+	} else if (type == CACHE_WRITE && c->cfg.write_through) {
+		c->stats.misses[type]++;
+	} else {
+		c->stats.misses[type]++;
+		l = cache_victim(c, set);
+		if (l->valid && l->dirty) {
+			c->stats.writebacks++;
+			if (next != NULL)
+				cache_access(m, CACHE_L2,
+					     l->block << c->block_shift,
+					     CACHE_WRITE);
+		}
+		l->block = block;
+		l->valid = 1;
+		l->dirty = 0;
+		l->stamp = c->clock;
+		if (next == NULL)
+			cycles += c->cfg.miss_time;
+		else
+			cycles += cache_access(m, CACHE_L2, addr,
+					       type == CACHE_WRITE ? CACHE_READ
+								   : type);
+	}
+	if (type == CACHE_WRITE && !c->cfg.write_through)
+		l->dirty = 1;
+	else if (type == CACHE_WRITE && next != NULL)
+		cache_access(m, CACHE_L2, addr, CACHE_WRITE);
+	c->stats.cycles += cycles;
+	return cycles;
+}
+
+/* access [@addr, @addr + @len) through L1 @id, return the cycles */
+static unsigned int cache_range(struct machine *m, enum cache_id id,
+				val_t addr, val_t len, enum cache_access type)
+{
+	unsigned long long end = (unsigned long long)addr + len;
+	unsigned int cycles = 0, shift;
+
+	if (m->caches[id] == NULL)
+		id = CACHE_L2;
+	if (m->caches[id] == NULL)
+		return 0;
+	shift = m->caches[id]->block_shift;
+	for (unsigned long long b = addr >> shift; b <= (end - 1) >> shift; b++)
+		cycles += cache_access(m, id, b << shift, type);
+	return cycles;
+}
+
+/*
+ * Branch predictors.
+ *
+ * Conditional jXX go through a direction predictor: always taken,
+ * backward taken/forward not taken, a table of 2-bit counters indexed
+ * by the PC (bimodal) or by the PC xor the global history (gshare).
+ * A return address stack predicts ret when it has entries; call pushes
+ * onto it and overwrites the oldest entry when full.  Outcomes are
+ * counted in total and per PC.
+ */
+static struct site *site_find(struct site_table *t, val_t pc)
+{
+	size_t mask = t->size - 1, i = (pc * 2654435761U) & mask;
+
+	while (t->sites[i].used && t->sites[i].pc != pc)
+		i = (i + 1) & mask;
+	return &t->sites[i];
+}
+
+/* return the counters of @pc in @t, zero the first time */
+static struct site *site_get(struct site_table *t, val_t pc)
+{
+	struct site *old = t->sites, *site;
+	size_t old_size = t->size;
+
+	if (2 * (t->nr_sites + 1) > t->size) {
+		t->size = old_size ? 2 * old_size : 256;
+		t->sites = calloc(t->size, sizeof(*t->sites));
+		for (size_t i = 0; i < old_size; i++)
+			if (old[i].used)
+				*site_find(t, old[i].pc) = old[i];
+		free(old);
+	}
+	site = site_find(t, pc);
+	if (!site->used) {
+		site->used = 1;
+		site->pc = pc;
+		t->nr_sites++;
+	}
+	return site;
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+	const struct site *x = a, *y = b;
+
+	return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+/* return the counters in @t sorted by pc, NULL if there are none */
+static struct site *site_sort(const struct site_table *t)
+{
+	struct site *sites;
+	size_t n = 0;
+
+	if (t->nr_sites == 0
+	    || (sites = malloc(t->nr_sites * sizeof(*sites))) == NULL)
+		return NULL;
+	for (size_t i = 0; i < t->size; i++)
+		if (t->sites[i].used)
+			sites[n++] = t->sites[i];
+	qsort(sites, n, sizeof(*sites), site_cmp);
+	return sites;
+}
+
+/* predict the jXX at @pc to @target, return whether it is taken */
+static int predict(struct predictor *p, val_t pc, val_t target)
+{
+	val_t mask = (1U << p->cfg.bits) - 1;
+
+	switch (p->cfg.kind) {
+	case PREDICT_TAKEN:
+		return 1;
+	case PREDICT_BTFNT:
+		return target <= pc;
+	case PREDICT_BIMODAL:
+		return p->counters[pc & mask] >= 2;
+	case PREDICT_GSHARE:
+		return p->counters[(pc ^ p->history) & mask] >= 2;
+	}
+	return 1;
+}
+
+static void predict_update(struct predictor *p, val_t pc, int taken)
+{
+	val_t mask = (1U << p->cfg.bits) - 1;
+	byte *ctr;
+
+	if (p->cfg.kind == PREDICT_BIMODAL)
+		ctr = &p->counters[pc & mask];
+	else if (p->cfg.kind == PREDICT_GSHARE)
+		ctr = &p->counters[(pc ^ p->history) & mask];
+	else
+		return;
+	if (taken && *ctr < 3)
+		(*ctr)++;
+	else if (!taken && *ctr > 0)
+		(*ctr)--;
+	p->history = ((p->history << 1) | taken) & mask;
+}
+
+/* run the predictor on @d, about to be executed by step() */
+static void predictor_step(struct machine *m, const struct decoded *d)
+{
+	struct predictor *p = m->predictor;
+	struct site *site;
+	val_t pc = m->PC, ra = 0;
+	int taken, miss;
+
+	p->outcome = PREDICT_NONE;
+	switch (ins_icode(d->ins)) {
+	case I_JXX:
+		if (ins_ifun(d->ins) == C_ALL)
+			return;
+		taken = cond(m, ins_ifun(d->ins));
+		miss = predict(p, pc, d->valC) != taken;
+		predict_update(p, pc, taken);
+		p->stats.branches++;
+		p->stats.branch_misses += miss;
+		break;
+	case I_CALL:
+		if (p->cfg.ras_depth > 0)
+			p->ras[p->ras_top++ % p->cfg.ras_depth] = d->valP;
+		return;
+	case I_RET:
+		if (p->cfg.ras_depth == 0)
+			return;
+		miss = p->ras_top == 0
+		    || machine_read(m, m->R[R_ESP], &ra, sizeof(ra)) != 0;
+		if (p->ras_top > 0)
+			miss |= p->ras[--p->ras_top % p->cfg.ras_depth] != ra;
+		p->stats.returns++;
+		p->stats.return_misses += miss;
+		break;
+	default:
+		return;
+	}
+	p->outcome = miss ? PREDICT_MISS : PREDICT_HIT;
+	site = site_get(&p->sites, pc);
+	site->is_ret = ins_icode(d->ins) == I_RET;
+	site->count++;
+	site->misses += miss;
+}
+
+/*
+ * Profile.
+ *
+ * Every instruction executed is counted at its pc; one that follows a
+ * jXX, call or ret starts a basic block.  call and ret also move along
+ * a tree of call chains rooted at the pc the profile started at, and
+ * the instruction is counted in the node of its chain as well, which
+ * is all it takes for inclusive and exclusive totals per function and
+ * for stacks of flame graphs.
+ */
+static void profile_step(struct machine *m, const struct decoded *d)
+{
+	struct profile *p = m->profile;
+	struct site *site = site_get(&p->pcs, m->PC);
+	struct call_node *node;
+
+	site->count++;
+	site->leader |= p->leader;
+	p->node->self++;
+	switch (ins_icode(d->ins)) {
+	case I_CALL:
+		if (p->depth == PROFILE_DEPTH) {
+			p->lost++;
+			break;
+		}
+		for (node = p->node->child; node != NULL; node = node->next)
+			if (node->pc == d->valC)
+				break;
+		if (node == NULL && (node = calloc(1, sizeof(*node))) != NULL) {
+			node->pc = d->valC;
+			node->parent = p->node;
+			node->next = p->node->child;
+			p->node->child = node;
+		}
+		if (node != NULL) {
+			p->node = node;
+			p->depth++;
+		} else {
+			p->lost++;
+		}
+		break;
+	case I_RET:
+		if (p->lost > 0) {
+			p->lost--;
+		} else if (p->node->parent != NULL) {
+			p->node = p->node->parent;
+			p->depth--;
+		}
+		break;
+	}
+	p->leader = ins_icode(d->ins) == I_JXX || ins_icode(d->ins) == I_CALL
+		    || ins_icode(d->ins) == I_RET;
+}
+
+/**
+ * step_model(m)
+ *
+ * step() through the cache, predictor and profile models, the cycles
+ * of the caches go to m->cache_stall.
+ */
+static int step_model(struct machine *m)
+{
+	const struct decoded *d;
+	enum stat stat;
+	val_t addr;
+
+	if ((d = fetch(m, m->PC, &stat)) != NULL) {
+		if (m->predictor != NULL)
+			predictor_step(m, d);
+		if (m->profile != NULL)
+			profile_step(m, d);
+		m->cache_stall += cache_range(m, CACHE_I, m->PC, d->len,
+					      CACHE_FETCH);
+		addr = mem_addr(m, d);
+		if ((d->mem_read || d->mem_write)
+		    && addr <= (val_t)-sizeof(val_t))
+			m->cache_stall += cache_range(m, CACHE_D, addr,
+						      sizeof(val_t),
+						      d->mem_write ? CACHE_WRITE
+								   : CACHE_READ);
+	}
+	return step(m);
+}
+
+/**
+ * run_seq(m)
+ *
+ * run the machine through the SEQ datapath until it stops
+ * or reaches its step limit.
+ */
+static void run_seq(struct machine *m)
+{
+	if (m->nr_models > 0) {
+		while (m->Step < m->limit && step_model(m) == 0)
+			;
+		return;
+	}
+	while (m->Step < m->limit && step(m) == 0)
+		;
+}
+
+/*
+ * PIPE timing engine.
+ *
+ * Runs the program through step(), so the architectural results are
+ * those of run_seq(), and models the control logic of the five-stage
+ * PIPE design of CS:APP cycle by cycle on the side: the D, E, M and W
+ * pipeline registers, with everything forwarded except a value loaded
+ * by the instruction in E.  Fetch predicts jXX taken, or as the branch
+ * predictor of the machine says, in which case a ret predicted by
+ * its return address stack does not stall either.  The control
+ * signals are those of pipe-std.hcl:
+ *
+ *	load/use:   E loads into a source of D: stall F and D, bubble E
+ *	mispredict: jXX in E mispredicted: bubble D and E
+ *	ret:        ret in D, E or M: stall F, bubble D
+ *
+ * Every cycle retires an instruction or a bubble from W, so cycles are
+ * instructions plus bubbles, without the four cycles to fill the pipe.
+ * A run stopped by its step limit drains the pipe, so that every step
+ * is counted, and the next run starts with it empty.
+ * With caches, the cycles of an instruction's cache accesses are added
+ * as bubbles of their own, as if the pipeline stalled for them.
+ */
+static const struct pipe_reg pipe_empty;
+
+static void pipe_fetch(struct machine *m, struct pipe_reg *f)
+{
+	const struct decoded *d;
+	enum stat stat;
+	int ret;
+
+	*f = pipe_empty;
+	f->kind = P_INSN;
+	if ((d = fetch(m, m->PC, &stat)) == NULL) {
+		f->ins = mem_byte(m, m->PC);
+		f->srcA = f->srcB = f->dstM = R_NONE;
+	} else {
+		f->ins = d->ins;
+		f->srcA = d->srcA;
+		f->srcB = d->srcB;
+		f->dstM = d->dstM;
+	}
+	ret = m->nr_models > 0 ? step_model(m) : step(m);
+	if (m->cache_stall > 0) {
+		m->pipe.stats.cycles += m->cache_stall;
+		m->pipe.stats.bubbles[f->ins][PIPE_CACHE] += m->cache_stall;
+		m->cache_stall = 0;
+	}
+	if (ret) {
+		f->last = 1;
+		m->pipe.stopping = 1;
+	} else if (m->predictor != NULL
+		   && m->predictor->outcome != PREDICT_NONE) {
+		/* a ret predicted right does not wait for its address */
+		f->predicted = m->predictor->outcome == PREDICT_HIT;
+		f->mispredicted = ins_icode(f->ins) == I_JXX && !f->predicted;
+	} else if (ins_icode(f->ins) == I_JXX && m->PC != d->valC) {
+		f->mispredicted = 1;
+	}
+	if (f->mispredicted)
+		m->pipe.wrong = 1;
+}
+
+static void pipe_bubble(struct pipe_reg *r, ins_t ins, enum pipe_cause cause)
+{
+	*r = pipe_empty;
+	r->kind = P_BUBBLE;
+	r->ins = ins;
+	r->cause = cause;
+}
+
+static int is_ret(const struct pipe_reg *r)
+{
+	return r->kind == P_INSN && ins_icode(r->ins) == I_RET && !r->predicted;
+}
+
+/* drop the instructions in flight */
+static void pipe_flush(struct machine *m)
+{
+	m->pipe.D = m->pipe.E = m->pipe.M = m->pipe.W = pipe_empty;
+	m->pipe.wrong = m->pipe.stopping = 0;
+}
+
+/**
+ * pipe_cycle(m)
+ *
+ * clock the pipeline once, return -1 instead if it is time to stop:
+ * the last instruction left W, or fetch would go past the step limit
+ * and the instructions in flight have all left W.
+ */
+static int pipe_cycle(struct machine *m)
+{
+	struct pipe *p = &m->pipe;
+	struct pipe_reg f = pipe_empty;
+	int load_use, mispredict, ret, fetching;
+	ins_t ins_E = p->E.ins;
+
+	/* pipeline control logic */
+	load_use = p->E.kind == P_INSN && p->D.kind == P_INSN
+		&& (ins_icode(ins_E) == I_MRMOVL || ins_icode(ins_E) == I_POPL
+		    || ins_icode(ins_E) == I_XCHGL)
+		&& p->E.dstM != R_NONE
+		&& (p->E.dstM == p->D.srcA || p->E.dstM == p->D.srcB);
+	mispredict = p->E.kind == P_INSN && p->E.mispredicted;
+	ret = is_ret(&p->D) || is_ret(&p->E) || is_ret(&p->M);
+	fetching = !load_use && !ret && !p->stopping && !p->wrong;
+	if (fetching && m->Step == m->limit) {
+		if (p->D.kind == P_EMPTY && p->E.kind == P_EMPTY
+		    && p->M.kind == P_EMPTY && p->W.kind == P_EMPTY)
+			return -1;
+		fetching = 0;	/* drain */
+	}
+
+	/* write back */
+	if (p->W.kind == P_INSN) {
+		p->stats.cycles++;
+		p->stats.insns++;
+		p->stats.count[p->W.ins]++;
+		if (p->W.last) {
+			pipe_flush(m);
+			return -1;
+		}
+	} else if (p->W.kind == P_BUBBLE) {
+		p->stats.cycles++;
+		p->stats.bubbles[p->W.ins][p->W.cause]++;
+	}
+
+	/* fetch */
+	if (fetching)
+		pipe_fetch(m, &f);
+	else if (p->wrong)
+		f.kind = P_WRONG;
+	if (mispredict)
+		p->wrong = 0;
+
+	/* clock the pipeline registers */
+	p->W = p->M;
+	p->M = p->E;
+	if (mispredict)
+		pipe_bubble(&p->E, ins_E, PIPE_MISPREDICT);
+	else if (load_use)
+		pipe_bubble(&p->E, ins_E, PIPE_LOAD_USE);
+	else
+		p->E = p->D;
+	if (load_use)
+		return 0;	/* D stalls */
+	if (mispredict)
+		pipe_bubble(&p->D, ins_E, PIPE_MISPREDICT);
+	else if (ret)
+		pipe_bubble(&p->D, pack_ins(I_RET, 0), PIPE_RET);
+	else
+		p->D = f;
+	return 0;
+}
+
+/**
+ * run_pipe(m)
+ *
+ * run the machine like run_seq(), counting its cycles on PIPE.
+ */
+static void run_pipe(struct machine *m)
+{
+	while (pipe_cycle(m) == 0)
+		;
+}
+
+/*
+ * Threaded-code engine.
+ *
+ * Instead of routing every instruction through the generic datapath,
+ * each opcode/ifun pair has its own handler that does only the work of
+ * that instruction.  With GCC the decoded record holds the address of
+ * its handler and every handler jumps straight to the next one
+ * (direct threading); other compilers get a switch on the op.
+ * The architectural effects, including Step, match run_seq().
+ */
+#ifdef __GNUC__
+#define THREADED_GOTO
+#endif
+
+#ifdef THREADED_GOTO
+#define HANDLER(op)	L_##op
+#define DISPATCH()	goto *d->handler
+#define HIT(d)		((d)->handler != NULL)	/* valid and handled */
+#else
+#define HANDLER(op)	case op
+#define DISPATCH()	goto dispatch
+#define HIT(d)		((d)->valid)
+#endif
+
+#define NEXT()						\
+	do {						\
+		if (m->Step++ == m->limit)		\
+			goto limit;			\
+		d = &m->dcache[m->PC & (DCACHE_SIZE - 1)];	\
+		if (!HIT(d) || d->pc != m->PC)		\
+			goto miss;			\
+		DISPATCH();				\
+	} while (0)
+
+#define STORE(addr, val)				\
+	do {						\
+		tmp = (val);				\
+		if (memory(m, (addr), 0, 1, &tmp))		\
+			goto adr;			\
+	} while (0)
+
+#define LOAD(addr)					\
+	do {						\
+		if (memory(m, (addr), 1, 0, &tmp))		\
+			goto adr;			\
+	} while (0)
+
+#define CMOV(ifun)					\
+	do {						\
+		if (cond(m, ifun))				\
+			m->R[d->rB] = m->R[d->rA];		\
+		m->PC = d->valP;				\
+		NEXT();					\
+	} while (0)
+
+#define OPL(alufun)					\
+	do {						\
+		m->R[d->rB] = alu(m, alufun, m->R[d->rA], m->R[d->rB], 1);	\
+		m->PC = d->valP;				\
+		NEXT();					\
+	} while (0)
+
+#define JXX(ifun)					\
+	do {						\
+		m->PC = cond(m, ifun) ? d->valC : d->valP;	\
+		NEXT();					\
+	} while (0)
+
+/**
+ * run_threaded(m)
+ *
+ * run the machine with one specialised handler per instruction
+ * until it stops or reaches its step limit.
+ */
+static void run_threaded(struct machine *m)
+{
+#ifdef THREADED_GOTO
+	static const void *const handlers[NR_OPS] = {
+		[OP_HALT] = &&L_OP_HALT,	[OP_NOP] = &&L_OP_NOP,
+		[OP_RRMOVL] = &&L_OP_RRMOVL,	[OP_CMOVLE] = &&L_OP_CMOVLE,
+		[OP_CMOVL] = &&L_OP_CMOVL,	[OP_CMOVE] = &&L_OP_CMOVE,
+		[OP_CMOVNE] = &&L_OP_CMOVNE,	[OP_CMOVGE] = &&L_OP_CMOVGE,
+		[OP_CMOVG] = &&L_OP_CMOVG,	[OP_IRMOVL] = &&L_OP_IRMOVL,
+		[OP_RMMOVL] = &&L_OP_RMMOVL,	[OP_MRMOVL] = &&L_OP_MRMOVL,
+		[OP_ADDL] = &&L_OP_ADDL,	[OP_SUBL] = &&L_OP_SUBL,
+		[OP_ANDL] = &&L_OP_ANDL,	[OP_XORL] = &&L_OP_XORL,
+		[OP_JMP] = &&L_OP_JMP,		[OP_JLE] = &&L_OP_JLE,
+		[OP_JL] = &&L_OP_JL,		[OP_JE] = &&L_OP_JE,
+		[OP_JNE] = &&L_OP_JNE,		[OP_JGE] = &&L_OP_JGE,
+		[OP_JG] = &&L_OP_JG,		[OP_CALL] = &&L_OP_CALL,
+		[OP_RET] = &&L_OP_RET,		[OP_PUSHL] = &&L_OP_PUSHL,
+		[OP_POPL] = &&L_OP_POPL,	[OP_XCHGL] = &&L_OP_XCHGL,
+	};
+#endif
+	struct decoded *d;
+	val_t addr, tmp;
+
+	if (m->Step++ == m->limit)
+		goto limit;
+miss:
+	if ((d = fetch(m, m->PC, &m->Stat)) == NULL)
+		return;
+#ifdef THREADED_GOTO
+	d->handler = handlers[d->op];
+	DISPATCH();
+#else
+dispatch:
+	switch (d->op) {
+#endif
+
+	HANDLER(OP_HALT):
+		m->Stat = S_HLT;
+		return;
+	HANDLER(OP_NOP):
+		m->PC = d->valP;
+		NEXT();
+	HANDLER(OP_RRMOVL):
+		m->R[d->rB] = m->R[d->rA];
+		m->PC = d->valP;
+		NEXT();
+	HANDLER(OP_CMOVLE):
+		CMOV(C_LE);
+	HANDLER(OP_CMOVL):
+		CMOV(C_L);
+	HANDLER(OP_CMOVE):
+		CMOV(C_E);
+	HANDLER(OP_CMOVNE):
+		CMOV(C_NE);
+	HANDLER(OP_CMOVGE):
+		CMOV(C_GE);
+	HANDLER(OP_CMOVG):
+		CMOV(C_G);
+	HANDLER(OP_IRMOVL):
+		m->R[d->rB] = d->valC;
+		m->PC = d->valP;
+		NEXT();
+	HANDLER(OP_RMMOVL):
+		STORE(m->R[d->rB] + d->valC, m->R[d->rA]);
+		m->PC = d->valP;
+		NEXT();
+	HANDLER(OP_MRMOVL):
+		LOAD(m->R[d->rB] + d->valC);
+		m->R[d->rA] = tmp;
+		m->PC = d->valP;
+		NEXT();
+	HANDLER(OP_ADDL):
+		OPL(A_ADD);
+	HANDLER(OP_SUBL):
+		OPL(A_SUB);
+	HANDLER(OP_ANDL):
+		OPL(A_AND);
+	HANDLER(OP_XORL):
+		OPL(A_XOR);
+	HANDLER(OP_JMP):
+		m->PC = d->valC;
+		NEXT();
+	HANDLER(OP_JLE):
+		JXX(C_LE);
+	HANDLER(OP_JL):
+		JXX(C_L);
+	HANDLER(OP_JE):
+		JXX(C_E);
+	HANDLER(OP_JNE):
+		JXX(C_NE);
+	HANDLER(OP_JGE):
+		JXX(C_GE);
+	HANDLER(OP_JG):
+		JXX(C_G);
+	HANDLER(OP_CALL):
+		addr = m->R[R_ESP] - 4;
+		STORE(addr, d->valP);
+		m->R[R_ESP] = addr;
+		m->PC = d->valC;
+		NEXT();
+	HANDLER(OP_RET):
+		addr = m->R[R_ESP];
+		LOAD(addr);
+		m->R[R_ESP] = addr + 4;
+		m->PC = tmp;
+		NEXT();
+	HANDLER(OP_PUSHL):
+		addr = m->R[R_ESP] - 4;
+		STORE(addr, m->R[d->rA]);
+		m->R[R_ESP] = addr;
+		m->PC = d->valP;
+		NEXT();
+	HANDLER(OP_POPL):
+		addr = m->R[R_ESP];
+		LOAD(addr);
+		m->R[R_ESP] = addr + 4;
+		m->R[d->rA] = tmp;
+		m->PC = d->valP;
+		NEXT();
+	HANDLER(OP_XCHGL):
+		tmp = m->R[d->rA];
+		if (exchange(m, m->R[d->rB] + d->valC, &tmp))
+			goto adr;
+		m->R[d->rA] = tmp;
+		m->PC = d->valP;
+		NEXT();
+
+#ifndef THREADED_GOTO
+	default:
+		m->Stat = S_INS;
+		return;
+	}
+#endif
+adr:
+	m->Stat = S_ADR;
+	return;
+limit:
+	m->Step--;
+}
+
+#undef HANDLER
+#undef DISPATCH
+#undef HIT
+#undef NEXT
+#undef STORE
+#undef LOAD
+#undef CMOV
+#undef OPL
+#undef JXX
+
+#ifdef JIT
+/*
+ * x86-64 backend.
+ *
+ * Blocks entered JIT_THRESHOLD times by run_blocks() are compiled to
+ * native code.  Compiled blocks keep the Y86 registers in r8d-r15d,
+ * the packed CC in ebx and page_dir in rbp, and rdi points to the
+ * jit_frame used to enter and leave native code.  They only implement
+ * the common case: an access to an absent page or across pages, a
+ * store into code, a misaligned xchgl or halt leaves native code
+ * before the instruction, which is then run by step().  Exits to a
+ * successor jump straight into its native code when it has any,
+ * everything else returns to run_blocks().
+ */
+#define JIT_THRESHOLD 32
+#define JIT_CODESIZE (4 << 20)
+#define JIT_BLOCKMAX ((MAXBLOCKLEN + 1) * 160 + 256)
+
+enum jit_exit {
+	JIT_EXIT_NEXT0,		/* to b->next[0] at PC */
+	JIT_EXIT_NEXT1,		/* to b->next[1] at PC */
+	JIT_EXIT_LOOKUP,	/* to the block at PC */
+	JIT_EXIT_STEP,		/* step() the instruction at PC */
+};
+
+struct jit_frame {
+	val_t R[8];
+	val_t CC;
+	val_t PC;
+	unsigned long long Step;
+	unsigned long long limit;
+	struct page ***page_dir;
+	struct block *b;	/* block that exited */
+	int exit;		/* enum jit_exit */
+};
+
+enum hreg {
+	H_RAX, H_RCX, H_RDX, H_RBX, H_RSP, H_RBP, H_RSI, H_RDI,
+	H_R8, H_R9, H_R10, H_R11, H_R12, H_R13, H_R14, H_R15,
+};
+
+#define H_CC	H_RBX
+#define H_DIR	H_RBP
+#define H_FRAME	H_RDI
+#define HREG(r)	(H_R8 + (r))	/* host register of Y86 register r */
+
+#define FRAME(field) offsetof(struct jit_frame, field)
+
+/* x86 condition codes of Y86 ifun */
+static const byte x86_cc[] = {
+	[C_LE] = 0xE, [C_L] = 0xC, [C_E] = 0x4,
+	[C_NE] = 0x5, [C_GE] = 0xD, [C_G] = 0xF,
+};
+#define X86_C	0x2	/* carry */
+#define X86_A	0x7	/* unsigned above */
+#define X86_O	0x0	/* overflow */
+#define X86_S	0x8	/* sign */
+#define X86_Z	0x4	/* zero */
+
+static void emit1(struct machine *m, byte x)
+{
+	*m->jit_ptr++ = x;
+}
+
+static void emit4(struct machine *m, val_t x)
+{
+	memcpy(m->jit_ptr, &x, sizeof(x));
+	m->jit_ptr += sizeof(x);
+}
+
+static void emit8(struct machine *m, uint64_t x)
+{
+	memcpy(m->jit_ptr, &x, sizeof(x));
+	m->jit_ptr += sizeof(x);
+}
+
+static void emit_rex(struct machine *m, int w, int reg, int index, int base)
+{
+	byte rex = 0x40 | (w << 3) | ((reg >> 3) << 2)
+		 | ((index >> 3) << 1) | (base >> 3);
+
+	if (rex != 0x40)
+		emit1(m, rex);
+}
+
+/**
+ * emit_op_rr(m, w, op, len, reg, rm)
+ *
+ * emit instruction @op (@len bytes) with register operands.
+ */
+static void emit_op_rr(struct machine *m, int w, unsigned int op, int len,
+		       int reg, int rm)
+{
+	emit_rex(m, w, reg, 0, rm);
+	while (len--)
+		emit1(m, op >> (8 * len));
+	emit1(m, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/**
+ * emit_op_sib(m, w, op, len, reg, base, index, scale, disp)
+ *
+ * emit instruction @op (@len bytes) with a memory operand
+ * [@base + @index << @scale + @disp], @index < 0 if there is none.
+ */
+static void emit_op_sib(struct machine *m, int w, unsigned int op, int len,
+			int reg, int base, int index, int scale, sval_t disp)
+{
+	int mod = disp == 0 ? 0 : (disp == (signed char)disp ? 1 : 2);
+
+	if (mod == 0 && (base & 7) == H_RBP)
+		mod = 1;
+	emit_rex(m, w, reg, index < 0 ? 0 : index, base);
+	while (len--)
+		emit1(m, op >> (8 * len));
+	if (index < 0 && (base & 7) != H_RSP) {
+		emit1(m, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+	} else {
+		emit1(m, (mod << 6) | ((reg & 7) << 3) | 4);
+		emit1(m, (scale << 6) | ((index < 0 ? 4 : index & 7) << 3)
+		      | (base & 7));
+	}
+	if (mod == 1)
+		emit1(m, disp);
+	else if (mod == 2)
+		emit4(m, disp);
+}
+
+static void emit_op_mem(struct machine *m, int w, unsigned int op, int len,
+			int reg, int base, int index, sval_t disp)
+{
+	emit_op_sib(m, w, op, len, reg, base, index, 0, disp);
+}
+
+static void emit_mov_imm(struct machine *m, int reg, val_t imm)
+{
+	emit_rex(m, 0, 0, 0, reg);
+	emit1(m, 0xB8 + (reg & 7));
+	emit4(m, imm);
+}
+
+/* cmp r32, imm32 */
+static void emit_cmp_imm(struct machine *m, int reg, val_t imm)
+{
+	emit_op_rr(m, 0, 0x81, 1, 7, reg);
+	emit4(m, imm);
+}
+
+/* jcc rel32, return where the displacement goes */
+static byte *emit_jcc(struct machine *m, int cc)
+{
+	emit1(m, 0x0F);
+	emit1(m, 0x80 + cc);
+	emit4(m, 0);
+	return m->jit_ptr - 4;
+}
+
+static byte *emit_jmp(struct machine *m)
+{
+	emit1(m, 0xE9);
+	emit4(m, 0);
+	return m->jit_ptr - 4;
+}
+
+static void patch(byte *rel, byte *target)
+{
+	sval_t disp = target - (rel + 4);
+
+	memcpy(rel, &disp, sizeof(disp));
+}
+
+/* setcc r8, for registers without REX */
+static void emit_setcc(struct machine *m, int cc, int reg)
+{
+	emit1(m, 0x0F);
+	emit1(m, 0x90 + cc);
+	emit1(m, 0xC0 | reg);
+}
+
+/*
+ * The per-block compilation state: where side exits of each
+ * instruction jump to, and whether the host flags still hold the
+ * result of the last OPl.
+ */
+struct jit_ctx {
+	struct machine *m;
+	struct block *b;
+	byte *exits[MAXBLOCKLEN][6];
+	int nr_exits[MAXBLOCKLEN];
+	int flags;		/* host flags are valid for conditions */
+	int flags_sub;		/* ... but came from subl, OF differs */
+};
+
+/* jump to the side exit of instruction i if host condition cc holds */
+static void side_exit(struct jit_ctx *ctx, int i, int cc)
+{
+	struct machine *m = ctx->m;
+
+	ctx->exits[i][ctx->nr_exits[i]++] = emit_jcc(m, cc);
+}
+
+/**
+ * emit_addr(ctx, i, base, disp)
+ *
+ * walk page_dir for the word at R[base] + disp, leave at instruction i
+ * if it is not within a present page, else rdx = page and
+ * rsi:rcx = page bytes:offset.
+ */
+static void emit_addr(struct jit_ctx *ctx, int i, int base, sval_t disp)
+{
+	struct machine *m = ctx->m;
+
+	/* lea eax, [base + disp] */
+	emit_op_mem(m, 0, 0x8D, 1, H_RAX, HREG(base), -1, disp);
+	/* mov ecx, eax; shr ecx, DIR_SHIFT; mov rdx, [rbp + rcx * 8] */
+	emit_op_rr(m, 0, 0x89, 1, H_RAX, H_RCX);
+	emit_op_rr(m, 0, 0xC1, 1, 5, H_RCX);
+	emit1(m, DIR_SHIFT);
+	emit_op_sib(m, 1, 0x8B, 1, H_RDX, H_DIR, H_RCX, 3, 0);
+	emit_op_rr(m, 1, 0x85, 1, H_RDX, H_RDX);
+	side_exit(ctx, i, X86_Z);
+	/* mov ecx, eax; shr ecx, PAGE_SHIFT; and ecx, TABLE_SIZE - 1 */
+	emit_op_rr(m, 0, 0x89, 1, H_RAX, H_RCX);
+	emit_op_rr(m, 0, 0xC1, 1, 5, H_RCX);
+	emit1(m, PAGE_SHIFT);
+	emit_op_rr(m, 0, 0x81, 1, 4, H_RCX);
+	emit4(m, TABLE_SIZE - 1);
+	/* mov rdx, [rdx + rcx * 8] */
+	emit_op_sib(m, 1, 0x8B, 1, H_RDX, H_RDX, H_RCX, 3, 0);
+	emit_op_rr(m, 1, 0x85, 1, H_RDX, H_RDX);
+	side_exit(ctx, i, X86_Z);
+	/* mov ecx, eax; and ecx, PAGE_MASK; cmp ecx, PAGE_SIZE - 4; ja */
+	emit_op_rr(m, 0, 0x89, 1, H_RAX, H_RCX);
+	emit_op_rr(m, 0, 0x81, 1, 4, H_RCX);
+	emit4(m, PAGE_MASK);
+	emit_cmp_imm(m, H_RCX, PAGE_SIZE - sizeof(val_t));
+	side_exit(ctx, i, X86_A);
+	/* mov rsi, [rdx + data] */
+	emit_op_mem(m, 1, 0x8B, 1, H_RSI, H_RDX, -1, offsetof(struct page, data));
+	ctx->flags = 0;
+}
+
+/*
+ * leave at instruction i if a store to page rdx at offset rcx needs
+ * page_own() or hits code
+ */
+static void emit_store_check(struct jit_ctx *ctx, int i)
+{
+	struct machine *m = ctx->m;
+	byte *none;
+
+	/* cmp byte [rdx + writable], 0; je */
+	emit_op_mem(m, 0, 0x80, 1, 7, H_RDX, -1, offsetof(struct page, writable));
+	emit1(m, 0);
+	side_exit(ctx, i, X86_Z);
+	/* mov rax, [rdx + code]; test rax, rax; jz; cmp dword [rax + rcx], 0 */
+	emit_op_mem(m, 1, 0x8B, 1, H_RAX, H_RDX, -1, offsetof(struct page, code));
+	emit_op_rr(m, 1, 0x85, 1, H_RAX, H_RAX);
+	none = emit_jcc(m, X86_Z);
+	emit_op_mem(m, 0, 0x83, 1, 7, H_RAX, H_RCX, 0);
+	emit1(m, 0);
+	side_exit(ctx, i, X86_Z ^ 1);
+	patch(none, m->jit_ptr);
+}
+
+/**
+ * emit_cc(ctx, sub)
+ *
+ * pack the host flags of the last OPl into CC, for subl eax holds
+ * whether the operands had different signs.  Leaves the flags alone.
+ */
+static void emit_cc(struct jit_ctx *ctx, int sub)
+{
+	struct machine *m = ctx->m;
+
+	if (sub) {
+		/* alu() sets OF of subl iff signs differ and x86 OF is clear */
+		emit_mov_imm(m, H_RDX, 0);
+		emit_op_rr(m, 0, 0x0F40 | X86_O, 2, H_RAX, H_RDX);
+	} else {
+		emit_setcc(m, X86_O, H_RAX);
+		emit_op_rr(m, 0, 0x0FB6, 2, H_RAX, H_RAX);
+	}
+	emit_setcc(m, X86_S, H_RCX);
+	emit_setcc(m, X86_Z, H_RDX);
+	emit_op_rr(m, 0, 0x0FB6, 2, H_RCX, H_RCX);
+	emit_op_rr(m, 0, 0x0FB6, 2, H_RDX, H_RDX);
+	/* lea ebx, [rax + rcx * 2]; lea ebx, [rbx + rdx * 4] */
+	emit1(m, 0x8D);
+	emit1(m, 0x1C);
+	emit1(m, 0x48);
+	emit1(m, 0x8D);
+	emit1(m, 0x1C);
+	emit1(m, 0x93);
+}
+
+/* the mask of CC values (bit cc) for which cc_cond(cc, ifun) holds */
+static val_t cond_mask(ifun_t ifun)
+{
+	val_t cc, mask = 0;
+
+	for (cc = 0; cc < 8; cc++)
+		if (cc_cond(cc, ifun))
+			mask |= 1 << cc;
+	return mask;
+}
+
+/* evaluate condition ifun, return the host condition that holds it */
+static int emit_cond(struct jit_ctx *ctx, ifun_t ifun)
+{
+	struct machine *m = ctx->m;
+
+	if (ctx->flags && (!ctx->flags_sub || ifun == C_E || ifun == C_NE))
+		return x86_cc[ifun];
+
+	/* mov eax, mask; bt eax, ebx */
+	emit_mov_imm(m, H_RAX, cond_mask(ifun));
+	emit_op_rr(m, 0, 0x0FA3, 2, H_CC, H_RAX);
+	ctx->flags = 0;
+	return X86_C;
+}
+
+/* leave through successor i of the block with PC = pc */
+static void emit_chain(struct jit_ctx *ctx, int i, val_t pc)
+{
+	struct machine *m = ctx->m;
+	byte *slow[3];
+
+	/* mov [frame.PC], pc */
+	emit_op_mem(m, 0, 0xC7, 1, 0, H_FRAME, -1, FRAME(PC));
+	emit4(m, pc);
+	/* mov rax, &b->next[i]; mov rax, [rax]; test rax, rax; jz */
+	emit_rex(m, 1, 0, 0, 0);
+	emit1(m, 0xB8);
+	emit8(m, (uintptr_t)&ctx->b->next[i]);
+	emit_op_mem(m, 1, 0x8B, 1, H_RAX, H_RAX, -1, 0);
+	emit_op_rr(m, 1, 0x85, 1, H_RAX, H_RAX);
+	slow[0] = emit_jcc(m, X86_Z);
+	/* cmp dword [rax + valid], 0; je */
+	emit_op_mem(m, 0, 0x83, 1, 7, H_RAX, -1, offsetof(struct block, valid));
+	emit1(m, 0);
+	slow[1] = emit_jcc(m, X86_Z);
+	/* mov rax, [rax + native]; test rax, rax; jz; jmp rax */
+	emit_op_mem(m, 1, 0x8B, 1, H_RAX, H_RAX, -1,
+		    offsetof(struct block, native));
+	emit_op_rr(m, 1, 0x85, 1, H_RAX, H_RAX);
+	slow[2] = emit_jcc(m, X86_Z);
+	emit1(m, 0xFF);
+	emit1(m, 0xE0);
+
+	patch(slow[0], m->jit_ptr);
+	patch(slow[1], m->jit_ptr);
+	patch(slow[2], m->jit_ptr);
+	emit_rex(m, 1, 0, 0, 0);
+	emit1(m, 0xB8);
+	emit8(m, (uintptr_t)ctx->b);
+	emit_op_mem(m, 1, 0x89, 1, H_RAX, H_FRAME, -1, FRAME(b));
+	emit_op_mem(m, 0, 0xC7, 1, 0, H_FRAME, -1, FRAME(exit));
+	emit4(m, JIT_EXIT_NEXT0 + i);
+	patch(emit_jmp(m), m->jit_leave);
+}
+
+/* leave to the block at PC, which is in ecx */
+static void emit_lookup(struct jit_ctx *ctx)
+{
+	struct machine *m = ctx->m;
+
+	emit_op_mem(m, 0, 0x89, 1, H_RCX, H_FRAME, -1, FRAME(PC));
+	emit_op_mem(m, 0, 0xC7, 1, 0, H_FRAME, -1, FRAME(exit));
+	emit4(m, JIT_EXIT_LOOKUP);
+	patch(emit_jmp(m), m->jit_leave);
+}
+
+/**
+ * jit_compile(m, b)
+ *
+ * compile block @b to native code, leave b->native NULL if the code
+ * area is full.
+ */
+static void jit_compile(struct machine *m, struct block *b)
+{
+	struct jit_ctx ctx;
+	struct uop *u;
+	byte cc_live[MAXBLOCKLEN + 1];
+	byte *code = m->jit_ptr, *taken;
+	unsigned int i;
+	int live, cc, sub;
+
+	if (m->jit_base == NULL)
+		return;
+	if (m->jit_ptr + JIT_BLOCKMAX > m->jit_base + JIT_CODESIZE) {
+		m->jit_full = 1;
+		return;
+	}
+
+	/*
+	 * cc_live[i]: CC set by instruction i may be read, by a later
+	 * condition or by step() after a side exit.
+	 */
+	live = 1;
+	for (i = b->n; i-- > 0; ) {
+		u = &b->uops[i];
+		if (u->op >= OP_ADDL && u->op <= OP_XORL) {
+			cc_live[i] = live;
+			live = 0;
+		} else if (u->op != OP_NOP && u->op != OP_RRMOVL
+			   && u->op != OP_IRMOVL && u->op != OP_JMP) {
+			live = 1;
+		}
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.m = m;
+	ctx.b = b;
+
+	/* add qword [frame.Step], n; leave if that is beyond the limit */
+	emit_op_mem(m, 1, 0x81, 1, 0, H_FRAME, -1, FRAME(Step));
+	emit4(m, b->n);
+	emit_op_mem(m, 1, 0x8B, 1, H_RAX, H_FRAME, -1, FRAME(limit));
+	emit_op_mem(m, 1, 0x39, 1, H_RAX, H_FRAME, -1, FRAME(Step));
+	side_exit(&ctx, 0, X86_A);
+
+	for (i = 0, u = b->uops; i < b->n; i++, u++) {
+		switch (u->op) {
+		case OP_HALT:
+			ctx.exits[i][ctx.nr_exits[i]++] = emit_jmp(m);
+			break;
+		case OP_NOP:
+			break;
+		case OP_RRMOVL:
+			emit_op_rr(m, 0, 0x89, 1, HREG(u->rA), HREG(u->rB));
+			break;
+		case OP_CMOVLE ... OP_CMOVG:
+			cc = emit_cond(&ctx, u->op - OP_RRMOVL);
+			emit_op_rr(m, 0, 0x0F40 | cc, 2, HREG(u->rB), HREG(u->rA));
+			break;
+		case OP_IRMOVL:
+			emit_mov_imm(m, HREG(u->rB), u->valC);
+			break;
+		case OP_RMMOVL:
+			emit_addr(&ctx, i, u->rB, u->valC);
+			emit_store_check(&ctx, i);
+			emit_op_mem(m, 0, 0x89, 1, HREG(u->rA), H_RSI, H_RCX, 0);
+			break;
+		case OP_MRMOVL:
+			emit_addr(&ctx, i, u->rB, u->valC);
+			emit_op_mem(m, 0, 0x8B, 1, HREG(u->rA), H_RSI, H_RCX, 0);
+			break;
+		case OP_ADDL ... OP_XORL:
+			sub = u->op == OP_SUBL;
+			if (sub && cc_live[i]) {
+				/* eax = (rA ^ rB) >> 31 */
+				emit_op_rr(m, 0, 0x89, 1, HREG(u->rA), H_RAX);
+				emit_op_rr(m, 0, 0x31, 1, HREG(u->rB), H_RAX);
+				emit_op_rr(m, 0, 0xC1, 1, 5, H_RAX);
+				emit1(m, 31);
+			}
+			emit_op_rr(m, 0, (byte []){ 0x01, 0x29, 0x21, 0x31 }
+					[u->op - OP_ADDL], 1,
+				   HREG(u->rA), HREG(u->rB));
+			if (cc_live[i])
+				emit_cc(&ctx, sub);
+			ctx.flags = 1;
+			ctx.flags_sub = sub;
+			break;
+		case OP_JMP:
+			emit_chain(&ctx, 1, u->valC);
+			break;
+		case OP_JLE ... OP_JG:
+			cc = emit_cond(&ctx, u->op - OP_JMP);
+			taken = emit_jcc(m, cc);
+			emit_chain(&ctx, 0, u->valP);
+			patch(taken, m->jit_ptr);
+			emit_chain(&ctx, 1, u->valC);
+			break;
+		case OP_CALL:
+			emit_addr(&ctx, i, R_ESP, -4);
+			emit_store_check(&ctx, i);
+			emit_op_mem(m, 0, 0xC7, 1, 0, H_RSI, H_RCX, 0);
+			emit4(m, u->valP);
+			emit_op_mem(m, 0, 0x8D, 1, HREG(R_ESP), HREG(R_ESP), -1, -4);
+			emit_chain(&ctx, 1, u->valC);
+			break;
+		case OP_RET:
+			emit_addr(&ctx, i, R_ESP, 0);
+			emit_op_mem(m, 0, 0x8B, 1, H_RCX, H_RSI, H_RCX, 0);
+			emit_op_mem(m, 0, 0x8D, 1, HREG(R_ESP), HREG(R_ESP), -1, 4);
+			emit_lookup(&ctx);
+			break;
+		case OP_PUSHL:
+			emit_addr(&ctx, i, R_ESP, -4);
+			emit_store_check(&ctx, i);
+			emit_op_mem(m, 0, 0x89, 1, HREG(u->rA), H_RSI, H_RCX, 0);
+			emit_op_mem(m, 0, 0x8D, 1, HREG(R_ESP), HREG(R_ESP), -1, -4);
+			break;
+		case OP_POPL:
+			emit_addr(&ctx, i, R_ESP, 0);
+			emit_op_mem(m, 0, 0x8B, 1, H_RCX, H_RSI, H_RCX, 0);
+			emit_op_mem(m, 0, 0x8D, 1, HREG(R_ESP), HREG(R_ESP), -1, 4);
+			emit_op_rr(m, 0, 0x89, 1, H_RCX, HREG(u->rA));
+			break;
+		case OP_XCHGL:
+			emit_addr(&ctx, i, u->rB, u->valC);
+			emit_store_check(&ctx, i);
+			/* test ecx, 3; jnz; xchg [rsi + rcx], rA */
+			emit_op_rr(m, 0, 0xF7, 1, 0, H_RCX);
+			emit4(m, sizeof(val_t) - 1);
+			side_exit(&ctx, i, X86_Z ^ 1);
+			emit_op_mem(m, 0, 0x87, 1, HREG(u->rA), H_RSI, H_RCX, 0);
+			break;
+		}
+	}
+	if (u->op == OP_CHAIN)
+		emit_chain(&ctx, 0, u->pc);
+
+	/* side exits: undo the Step of the rest and step() instruction i */
+	for (i = 0; i < b->n; i++) {
+		if (ctx.nr_exits[i] == 0)
+			continue;
+		while (ctx.nr_exits[i]-- > 0)
+			patch(ctx.exits[i][ctx.nr_exits[i]], m->jit_ptr);
+		emit_op_mem(m, 1, 0x81, 1, 5, H_FRAME, -1, FRAME(Step));
+		emit4(m, b->n - i);
+		emit_op_mem(m, 0, 0xC7, 1, 0, H_FRAME, -1, FRAME(PC));
+		emit4(m, b->uops[i].pc);
+		emit_op_mem(m, 0, 0xC7, 1, 0, H_FRAME, -1, FRAME(exit));
+		emit4(m, JIT_EXIT_STEP);
+		patch(emit_jmp(m), m->jit_leave);
+	}
+
+	b->native = code;
+}
+
+/**
+ * jit_init(m)
+ *
+ * map the code area and emit the code that enters and leaves
+ * compiled blocks.  The JIT stays off if the mapping fails.
+ */
+static void jit_init(struct machine *m)
+{
+	static const int saved[] = {
+		H_RBX, H_RBP, H_R12, H_R13, H_R14, H_R15,
+	};
+	void *area;
+	int i;
+
+	if (m->jit_ptr != NULL)
+		return;
+	area = mmap(NULL, JIT_CODESIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED)
+		return;
+	m->jit_ptr = area;
+
+	/* jit_enter(frame, code) */
+	m->jit_enter = (void (*)(struct jit_frame *, void *))m->jit_ptr;
+	for (i = 0; i < 6; i++) {
+		emit_rex(m, 0, 0, 0, saved[i]);
+		emit1(m, 0x50 + (saved[i] & 7));
+	}
+	for (i = 0; i < 8; i++)
+		emit_op_mem(m, 0, 0x8B, 1, HREG(i), H_FRAME, -1, FRAME(R[i]));
+	emit_op_mem(m, 0, 0x8B, 1, H_CC, H_FRAME, -1, FRAME(CC));
+	emit_op_mem(m, 1, 0x8B, 1, H_DIR, H_FRAME, -1, FRAME(page_dir));
+	emit_op_rr(m, 1, 0x89, 1, H_RSI, H_RAX);
+	emit1(m, 0xFF);
+	emit1(m, 0xE0);
+
+	m->jit_leave = m->jit_ptr;
+	for (i = 0; i < 8; i++)
+		emit_op_mem(m, 0, 0x89, 1, HREG(i), H_FRAME, -1, FRAME(R[i]));
+	emit_op_mem(m, 0, 0x89, 1, H_CC, H_FRAME, -1, FRAME(CC));
+	for (i = 6; i-- > 0; ) {
+		emit_rex(m, 0, 0, 0, saved[i]);
+		emit1(m, 0x58 + (saved[i] & 7));
+	}
+	emit1(m, 0xC3);
+
+	m->jit_base = m->jit_ptr;
+}
+
+/**
+ * jit_run(m, b)
+ *
+ * run compiled block @b and the compiled blocks it chains to,
+ * return the enum jit_exit and store the block that exited in *@b.
+ */
+static int jit_run(struct machine *m, struct block **b)
+{
+	struct jit_frame frame;
+
+	memcpy(frame.R, m->R, sizeof(frame.R));
+	frame.CC = getcc(m);
+	frame.Step = m->Step;
+	frame.limit = m->limit;
+	frame.page_dir = m->page_dir;
+	m->jit_enter(&frame, (*b)->native);
+	memcpy(m->R, frame.R, sizeof(frame.R));
+	setcc(m, frame.CC);
+	m->Step = frame.Step;
+	m->PC = frame.PC;
+	*b = frame.b;
+	return frame.exit;
+}
+#endif
+
+/*
+ * Block engine.
+ *
+ * Runs translated blocks, following the successor links between them.
+ * Step is charged for a whole block on entry and corrected when the
+ * block is left early by a fault or by a store into itself.  PC is
+ * only kept up to date at block boundaries, so devices, which read
+ * Step, are left to step().
+ */
+#ifdef THREADED_GOTO
+#define HANDLER(op)	L_##op
+#define DISPATCH()	goto *u->handler
+#else
+#define HANDLER(op)	case op
+#define DISPATCH()	goto dispatch
+#endif
+
+#define NEXT()						\
+	do {						\
+		u++;					\
+		DISPATCH();				\
+	} while (0)
+
+/* leave the block after u, or at u if it did not complete */
+#define EXIT(done)					\
+	do {						\
+		m->Step -= b->n - (u - b->uops) - (done);	\
+	} while (0)
+
+#define STORE(addr, val)				\
+	do {						\
+		tmp = (val);				\
+		if ((fault = mem_access(m, (addr), 0, 1, &tmp, 1)))	\
+			goto adr;			\
+		if (m->block_dirty) {			\
+			m->block_dirty = 0;		\
+			if (!b->valid)			\
+				goto smc;		\
+		}					\
+	} while (0)
+
+#define LOAD(addr)					\
+	do {						\
+		if ((fault = mem_access(m, (addr), 1, 0, &tmp, 1)))	\
+			goto adr;			\
+	} while (0)
+
+#define CMOV(ifun)					\
+	do {						\
+		if (cond(m, ifun))				\
+			m->R[u->rB] = m->R[u->rA];		\
+		NEXT();					\
+	} while (0)
+
+#define OPL(alufun)					\
+	do {						\
+		m->R[u->rB] = alu(m, alufun, m->R[u->rA], m->R[u->rB], 1);	\
+		NEXT();					\
+	} while (0)
+
+#define CHAIN(i)					\
+	do {						\
+		nb = b->next[i];			\
+		if (nb == NULL || !nb->valid) {		\
+			link = &b->next[i];		\
+			goto lookup;			\
+		}					\
+		b = nb;					\
+		goto enter;				\
+	} while (0)
+
+#define JXX(ifun)					\
+	do {						\
+		if (cond(m, ifun)) {			\
+			m->PC = u->valC;			\
+			CHAIN(1);			\
+		}					\
+		m->PC = u->valP;				\
+		CHAIN(0);				\
+	} while (0)
+
+/**
+ * run_blocks(m, jit)
+ *
+ * run the machine on translated basic blocks until it stops or reaches
+ * its step limit, compiling hot blocks to native code if @jit is set.
+ */
+static inline void run_blocks(struct machine *m, int jit)
+{
+#ifdef THREADED_GOTO
+	static const void *const handlers[NR_OPS + 1] = {
+		[OP_HALT] = &&L_OP_HALT,	[OP_NOP] = &&L_OP_NOP,
+		[OP_RRMOVL] = &&L_OP_RRMOVL,	[OP_CMOVLE] = &&L_OP_CMOVLE,
+		[OP_CMOVL] = &&L_OP_CMOVL,	[OP_CMOVE] = &&L_OP_CMOVE,
+		[OP_CMOVNE] = &&L_OP_CMOVNE,	[OP_CMOVGE] = &&L_OP_CMOVGE,
+		[OP_CMOVG] = &&L_OP_CMOVG,	[OP_IRMOVL] = &&L_OP_IRMOVL,
+		[OP_RMMOVL] = &&L_OP_RMMOVL,	[OP_MRMOVL] = &&L_OP_MRMOVL,
+		[OP_ADDL] = &&L_OP_ADDL,	[OP_SUBL] = &&L_OP_SUBL,
+		[OP_ANDL] = &&L_OP_ANDL,	[OP_XORL] = &&L_OP_XORL,
+		[OP_JMP] = &&L_OP_JMP,		[OP_JLE] = &&L_OP_JLE,
+		[OP_JL] = &&L_OP_JL,		[OP_JE] = &&L_OP_JE,
+		[OP_JNE] = &&L_OP_JNE,		[OP_JGE] = &&L_OP_JGE,
+		[OP_JG] = &&L_OP_JG,		[OP_CALL] = &&L_OP_CALL,
+		[OP_RET] = &&L_OP_RET,		[OP_PUSHL] = &&L_OP_PUSHL,
+		[OP_POPL] = &&L_OP_POPL,	[OP_XCHGL] = &&L_OP_XCHGL,
+		[OP_CHAIN] = &&L_OP_CHAIN,
+	};
+	unsigned int i;
+#endif
+	struct block *b, *nb, **link = NULL;
+	struct uop *u;
+	unsigned int flushes;
+	enum stat stat;
+	val_t addr = 0, tmp;	/* addr: the new %esp at smc */
+	int fault;
+
+lookup:
+	if ((nb = block_lookup(m, m->PC)) == NULL) {
+		flushes = m->block_flushes;
+		if ((nb = translate(m, m->PC, &stat)) == NULL) {
+			if (m->Step < m->limit) {
+				m->Stat = stat;
+				m->Step++;
+			}
+			return;
+		}
+		if (m->block_flushes != flushes)
+			link = NULL;
+#ifdef THREADED_GOTO
+		for (i = 0; i <= nb->n; i++)
+			nb->uops[i].handler = handlers[nb->uops[i].op];
+#endif
+	}
+	if (link != NULL)
+		*link = nb;
+	link = NULL;
+	b = nb;
+enter:
+	if (m->limit - m->Step < b->n) {
+		/* the step limit falls within this block */
+		run_seq(m);
+		return;
+	}
+#ifdef JIT
+	if (jit) {
+		if (b->native == NULL && ++b->count == JIT_THRESHOLD)
+			jit_compile(m, b);
+		if (b->native != NULL) {
+			switch (jit_run(m, &b)) {
+			case JIT_EXIT_NEXT0:
+				CHAIN(0);
+			case JIT_EXIT_NEXT1:
+				CHAIN(1);
+			case JIT_EXIT_LOOKUP:
+				goto lookup;
+			case JIT_EXIT_STEP:
+				if (m->Step == m->limit || step(m))
+					return;
+				goto lookup;
+			}
+		}
+	}
+#endif
+	m->Step += b->n;
+	u = b->uops;
+#ifdef THREADED_GOTO
+	DISPATCH();
+#else
+dispatch:
+	switch (u->op) {
+#endif
+
+	HANDLER(OP_HALT):
+		m->PC = u->pc;
+		m->Stat = S_HLT;
+		return;
+	HANDLER(OP_NOP):
+		NEXT();
+	HANDLER(OP_RRMOVL):
+		m->R[u->rB] = m->R[u->rA];
+		NEXT();
+	HANDLER(OP_CMOVLE):
+		CMOV(C_LE);
+	HANDLER(OP_CMOVL):
+		CMOV(C_L);
+	HANDLER(OP_CMOVE):
+		CMOV(C_E);
+	HANDLER(OP_CMOVNE):
+		CMOV(C_NE);
+	HANDLER(OP_CMOVGE):
+		CMOV(C_GE);
+	HANDLER(OP_CMOVG):
+		CMOV(C_G);
+	HANDLER(OP_IRMOVL):
+		m->R[u->rB] = u->valC;
+		NEXT();
+	HANDLER(OP_RMMOVL):
+		STORE(m->R[u->rB] + u->valC, m->R[u->rA]);
+		NEXT();
+	HANDLER(OP_MRMOVL):
+		LOAD(m->R[u->rB] + u->valC);
+		m->R[u->rA] = tmp;
+		NEXT();
+	HANDLER(OP_ADDL):
+		OPL(A_ADD);
+	HANDLER(OP_SUBL):
+		OPL(A_SUB);
+	HANDLER(OP_ANDL):
+		OPL(A_AND);
+	HANDLER(OP_XORL):
+		OPL(A_XOR);
+	HANDLER(OP_JMP):
+		m->PC = u->valC;
+		CHAIN(1);
+	HANDLER(OP_JLE):
+		JXX(C_LE);
+	HANDLER(OP_JL):
+		JXX(C_L);
+	HANDLER(OP_JE):
+		JXX(C_E);
+	HANDLER(OP_JNE):
+		JXX(C_NE);
+	HANDLER(OP_JGE):
+		JXX(C_GE);
+	HANDLER(OP_JG):
+		JXX(C_G);
+	HANDLER(OP_CALL):
+		addr = m->R[R_ESP] - 4;
+		m->PC = u->valC;
+		STORE(addr, u->valP);
+		m->R[R_ESP] = addr;
+		CHAIN(1);
+	HANDLER(OP_RET):
+		addr = m->R[R_ESP];
+		LOAD(addr);
+		m->R[R_ESP] = addr + 4;
+		m->PC = tmp;
+		goto lookup;
+	HANDLER(OP_PUSHL):
+		addr = m->R[R_ESP] - 4;
+		STORE(addr, m->R[u->rA]);
+		m->R[R_ESP] = addr;
+		NEXT();
+	HANDLER(OP_POPL):
+		addr = m->R[R_ESP];
+		LOAD(addr);
+		m->R[R_ESP] = addr + 4;
+		m->R[u->rA] = tmp;
+		NEXT();
+	HANDLER(OP_XCHGL):
+		tmp = m->R[u->rA];
+		if ((fault = exchange(m, m->R[u->rB] + u->valC, &tmp)))
+			goto adr;
+		m->R[u->rA] = tmp;
+		if (m->block_dirty) {
+			m->block_dirty = 0;
+			if (!b->valid)
+				goto smc;
+		}
+		NEXT();
+	HANDLER(OP_CHAIN):
+		m->PC = u->pc;
+		CHAIN(0);
+
+#ifndef THREADED_GOTO
+	default:
+		m->Stat = S_INS;
+		return;
+	}
+#endif
+smc:
+	/* the store overwrote this block, continue after it */
+	EXIT(1);
+	if (u->op == OP_CALL || u->op == OP_PUSHL)
+		m->R[R_ESP] = addr;
+	m->PC = u->op == OP_CALL ? u->valC : u->valP;
+	goto lookup;
+adr:
+	if (fault > 0) {
+		/* a device: nothing of u is done yet, step() it */
+		EXIT(0);
+		m->PC = u->pc;
+		if (step(m))
+			return;
+		goto lookup;
+	}
+	EXIT(1);
+	m->PC = u->pc;
+	m->Stat = S_ADR;
+}
+
+#undef HANDLER
+#undef DISPATCH
+#undef NEXT
+#undef EXIT
+#undef STORE
+#undef LOAD
+#undef CMOV
+#undef OPL
+#undef CHAIN
+#undef JXX
+
+static void run_block(struct machine *m)
+{
+	run_blocks(m, 0);
+}
+
+#ifdef JIT
+static void run_jit(struct machine *m)
+{
+	jit_init(m);
+	run_blocks(m, 1);
+}
+#endif
+
+struct engine {
+	const char *name;
+	void (*run)(struct machine *m);
+};
+
+static const struct engine engines[] = {
+	{"seq",      run_seq     },
+	{"pipe",     run_pipe    },
+	{"threaded", run_threaded},
+	{"block",    run_block   },
+#ifdef JIT
+	{"jit",      run_jit     },
+#endif
+	{NULL,       NULL        },
+};
+
+/* the name of engine @i, or NULL past the last one */
+const char *machine_engine_name(unsigned int i)
+{
+	return i < sizeof(engines) / sizeof(*engines) ? engines[i].name : NULL;
+}
+
+/**
+ * machine_set_engine(m, name)
+ *
+ * run @m with engine @name from now on, return -1 if there is none.
+ */
+int machine_set_engine(struct machine *m, const char *name)
+{
+	const struct engine *e;
+
+	for (e = engines; e->name != NULL; e++) {
+		if (strcmp(e->name, name) == 0) {
+			m->run = e->run;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* run the engine of @m, or seq if it cannot see the models */
+static void run(struct machine *m)
+{
+	if (m->nr_models > 0 && m->run != run_pipe)
+		run_seq(m);
+	else
+		m->run(m);
+}
+
+/**
+ * machine_set_cache(m, id, cfg)
+ *
+ * give @m cache @id configured by @cfg, or none if @cfg is NULL,
+ * with its statistics cleared.  Return -1 with errno set to EINVAL if
+ * @cfg is not made of powers of two or to ENOMEM if out of memory.
+ */
+int machine_set_cache(struct machine *m, enum cache_id id,
+		      const struct cache_config *cfg)
+{
+	struct cache *c = NULL;
+	unsigned int nr_lines;
+
+	if (id >= NR_CACHES)
+		goto inval;
+	if (cfg != NULL) {
+		if (cfg->block < sizeof(val_t) || (cfg->block & (cfg->block - 1))
+		    || cfg->assoc == 0 || (cfg->assoc & (cfg->assoc - 1))
+		    || cfg->size < cfg->block * cfg->assoc
+		    || (cfg->size & (cfg->size - 1))
+		    || cfg->policy > CACHE_RANDOM)
+			goto inval;
+		nr_lines = cfg->size / cfg->block;
+		c = calloc(1, sizeof(*c) + nr_lines * sizeof(c->lines[0]));
+		if (c == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		c->cfg = *cfg;
+		c->block_shift = __builtin_ctz(cfg->block);
+		c->nr_sets = nr_lines / cfg->assoc;
+		c->seed = 2463534242U;
+	}
+	m->nr_models += (c != NULL) - (m->caches[id] != NULL);
+	free(m->caches[id]);
+	m->caches[id] = c;
+	return 0;
+
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * machine_cache_stats(m, id)
+ *
+ * return the statistics of cache @id of @m, or NULL if it has none.
+ */
+const struct cache_stats *machine_cache_stats(const struct machine *m,
+					      enum cache_id id)
+{
+	return id < NR_CACHES && m->caches[id] != NULL ? &m->caches[id]->stats
+						       : NULL;
+}
+
+/**
+ * machine_set_predictor(m, cfg)
+ *
+ * give @m the branch predictor configured by @cfg, or none if @cfg is
+ * NULL.  Return -1 with errno set to EINVAL if @cfg is invalid or to
+ * ENOMEM if out of memory.
+ */
+int machine_set_predictor(struct machine *m,
+			  const struct predictor_config *cfg)
+{
+	struct predictor *p = NULL;
+
+	if (cfg != NULL) {
+		if (cfg->kind > PREDICT_GSHARE || cfg->bits > 24) {
+			errno = EINVAL;
+			return -1;
+		}
+		p = calloc(1, sizeof(*p) + (1U << cfg->bits));
+		if (p == NULL || (cfg->ras_depth > 0 && (p->ras = calloc(
+				cfg->ras_depth, sizeof(*p->ras))) == NULL)) {
+			free(p);
+			errno = ENOMEM;
+			return -1;
+		}
+		p->cfg = *cfg;
+		/* weakly taken */
+		memset(p->counters, 2, 1U << cfg->bits);
+	}
+	m->nr_models += (p != NULL) - (m->predictor != NULL);
+	if (m->predictor != NULL) {
+		free(m->predictor->ras);
+		free(m->predictor->sites.sites);
+		free(m->predictor);
+	}
+	m->predictor = p;
+	return 0;
+}
+
+const struct predictor_stats *machine_predictor_stats(const struct machine *m)
+{
+	return m->predictor != NULL ? &m->predictor->stats : NULL;
+}
+
+/**
+ * machine_predictor_sites(m, fn, arg)
+ *
+ * call @fn(@arg, pc, is_ret, count, misses) for every predicted jXX
+ * or ret, in ascending order of pc.
+ */
+void machine_predictor_sites(struct machine *m,
+			     void (*fn)(void *arg, val_t pc, int is_ret,
+					unsigned long long count,
+					unsigned long long misses),
+			     void *arg)
+{
+	struct site *sites;
+
+	if (m->predictor == NULL
+	    || (sites = site_sort(&m->predictor->sites)) == NULL)
+		return;
+	for (size_t i = 0; i < m->predictor->sites.nr_sites; i++)
+		fn(arg, sites[i].pc, sites[i].is_ret, sites[i].count,
+		   sites[i].misses);
+	free(sites);
+}
+
+static void call_free(struct call_node *node)
+{
+	struct call_node *next;
+
+	for (; node != NULL; node = next) {
+		next = node->next;
+		call_free(node->child);
+		free(node);
+	}
+}
+
+/**
+ * machine_set_profile(m, on)
+ *
+ * start profiling @m from scratch if @on, else stop and forget the
+ * profile.  Return -1 with errno set to ENOMEM if out of memory.
+ */
+int machine_set_profile(struct machine *m, int on)
+{
+	struct profile *p = NULL;
+
+	if (on) {
+		if ((p = calloc(1, sizeof(*p))) == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		p->leader = 1;
+		p->root.pc = m->PC;
+		p->node = &p->root;
+	}
+	m->nr_models += (p != NULL) - (m->profile != NULL);
+	if (m->profile != NULL) {
+		call_free(m->profile->root.child);
+		free(m->profile->pcs.sites);
+		free(m->profile);
+	}
+	m->profile = p;
+	return 0;
+}
+
+/**
+ * machine_profile_pcs(m, fn, arg)
+ *
+ * call @fn(@arg, pc, count, leader) for every pc executed while
+ * profiling, in ascending order: it ran @count times, and @leader if
+ * it started a basic block at least once.
+ */
+void machine_profile_pcs(struct machine *m,
+			 void (*fn)(void *arg, val_t pc,
+				    unsigned long long count, int leader),
+			 void *arg)
+{
+	struct site *sites;
+
+	if (m->profile == NULL || (sites = site_sort(&m->profile->pcs)) == NULL)
+		return;
+	for (size_t i = 0; i < m->profile->pcs.nr_sites; i++)
+		fn(arg, sites[i].pc, sites[i].count, sites[i].leader);
+	free(sites);
+}
+
+static void call_walk(const struct call_node *node, val_t *stack,
+		      unsigned int depth,
+		      void (*fn)(void *arg, const val_t *stack,
+				 unsigned int depth,
+				 unsigned long long count),
+		      void *arg)
+{
+	for (; node != NULL; node = node->next) {
+		stack[depth] = node->pc;
+		if (node->self > 0)
+			fn(arg, stack, depth + 1, node->self);
+		call_walk(node->child, stack, depth + 1, fn, arg);
+	}
+}
+
+/**
+ * machine_profile_stacks(m, fn, arg)
+ *
+ * call @fn(@arg, stack, depth, count) for every chain of calls that
+ * executed instructions while profiling: @stack holds the entries of
+ * the @depth functions of the chain, outermost first, and @count the
+ * instructions executed in the innermost one.
+ */
+void machine_profile_stacks(struct machine *m,
+			    void (*fn)(void *arg, const val_t *stack,
+				       unsigned int depth,
+				       unsigned long long count),
+			    void *arg)
+{
+	val_t stack[PROFILE_DEPTH + 1];
+
+	if (m->profile != NULL)
+		call_walk(&m->profile->root, stack, 0, fn, arg);
+}
+
+/* a machine on memory @mem, or on a memory of its own if NULL */
+static struct machine *machine_alloc(struct memory *mem)
+{
+	struct machine *m = calloc(1, sizeof(*m));
+
+	if (m == NULL)
+		return NULL;
+	if (mem == NULL) {
+		if ((mem = calloc(1, sizeof(*mem))) == NULL) {
+			free(m);
+			return NULL;
+		}
+		INIT_LIST_HEAD(&mem->dirty);
+		pthread_mutex_init(&mem->lock, NULL);
+	}
+	m->mem = mem;
+	m->page_dir = mem->dir;
+	m->Stat = S_AOK;
+	m->cc_op = CC_NONE;
+	m->run = run_seq;
+	return m;
+}
+
+/**
+ * machine_create(image, len)
+ *
+ * return a new machine running the seq engine with @image loaded at
+ * address 0 and everything else zero, or NULL if out of memory.
+ */
+struct machine *machine_create(const byte *image, size_t len)
+{
+	struct machine *m = machine_alloc(NULL);
+
+	if (m != NULL && load(m, 0, image, len)) {
+		machine_destroy(m);
+		return NULL;
+	}
+	return m;
+}
+
+/* free the memory of @m and all its pages */
+static void memory_free(struct machine *m)
+{
+	struct page **table;
+
+	for (val_t d = 0; d < DIR_SIZE; d++) {
+		if ((table = m->page_dir[d]) == NULL)
+			continue;
+		for (val_t t = 0; t < TABLE_SIZE; t++)
+			if (table[t] != NULL)
+				page_remove(m, table[t]);
+		free(table);
+	}
+	pthread_mutex_destroy(&m->mem->lock);
+	free(m->mem);
+}
+
+/* free @m but not its memory */
+static void machine_free(struct machine *m)
+{
+	machine_record(m, 0, 0);
+	for (int i = 0; i < NR_CACHES; i++)
+		free(m->caches[i]);
+	machine_set_predictor(m, NULL);
+	machine_set_profile(m, 0);
+#ifdef JIT
+	if (m->jit_enter != NULL)
+		munmap((void *)m->jit_enter, JIT_CODESIZE);
+#endif
+	free(m);
+}
+
+/* destroy @m, which must not be a core of an smp (see smp_destroy()) */
+void machine_destroy(struct machine *m)
+{
+	memory_free(m);
+	machine_free(m);
+}
+
+/*
+ * Multi-core machines.
+ *
+ * The cores of an smp are machines sharing one memory.  Each has its
+ * own PC, registers, CC, Step and status, its own engine, models and
+ * translations of the code, but no snapshots or history.
+ *
+ * Memory model: every core sees its own accesses in program order.
+ * With a quantum, the cores take turns on one thread, so every core
+ * sees every store as soon as it is made: the run is sequentially
+ * consistent and the same every time.  On threads of their own:
+ *
+ *  - aligned words are loaded and stored whole, others may tear;
+ *  - the stores of a core may become visible to the others late and,
+ *    on hosts weaker than x86-64, in another order than they were made;
+ *  - xchgl is atomic and a full barrier: the accesses of a core before
+ *    it are visible to all cores before it is, and those after it are
+ *    made after it;
+ *  - code stored while another core may run it is undefined: that core
+ *    may run the old code, or the new one.
+ *
+ * So two cores only agree on the order of accesses through xchgl, and
+ * a lock made of it orders the accesses made under it.  xchgl faults
+ * with ADR on a misaligned address with and without cores.
+ */
+
+/**
+ * smp_create(image, len, nr_cores)
+ *
+ * return @nr_cores cores sharing a memory with @image loaded at address
+ * 0, or NULL if out of memory.  Every core starts like a machine from
+ * machine_create(), except that %eax holds its number.
+ */
+struct smp *smp_create(const byte *image, size_t len, unsigned int nr_cores)
+{
+	struct smp *s = calloc(1, sizeof(*s));
+	struct page **table;
+	struct machine *m;
+
+	if (s == NULL)
+		return NULL;
+	if (nr_cores == 0
+	    || (s->cores = calloc(nr_cores, sizeof(*s->cores))) == NULL
+	    || (m = machine_create(image, len)) == NULL)
+		goto fail;
+	s->cores[s->nr_cores++] = m;
+
+	/* see struct memory */
+	for (val_t d = 0; d < DIR_SIZE; d++) {
+		if ((table = m->page_dir[d]) == NULL)
+			continue;
+		for (val_t t = 0; t < TABLE_SIZE; t++)
+			if (table[t] != NULL && !table[t]->writable
+			    && page_own(m, table[t]))
+				goto fail;
+	}
+	m->mem->smp = s;
+
+	while (s->nr_cores < nr_cores) {
+		if ((m = machine_alloc(m->mem)) == NULL)
+			goto fail;
+		m->R[R_EAX] = s->nr_cores;
+		s->cores[s->nr_cores++] = m;
+	}
+	return s;
+
+fail:
+	smp_destroy(s);
+	return NULL;
+}
+
+void smp_destroy(struct smp *s)
+{
+	if (s->nr_cores > 0)
+		memory_free(s->cores[0]);
+	for (unsigned int i = 0; i < s->nr_cores; i++)
+		machine_free(s->cores[i]);
+	free(s->cores);
+	free(s);
+}
+
+unsigned int smp_nr_cores(const struct smp *s)
+{
+	return s->nr_cores;
+}
+
+struct machine *smp_core(struct smp *s, unsigned int i)
+{
+	return i < s->nr_cores ? s->cores[i] : NULL;
+}
+
+/* S_AOK if a core of @s can go on, else the first fault or S_HLT */
+static enum stat smp_stat(const struct smp *s)
+{
+	enum stat stat = S_HLT;
+
+	for (unsigned int i = s->nr_cores; i-- > 0; ) {
+		if (s->cores[i]->Stat == S_AOK)
+			return S_AOK;
+		if (s->cores[i]->Stat != S_HLT)
+			stat = s->cores[i]->Stat;
+	}
+	return stat;
+}
+
+struct smp_thread {
+	pthread_t thread;
+	struct machine *m;
+	unsigned long long steps;
+	pthread_mutex_t *lock;
+	pthread_cond_t *cond;
+	int *go;		/* 1: run, -1: give up, 0: wait */
+};
+
+static void *smp_thread(void *arg)
+{
+	struct smp_thread *t = arg;
+	int go;
+
+	pthread_mutex_lock(t->lock);
+	while ((go = *t->go) == 0)
+		pthread_cond_wait(t->cond, t->lock);
+	pthread_mutex_unlock(t->lock);
+	if (go > 0)
+		machine_run(t->m, t->steps);
+	return NULL;
+}
+
+/*
+ * run every core of @s on a thread of its own, core 0 on this one,
+ * return -1 if the threads cannot all be created
+ */
+static int smp_run_threads(struct smp *s, unsigned long long steps)
+{
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	struct smp_thread threads[s->nr_cores];
+	unsigned int i, n;
+	int go = 0;
+
+	for (n = 1; n < s->nr_cores; n++) {
+		threads[n] = (struct smp_thread){
+			.m = s->cores[n], .steps = steps,
+			.lock = &lock, .cond = &cond, .go = &go,
+		};
+		if (pthread_create(&threads[n].thread, NULL, smp_thread,
+				   &threads[n]) != 0)
+			break;
+	}
+	/* start them all at once, or none of them */
+	pthread_mutex_lock(&lock);
+	go = n == s->nr_cores ? 1 : -1;
+	s->threads = go > 0;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	if (go > 0)
+		machine_run(s->cores[0], steps);
+	for (i = 1; i < n; i++)
+		pthread_join(threads[i].thread, NULL);
+	s->threads = 0;
+	return go > 0 ? 0 : -1;
+}
+
+/**
+ * smp_run(s, steps, quantum)
+ *
+ * run every core of @s for at most @steps instructions of its own,
+ * return S_AOK if some core can go on, else the status of the first
+ * core that faulted, or S_HLT.  The cores take turns running @quantum
+ * instructions each in order on this thread, or with SMP_THREADS run
+ * on threads of their own; if those cannot be created, they take
+ * turns of one instruction.  A core that stops leaves the others be.
+ */
+enum stat smp_run(struct smp *s, unsigned long long steps,
+		  unsigned long long quantum)
+{
+	unsigned long long end[s->nr_cores], n;
+	struct machine *m;
+	unsigned int i;
+	int running;
+
+	if (quantum == SMP_THREADS) {
+		if (smp_run_threads(s, steps) == 0)
+			return smp_stat(s);
+		quantum = 1;
+	}
+	for (i = 0; i < s->nr_cores; i++) {
+		m = s->cores[i];
+		end[i] = steps > ULLONG_MAX - m->Step ? ULLONG_MAX
+		       : m->Step + steps;
+	}
+	do {
+		running = 0;
+		for (i = 0; i < s->nr_cores; i++) {
+			m = s->cores[i];
+			if (m->Stat != S_AOK || m->Step >= end[i])
+				continue;
+			n = end[i] - m->Step < quantum ? end[i] - m->Step
+						       : quantum;
+			if (machine_run(m, n) == S_AOK && m->Step < end[i])
+				running = 1;
+		}
+	} while (running);
+	return smp_stat(s);
+}
+
+/*
+ * Snapshots.
+ *
+ * A snapshot is the architectural state of a machine plus references
+ * to the data of all its pages, sorted by address.  Taking one only
+ * makes the pages of the machine read-only, so both sides copy a page
+ * on their next store to it.  Restoring swaps in the data of the pages
+ * that differ and drops the translations of those pages only.
+ */
+struct snapshot_page {
+	val_t base;
+	struct page_data *data;
+	struct page_data *orig;		/* or NULL */
+};
+
+struct snapshot {
+	val_t PC, CC, R[8];
+	unsigned long long Step;
+	enum stat Stat;
+	size_t nr_pages;
+	struct snapshot_page pages[];
+};
+
+static struct snapshot *snapshot_alloc(size_t nr_pages)
+{
+	struct snapshot *s;
+
+	s = calloc(1, sizeof(*s) + nr_pages * sizeof(s->pages[0]));
+	if (s != NULL)
+		s->nr_pages = nr_pages;
+	return s;
+}
+
+void snapshot_free(struct snapshot *s)
+{
+	for (size_t i = 0; i < s->nr_pages; i++) {
+		data_put(s->pages[i].data);
+		data_put(s->pages[i].orig);
+	}
+	free(s);
+}
+
+/**
+ * machine_snapshot(m)
+ *
+ * return a snapshot of @m, or NULL with errno set if out of memory or
+ * to EINVAL if @m is a core of an smp.
+ */
+struct snapshot *machine_snapshot(struct machine *m)
+{
+	struct snapshot_page *sp;
+	struct page **table, *p;
+	struct snapshot *s;
+
+	if (m->mem->smp != NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((s = snapshot_alloc(m->mem->nr_pages)) == NULL)
+		return NULL;
+	s->PC = m->PC;
+	s->CC = getcc(m);
+	memcpy(s->R, m->R, sizeof(s->R));
+	s->Step = m->Step;
+	s->Stat = m->Stat;
+	sp = s->pages;
+	for (val_t d = 0; d < DIR_SIZE; d++) {
+		if ((table = m->page_dir[d]) == NULL)
+			continue;
+		for (val_t t = 0; t < TABLE_SIZE; t++) {
+			if ((p = table[t]) == NULL)
+				continue;
+			sp->base = p->base;
+			sp->data = data_get(p->data);
+			sp->orig = data_get(p->orig);
+			p->writable = 0;
+			sp++;
+		}
+	}
+	return s;
+}
+
+static int snapshot_page_cmp(const void *key, const void *elem)
+{
+	val_t base = *(const val_t *)key;
+	const struct snapshot_page *sp = elem;
+
+	return base < sp->base ? -1 : base > sp->base;
+}
+
+/* drop every translation of the code in page @p */
+static void page_forget(struct machine *m, struct page *p)
+{
+	dcache_invalidate(m, p->base, PAGE_SIZE);
+	block_invalidate(m, p->base, PAGE_SIZE);
+	free(p->code);
+	p->code = NULL;
+}
+
+static void page_set_orig(struct machine *m, struct page *p,
+			  struct page_data *orig)
+{
+	if (p->orig == orig)
+		return;
+	if (p->orig == NULL) {
+		list_add(&p->dirty, &m->mem->dirty);
+		m->mem->nr_dirty++;
+	} else if (orig == NULL) {
+		list_del(&p->dirty);
+		m->mem->nr_dirty--;
+	}
+	data_put(p->orig);
+	p->orig = data_get(orig);
+}
+
+/*
+ * put @m back in the state of @s, leaving its history alone; a page
+ * there is no memory for leaves it stopped on S_ADR
+ */
+static void restore(struct machine *m, const struct snapshot *s)
+{
+	const struct snapshot_page *sp;
+	struct page **table, *p;
+	int lost = 0;
+
+	for (val_t d = 0; d < DIR_SIZE; d++) {
+		if ((table = m->page_dir[d]) == NULL)
+			continue;
+		for (val_t t = 0; t < TABLE_SIZE; t++) {
+			if ((p = table[t]) == NULL)
+				continue;
+			sp = bsearch(&p->base, s->pages, s->nr_pages,
+				     sizeof(*sp), snapshot_page_cmp);
+			if (sp == NULL) {
+				page_forget(m, p);
+				page_remove(m, p);
+				continue;
+			}
+			if (p->data != sp->data) {
+				page_forget(m, p);
+				data_put(p->data);
+				p->data = data_get(sp->data);
+			}
+			page_set_orig(m, p, sp->orig);
+			p->writable = 0;
+		}
+	}
+	for (sp = s->pages; sp < s->pages + s->nr_pages; sp++) {
+		if (page_find(m, sp->base) != NULL
+		    || is_device(m, sp->base, PAGE_SIZE))
+			continue;
+		p = page_insert(m, sp->base, sp->data, 0);
+		if (p == NULL) {
+			lost = 1;
+			continue;
+		}
+		data_get(sp->data);
+		page_set_orig(m, p, sp->orig);
+	}
+
+	m->PC = s->PC;
+	setcc(m, s->CC);
+	memcpy(m->R, s->R, sizeof(s->R));
+	m->Step = s->Step;
+	m->Stat = lost ? S_ADR : s->Stat;
+	pipe_flush(m);
+}
+
+/**
+ * machine_restore(m, s)
+ *
+ * put @m back in the state of snapshot @s, which may have been taken
+ * from another machine.  The history of @m starts over.  Cores of an
+ * smp are left alone.
+ */
+void machine_restore(struct machine *m, const struct snapshot *s)
+{
+	if (m->mem->smp != NULL)
+		return;
+	restore(m, s);
+	machine_record(m, m->ckpt_interval, m->max_ckpts);
+}
+
+/**
+ * machine_fork(m)
+ *
+ * return a new machine in the state of @m, running the same engine,
+ * that shares the pages of @m until either side writes them.
+ */
+struct machine *machine_fork(struct machine *m)
+{
+	struct snapshot *s;
+	struct machine *child;
+
+	if ((s = machine_snapshot(m)) == NULL)
+		return NULL;
+	if ((child = machine_create(NULL, 0)) != NULL) {
+		machine_restore(child, s);
+		child->run = m->run;
+	}
+	snapshot_free(s);
+	return child;
+}
+
+/*
+ * Checkpoint files hold a snapshot in little endian:
+ *
+ *	"Y86SNAP1", PC, CC, R[0..7], Stat, Step (64 bits), nr_pages
+ *
+ * then for each page its base, its SNAP_* flags, its data unless
+ * SNAP_DATA_ZERO and its original data if SNAP_ORIG and neither
+ * SNAP_ORIG_ZERO nor SNAP_ORIG_SAME.  Fields are 32 bits wide.
+ */
+#define SNAP_MAGIC	"Y86SNAP1"
+#define SNAP_DATA_ZERO	0x1	/* data is all zero */
+#define SNAP_ORIG	0x2	/* orig is kept */
+#define SNAP_ORIG_ZERO	0x4	/* ... and is all zero */
+#define SNAP_ORIG_SAME	0x8	/* ... and is the data */
+#define SNAP_FLAGS	0xf
+
+static void put32(FILE *out, val_t x)
+{
+	for (int i = 0; i < 4; i++)
+		fputc(x >> (8 * i), out);
+}
+
+static int get32(FILE *in, val_t *x)
+{
+	byte b[4];
+
+	if (fread(b, 1, sizeof(b), in) != sizeof(b))
+		return -1;
+	*x = b[0] | b[1] << 8 | b[2] << 16 | (val_t)b[3] << 24;
+	return 0;
+}
+
+static int is_zero(const byte *bytes)
+{
+	for (int i = 0; i < PAGE_SIZE; i++)
+		if (bytes[i] != 0)
+			return 0;
+	return 1;
+}
+
+/**
+ * snapshot_save(s, out)
+ *
+ * write snapshot @s to @out, return 0 on success, or -1 with errno set.
+ */
+int snapshot_save(const struct snapshot *s, FILE *out)
+{
+	const struct snapshot_page *sp;
+	val_t flags;
+
+	fwrite(SNAP_MAGIC, 1, 8, out);
+	put32(out, s->PC);
+	put32(out, s->CC);
+	for (int i = 0; i < 8; i++)
+		put32(out, s->R[i]);
+	put32(out, s->Stat);
+	put32(out, s->Step);
+	put32(out, s->Step >> 32);
+	put32(out, s->nr_pages);
+	for (sp = s->pages; sp < s->pages + s->nr_pages; sp++) {
+		flags = is_zero(sp->data->bytes) ? SNAP_DATA_ZERO : 0;
+		if (sp->orig == sp->data)
+			flags |= SNAP_ORIG | SNAP_ORIG_SAME;
+		else if (sp->orig != NULL)
+			flags |= SNAP_ORIG
+			       | (is_zero(sp->orig->bytes) ? SNAP_ORIG_ZERO : 0);
+		put32(out, sp->base);
+		put32(out, flags);
+		if (!(flags & SNAP_DATA_ZERO))
+			fwrite(sp->data->bytes, 1, PAGE_SIZE, out);
+		if ((flags & SNAP_ORIG)
+		    && !(flags & (SNAP_ORIG_ZERO | SNAP_ORIG_SAME)))
+			fwrite(sp->orig->bytes, 1, PAGE_SIZE, out);
+	}
+	return ferror(out) ? -1 : 0;
+}
+
+/* read page data from @in unless @zero, or NULL */
+static struct page_data *data_read(FILE *in, int zero)
+{
+	struct page_data *data = data_alloc();
+
+	if (data != NULL && !zero
+	    && fread(data->bytes, 1, PAGE_SIZE, in) != PAGE_SIZE) {
+		data_put(data);
+		return NULL;
+	}
+	return data;
+}
+
+/**
+ * snapshot_load(in)
+ *
+ * read a snapshot written by snapshot_save() from @in,
+ * return NULL with errno set on failure (EINVAL: not a snapshot).
+ */
+struct snapshot *snapshot_load(FILE *in)
+{
+	struct snapshot_page *sp;
+	struct snapshot *s;
+	char magic[8];
+	val_t regs[13], flags, nr_pages;
+
+	if (fread(magic, 1, 8, in) != 8 || memcmp(magic, SNAP_MAGIC, 8) != 0)
+		goto bad;
+	for (int i = 0; i < 13; i++)
+		if (get32(in, &regs[i]))
+			goto bad;
+	if (get32(in, &nr_pages) || nr_pages > DIR_SIZE * TABLE_SIZE
+	    || regs[10] < S_AOK || regs[10] > S_INS)
+		goto bad;
+	if ((s = snapshot_alloc(nr_pages)) == NULL)
+		return NULL;
+	s->PC = regs[0];
+	s->CC = regs[1] & ((1 << F_OF) | (1 << F_SF) | (1 << F_ZF));
+	memcpy(s->R, &regs[2], sizeof(s->R));
+	s->Stat = regs[10];
+	s->Step = regs[11] | (unsigned long long)regs[12] << 32;
+	for (sp = s->pages; sp < s->pages + nr_pages; sp++) {
+		if (get32(in, &sp->base) || get32(in, &flags)
+		    || (sp->base & PAGE_MASK) || (flags & ~SNAP_FLAGS)
+		    || (sp > s->pages && sp->base <= sp[-1].base))
+			goto bad_snapshot;
+		if ((sp->data = data_read(in, flags & SNAP_DATA_ZERO)) == NULL)
+			goto bad_snapshot;
+		if (!(flags & SNAP_ORIG))
+			continue;
+		if (flags & SNAP_ORIG_SAME)
+			sp->orig = data_get(sp->data);
+		else if ((sp->orig = data_read(in, flags & SNAP_ORIG_ZERO))
+			 == NULL)
+			goto bad_snapshot;
+	}
+	return s;
+
+bad_snapshot:
+	snapshot_free(s);
+bad:
+	errno = EINVAL;
+	return NULL;
+}
+
+/*
+ * the memory stores of machine_write(), outside of the history,
+ * return -1 if out of memory
+ */
+static int mem_write(struct machine *m, val_t addr, const void *buf,
+		     size_t len)
+{
+	const byte *src = buf;
+	val_t start = addr;
+	size_t n, total = len;
+	struct page *p;
+	int ret = 0;
+
+	for (; len > 0; addr += n, src += n, len -= n) {
+		n = PAGE_SIZE - (addr & PAGE_MASK);
+		if (n > len)
+			n = len;
+		if ((p = page_store(m, addr)) == NULL) {
+			ret = -1;
+			break;
+		}
+		memcpy(&p->data->bytes[addr & PAGE_MASK], src, n);
+	}
+	if (total > 0 && is_code(m, start, total))
+		smc(m, start, total);
+	return ret;
+}
+
+/**
+ * step_undo(m)
+ *
+ * step() that first logs how to revert the step in m->undo.
+ */
+static int step_undo(struct machine *m)
+{
+	struct undo *u = &m->undo[m->nr_undo++];
+	const struct decoded *d;
+	enum stat stat;
+	val_t R[8], addr;
+	int i = 0, ret;
+
+	u->PC = m->PC;
+	u->reg[0] = u->reg[1] = R_NONE;
+	u->flags = 0;
+	if ((d = fetch(m, m->PC, &stat)) != NULL) {
+		if (d->set_cc) {
+			u->cc = getcc(m);
+			u->flags |= UNDO_CC;
+		}
+		addr = mem_addr(m, d);
+		if (d->mem_write
+		    && machine_read(m, addr, &u->mem, sizeof(u->mem)) == 0) {
+			u->addr = addr;
+			u->flags |= UNDO_MEM;
+		}
+	}
+	memcpy(R, m->R, sizeof(R));
+	ret = step(m);
+	for (regid_t r = R_EAX; r <= R_EDI; r++) {
+		if (m->R[r] != R[r]) {
+			u->reg[i] = r;
+			u->val[i++] = R[r];
+		}
+	}
+	return ret;
+}
+
+/* revert the last step logged in m->undo, return -1 if out of memory */
+static int step_back(struct machine *m)
+{
+	const struct undo *u = &m->undo[m->nr_undo - 1];
+
+	if ((u->flags & UNDO_MEM)
+	    && mem_write(m, u->addr, &u->mem, sizeof(u->mem)))
+		return -1;
+	m->nr_undo--;
+	for (int i = 0; i < 2; i++)
+		if (u->reg[i] != R_NONE)
+			m->R[u->reg[i]] = u->val[i];
+	if (u->flags & UNDO_CC)
+		setcc(m, u->cc);
+	m->PC = u->PC;
+	m->Step--;
+	m->Stat = S_AOK;
+	return 0;
+}
+
+/* take a checkpoint of @m, thinning out the older ones if needed */
+static int history_checkpoint(struct machine *m)
+{
+	struct snapshot *s;
+	unsigned int i;
+
+	if ((s = machine_snapshot(m)) == NULL)
+		return -1;
+	if (m->nr_ckpts == m->max_ckpts) {
+		for (i = 1; 2 * i < m->nr_ckpts; i++) {
+			snapshot_free(m->ckpts[2 * i - 1]);
+			m->ckpts[i] = m->ckpts[2 * i];
+		}
+		if (m->nr_ckpts % 2 == 0)
+			snapshot_free(m->ckpts[m->nr_ckpts - 1]);
+		m->nr_ckpts = i;
+		if (m->ckpt_interval <= ULLONG_MAX / 2)
+			m->ckpt_interval *= 2;
+	}
+	m->ckpts[m->nr_ckpts++] = s;
+	return 0;
+}
+
+/**
+ * history_replay(m, to)
+ *
+ * bring @m to step @to by replaying from the last checkpoint before it,
+ * logging the last UNDO_MAX steps.  Return -1 if @to is older than
+ * the history.
+ */
+static int history_replay(struct machine *m, unsigned long long to)
+{
+	struct snapshot *s = NULL;
+
+	for (unsigned int i = 0; i < m->nr_ckpts; i++)
+		if (m->ckpts[i]->Step < to || (i == 0 && m->ckpts[i]->Step == to))
+			s = m->ckpts[i];
+	if (s == NULL)
+		return -1;
+	restore(m, s);
+	if (to - m->Step > UNDO_MAX) {
+		m->limit = to - UNDO_MAX;
+		/* the models and the pipe have seen these steps already */
+		if (m->nr_models > 0 || m->run == run_pipe)
+			while (m->Step < m->limit && step(m) == 0)
+				;
+		else
+			m->run(m);
+	}
+	m->nr_undo = 0;
+	m->undo_step = m->Step;
+	while (m->Step < to && step_undo(m) == 0)
+		;
+	return 0;
+}
+
+/**
+ * machine_record(m, interval, depth)
+ *
+ * start recording the history of @m from now on, keeping at most
+ * @depth checkpoints, @interval steps apart at first; an @interval of
+ * 0 stops recording.  Return 0 on success, or -1 with errno set
+ * (EINVAL: bad @depth, or @m is a core of an smp).
+ */
+int machine_record(struct machine *m, unsigned long long interval,
+		   unsigned int depth)
+{
+	while (m->nr_ckpts > 0)
+		snapshot_free(m->ckpts[--m->nr_ckpts]);
+	free(m->ckpts);
+	free(m->undo);
+	m->ckpts = NULL;
+	m->undo = NULL;
+	m->nr_undo = 0;
+	m->max_ckpts = 0;
+	m->ckpt_interval = 0;
+	if (interval == 0)
+		return 0;
+	if (depth < 2 || m->mem->smp != NULL || m->mem->devices) {
+		errno = EINVAL;
+		return -1;
+	}
+	m->ckpts = malloc(depth * sizeof(*m->ckpts));
+	m->undo = malloc(UNDO_MAX * sizeof(*m->undo));
+	if (m->ckpts == NULL || m->undo == NULL)
+		goto nomem;
+	m->max_ckpts = depth;
+	m->ckpt_interval = interval;
+	if (history_checkpoint(m))
+		goto nomem;
+	return 0;
+
+nomem:
+	machine_record(m, 0, 0);
+	errno = ENOMEM;
+	return -1;
+}
+
+/**
+ * machine_history(m)
+ *
+ * return the first step @m can go back to.
+ */
+unsigned long long machine_history(const struct machine *m)
+{
+	return m->nr_ckpts > 0 ? m->ckpts[0]->Step : m->Step;
+}
+
+/**
+ * machine_reverse(m, step)
+ *
+ * bring @m back to the state it had after @step steps,
+ * return -1 if that is in the future or before its history, or if out
+ * of memory.
+ */
+int machine_reverse(struct machine *m, unsigned long long step)
+{
+	if (step > m->Step)
+		return -1;
+	if (m->undo_step + m->nr_undo == m->Step && step >= m->undo_step) {
+		while (m->Step > step)
+			if (step_back(m))
+				return -1;
+		return 0;
+	}
+	return history_replay(m, step);
+}
+
+/**
+ * machine_reverse_write(m, addr, len)
+ *
+ * bring @m back to the state it had right before the last step that
+ * stored into [@addr, @addr + @len), return -1 and leave it alone if
+ * no step of its history did.
+ */
+int machine_reverse_write(struct machine *m, val_t addr, size_t len)
+{
+	unsigned long long now = m->Step;
+	const struct undo *u;
+
+	while (m->Step > machine_history(m)) {
+		if (m->nr_undo == 0 || m->undo_step + m->nr_undo != m->Step)
+			history_replay(m, m->Step);
+		while (m->nr_undo > 0) {
+			u = &m->undo[m->nr_undo - 1];
+			if (step_back(m))
+				return -1;
+			if ((u->flags & UNDO_MEM)
+			    && u->addr < (unsigned long long)addr + len
+			    && addr < u->addr + sizeof(u->mem))
+				return 0;
+		}
+	}
+	history_replay(m, now);
+	return -1;
+}
+
+/**
+ * machine_run(m, steps)
+ *
+ * run @m for at most @steps instructions (MACHINE_FOREVER: until it
+ * stops), return its status, S_AOK if it can go on.
+ */
+enum stat machine_run(struct machine *m, unsigned long long steps)
+{
+	unsigned long long limit, next;
+	struct snapshot *last;
+
+	if (m->Stat != S_AOK)
+		return m->Stat;
+	limit = steps > ULLONG_MAX - m->Step ? ULLONG_MAX : m->Step + steps;
+	if (m->max_ckpts == 0) {
+		m->limit = limit;
+		run(m);
+		return m->Stat;
+	}
+
+	/* stop at every checkpoint, old or new */
+	m->nr_undo = 0;
+	do {
+		last = m->ckpts[m->nr_ckpts - 1];
+		next = m->ckpt_interval > ULLONG_MAX - last->Step ? ULLONG_MAX
+		     : last->Step + m->ckpt_interval;
+		for (unsigned int i = m->nr_ckpts; i-- > 0; )
+			if (m->ckpts[i]->Step > m->Step)
+				next = m->ckpts[i]->Step;
+		if (next > limit)
+			next = limit;
+		m->limit = next;
+		run(m);
+		if (m->Stat == S_AOK && m->Step > last->Step
+		    && m->Step == last->Step + m->ckpt_interval)
+			history_checkpoint(m);
+	} while (m->Stat == S_AOK && m->Step < limit);
+	return m->Stat;
+}
+
+const struct pipe_stats *machine_pipe_stats(const struct machine *m)
+{
+	return &m->pipe.stats;
+}
+
+enum stat machine_stat(const struct machine *m)
+{
+	return m->Stat;
+}
+
+unsigned long long machine_steps(const struct machine *m)
+{
+	return m->Step;
+}
+
+val_t machine_pc(const struct machine *m)
+{
+	return m->PC;
+}
+
+void machine_set_pc(struct machine *m, val_t pc)
+{
+	m->PC = pc;
+	machine_record(m, m->ckpt_interval, m->max_ckpts);
+}
+
+val_t machine_reg(const struct machine *m, regid_t reg)
+{
+	return reg <= R_EDI ? m->R[reg] : 0;
+}
+
+void machine_set_reg(struct machine *m, regid_t reg, val_t val)
+{
+	if (reg <= R_EDI)
+		m->R[reg] = val;
+	machine_record(m, m->ckpt_interval, m->max_ckpts);
+}
+
+val_t machine_cc(struct machine *m)
+{
+	return getcc(m);
+}
+
+void machine_set_cc(struct machine *m, val_t cc)
+{
+	setcc(m, cc & ((1 << F_OF) | (1 << F_SF) | (1 << F_ZF)));
+	machine_record(m, m->ckpt_interval, m->max_ckpts);
+}
+
+/**
+ * machine_set_devices(m, out, in)
+ *
+ * attach the devices to the memory of @m: DEV_PUTC and DEV_PUTD write
+ * to @out, DEV_GETC reads from @in, and either may be NULL.  Both stay
+ * the caller's, to flush and close.  Return -1 with EBUSY if @m records
+ * its history or has memory in the device page.  Devices are not part
+ * of snapshots, and forks have none.
+ */
+int machine_set_devices(struct machine *m, FILE *out, FILE *in)
+{
+	if (m->ckpt_interval != 0 || page_find(m, DEV_BASE) != NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+	m->mem->dev_out = out;
+	m->mem->dev_in = in;
+	m->mem->devices = 1;
+	return 0;
+}
+
+/* whether [addr, addr + len) wraps around the address space */
+static int mem_wraps(val_t addr, size_t len)
+{
+	return (unsigned long long)addr + len > 1ULL << 32;
+}
+
+/**
+ * machine_read(m, addr, buf, len)
+ *
+ * copy @len bytes of guest memory at @addr to @buf,
+ * return -1 if the range wraps around the address space.
+ */
+int machine_read(struct machine *m, val_t addr, void *buf, size_t len)
+{
+	struct page *p;
+	byte *dst = buf;
+	size_t n;
+
+	if (mem_wraps(addr, len))
+		return -1;
+	for (; len > 0; addr += n, dst += n, len -= n) {
+		n = PAGE_SIZE - (addr & PAGE_MASK);
+		if (n > len)
+			n = len;
+		if ((p = page_find(m, addr)) == NULL)
+			memset(dst, 0, n);
+		else
+			memcpy(dst, &p->data->bytes[addr & PAGE_MASK], n);
+	}
+	return 0;
+}
+
+/**
+ * machine_write(m, addr, buf, len)
+ *
+ * store @len bytes from @buf to guest memory at @addr like the guest
+ * would, return -1 if the range wraps around the address space or
+ * touches the devices, or if out of memory.
+ */
+int machine_write(struct machine *m, val_t addr, const void *buf, size_t len)
+{
+	int ret;
+
+	if (mem_wraps(addr, len) || is_device(m, addr, len))
+		return -1;
+	ret = mem_write(m, addr, buf, len);
+	machine_record(m, m->ckpt_interval, m->max_ckpts);
+	return ret;
+}
+
+/* order dirty pages by address for machine_changes() */
+static int page_cmp(const void *a, const void *b)
+{
+	val_t x = (*(struct page *const *)a)->base;
+	val_t y = (*(struct page *const *)b)->base;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * machine_changes(m, fn, arg)
+ *
+ * call @fn(@arg, addr, orig, now) for every word of memory that
+ * differs from the loaded image, in ascending order, or for none if
+ * out of memory.
+ */
+void machine_changes(struct machine *m,
+		     void (*fn)(void *arg, val_t addr, val_t orig, val_t now),
+		     void *arg)
+{
+	struct page **pages, *p;
+	size_t n = 0;
+
+	if ((pages = malloc((m->mem->nr_dirty + 1) * sizeof(*pages))) == NULL)
+		return;
+	list_for_each_entry(p, &m->mem->dirty, dirty)
+		pages[n++] = p;
+	qsort(pages, m->mem->nr_dirty, sizeof(*pages), page_cmp);
+	for (n = 0; n < m->mem->nr_dirty; n++) {
+		p = pages[n];
+		for (val_t i = 0; i < PAGE_SIZE; i += sizeof(val_t)) {
+			val_t now = *(val_t *)&p->data->bytes[i];
+			val_t orig = *(val_t *)&p->orig->bytes[i];
+
+			if (now != orig)
+				fn(arg, p->base + i, orig, now);
+		}
+	}
+	free(pages);
+}
+
+const char *stat_name(enum stat stat)
+{
+	return stat >= S_AOK && stat <= S_INS ? stat_names[stat] : NULL;
+}
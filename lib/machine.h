@@ -0,0 +1,245 @@
+#ifndef _MACHINE_
+#define _MACHINE_
+
+#include "Y86.h"
+#include <stddef.h>
+#include <stdio.h>
+
+enum stat {
+	S_AOK = 1,
+	S_HLT = 2,
+	S_ADR = 3,
+	S_INS = 4,
+};
+
+enum flag {
+	F_OF = 0,
+	F_SF = 1,
+	F_ZF = 2,
+};
+
+#define setCC(cc, o, s, z)			\
+	do {					\
+		cc = ((((o) != 0) << F_OF)	\
+		    | (((s) != 0) << F_SF)	\
+		    | (((z) != 0) << F_ZF));	\
+	} while (0)
+
+#define getCC(cc, o, s, z)			\
+	do {					\
+		o = ((cc >> F_OF) & 1);		\
+		s = ((cc >> F_SF) & 1);		\
+		z = ((cc >> F_ZF) & 1);		\
+	} while (0)
+
+/* run until the machine stops */
+#define MACHINE_FOREVER (~0ULL)
+
+/*
+ * A Y86 machine.  Machines share nothing but the memory of the cores of
+ * an smp, so different machines may be used from different threads at
+ * the same time.
+ */
+struct machine;
+
+extern struct machine *machine_create(const byte *image, size_t len);
+extern void machine_destroy(struct machine *m);
+
+extern const char *machine_engine_name(unsigned int i);
+extern int machine_set_engine(struct machine *m, const char *name);
+
+extern enum stat machine_run(struct machine *m, unsigned long long steps);
+
+extern enum stat machine_stat(const struct machine *m);
+extern unsigned long long machine_steps(const struct machine *m);
+
+extern val_t machine_pc(const struct machine *m);
+extern void machine_set_pc(struct machine *m, val_t pc);
+extern val_t machine_reg(const struct machine *m, regid_t reg);
+extern void machine_set_reg(struct machine *m, regid_t reg, val_t val);
+extern val_t machine_cc(struct machine *m);
+extern void machine_set_cc(struct machine *m, val_t cc);
+
+extern int machine_read(struct machine *m, val_t addr, void *buf, size_t len);
+extern int machine_write(struct machine *m, val_t addr,
+			 const void *buf, size_t len);
+extern void machine_changes(struct machine *m,
+			    void (*fn)(void *arg, val_t addr,
+				       val_t orig, val_t now),
+			    void *arg);
+
+/*
+ * Memory-mapped devices.  Once attached, the last page of the address
+ * space holds device registers instead of memory, shared by the cores
+ * of an smp.  They are accessed by aligned words, anything else raises
+ * ADR, as does running code there or xchgl on them.  Other words of
+ * the page read as 0 and ignore stores.
+ */
+#define DEV_BASE	0xfffff000U
+#define DEV_PUTC	(DEV_BASE + 0x00)	/* store: write the low byte */
+#define DEV_PUTD	(DEV_BASE + 0x04)	/* store: write the word in decimal */
+#define DEV_GETC	(DEV_BASE + 0x08)	/* load: next input byte, -1 at end */
+#define DEV_CYCLES	(DEV_BASE + 0x10)	/* load: steps so far, low word */
+#define DEV_CYCLES_HI	(DEV_BASE + 0x14)	/* load: high word */
+
+extern int machine_set_devices(struct machine *m, FILE *out, FILE *in);
+
+/*
+ * Cycle counts of the pipe engine, which times the run on the PIPE
+ * design of CS:APP.  Bubbles are counted by cause and by the ins byte
+ * of the instruction that caused them.
+ */
+enum pipe_cause {
+	PIPE_LOAD_USE,		/* value loaded by the previous instruction */
+	PIPE_MISPREDICT,	/* jXX mispredicted */
+	PIPE_RET,		/* waiting for the return address */
+	PIPE_CACHE,		/* cache misses, see below */
+	NR_PIPE_CAUSES
+};
+
+struct pipe_stats {
+	unsigned long long cycles;	/* instructions + bubbles */
+	unsigned long long insns;
+	unsigned long long count[256];	/* instructions by ins byte */
+	unsigned long long bubbles[256][NR_PIPE_CAUSES];
+};
+
+extern const struct pipe_stats *machine_pipe_stats(const struct machine *m);
+
+/*
+ * Cache models.  Caches only see the runs of the seq and pipe engines;
+ * other engines run as seq while a machine has any.
+ */
+enum cache_id {
+	CACHE_I,		/* instruction fetches */
+	CACHE_D,		/* data accesses */
+	CACHE_L2,		/* misses of both */
+	NR_CACHES
+};
+
+enum cache_policy {
+	CACHE_LRU,
+	CACHE_FIFO,
+	CACHE_RANDOM,
+};
+
+enum cache_access {
+	CACHE_FETCH,
+	CACHE_READ,
+	CACHE_WRITE,
+	NR_CACHE_ACCESSES
+};
+
+struct cache_config {
+	unsigned int size;		/* bytes, power of 2 */
+	unsigned int assoc;		/* ways, power of 2 */
+	unsigned int block;		/* bytes, power of 2 */
+	enum cache_policy policy;
+	int write_through;		/* else write-back, write-allocate */
+	unsigned int hit_time;		/* cycles of an access */
+	unsigned int miss_time;		/* more cycles if memory is reached */
+};
+
+struct cache_stats {
+	unsigned long long hits[NR_CACHE_ACCESSES];
+	unsigned long long misses[NR_CACHE_ACCESSES];
+	unsigned long long writebacks;
+	unsigned long long cycles;	/* of the accesses, levels below included */
+};
+
+extern int machine_set_cache(struct machine *m, enum cache_id id,
+			     const struct cache_config *cfg);
+extern const struct cache_stats *machine_cache_stats(const struct machine *m,
+						     enum cache_id id);
+
+/*
+ * Branch predictor models, which also decide what the pipe engine
+ * predicts.  Like caches, they only see seq and pipe.
+ */
+enum predictor_kind {
+	PREDICT_TAKEN,		/* always taken */
+	PREDICT_BTFNT,		/* backward taken, forward not taken */
+	PREDICT_BIMODAL,	/* 2-bit counters indexed by pc */
+	PREDICT_GSHARE,		/* 2-bit counters indexed by pc ^ history */
+};
+
+struct predictor_config {
+	enum predictor_kind kind;
+	unsigned int bits;		/* log2 of counters, bits of history */
+	unsigned int ras_depth;		/* return address stack, 0: none */
+};
+
+struct predictor_stats {
+	unsigned long long branches, branch_misses;	/* conditional jXX */
+	unsigned long long returns, return_misses;
+};
+
+extern int machine_set_predictor(struct machine *m,
+				 const struct predictor_config *cfg);
+extern const struct predictor_stats *
+machine_predictor_stats(const struct machine *m);
+extern void machine_predictor_sites(struct machine *m,
+				    void (*fn)(void *arg, val_t pc, int is_ret,
+					       unsigned long long count,
+					       unsigned long long misses),
+				    void *arg);
+
+/*
+ * Profile of the instructions executed, per pc and per chain of calls.
+ * Like caches, profiles only see seq and pipe.
+ */
+extern int machine_set_profile(struct machine *m, int on);
+extern void machine_profile_pcs(struct machine *m,
+				void (*fn)(void *arg, val_t pc,
+					   unsigned long long count,
+					   int leader),
+				void *arg);
+extern void machine_profile_stacks(struct machine *m,
+				   void (*fn)(void *arg, const val_t *stack,
+					      unsigned int depth,
+					      unsigned long long count),
+				   void *arg);
+
+/*
+ * A snapshot of the state of a machine.  Taking one is cheap: pages
+ * are shared copy-on-write with the machine until either side writes.
+ */
+struct snapshot;
+
+extern struct snapshot *machine_snapshot(struct machine *m);
+extern void machine_restore(struct machine *m, const struct snapshot *s);
+extern struct machine *machine_fork(struct machine *m);
+extern void snapshot_free(struct snapshot *s);
+extern int snapshot_save(const struct snapshot *s, FILE *out);
+extern struct snapshot *snapshot_load(FILE *in);
+
+/*
+ * Reverse execution: while recording, a machine can be brought back
+ * to any earlier step of its history.
+ */
+extern int machine_record(struct machine *m, unsigned long long interval,
+			  unsigned int depth);
+extern unsigned long long machine_history(const struct machine *m);
+extern int machine_reverse(struct machine *m, unsigned long long step);
+extern int machine_reverse_write(struct machine *m, val_t addr, size_t len);
+
+/*
+ * Multi-core machines: cores sharing one memory, each a machine of its
+ * own without snapshots or history.  See lib/machine.c for the memory
+ * model.
+ */
+struct smp;
+
+#define SMP_THREADS 0	/* quantum of smp_run(): a host thread per core */
+
+extern struct smp *smp_create(const byte *image, size_t len,
+			      unsigned int nr_cores);
+extern void smp_destroy(struct smp *s);
+extern unsigned int smp_nr_cores(const struct smp *s);
+extern struct machine *smp_core(struct smp *s, unsigned int i);
+extern enum stat smp_run(struct smp *s, unsigned long long steps,
+			 unsigned long long quantum);
+
+extern const char *stat_name(enum stat stat);
+
+#endif
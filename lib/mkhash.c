@@ -0,0 +1,74 @@
+/*
+ * mkhash: print the perfect hash tables of the mnemonics and register
+ * names of Y86.def for lib/Y86.c.  A seed of str_hash() is searched
+ * for each table so that no two names share a slot; a lookup then
+ * hashes once and compares one string.
+ */
+#include "Y86.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const ins_names[] = {
+#define INS(name, icode, ifun) name,
+#include "Y86.def"
+};
+
+static const char *const regid_names[] = {
+#define REG(name, regid) name,
+#include "Y86.def"
+};
+
+#define NR(a) (sizeof(a) / sizeof((a)[0]))
+
+/**
+ * print_table(prefix, names, n)
+ *
+ * print a table of the smallest power of 2 at least twice @n slots
+ * with the index of @names[i] at slot str_hash(@names[i], seed), -1 in
+ * the others, and the seed that makes it perfect.
+ */
+static void print_table(const char *prefix, const char *const *names,
+			unsigned int n)
+{
+	unsigned int size, seed, i, slot;
+	signed char *table;
+
+	for (size = 1; size < 2 * n; size *= 2)
+		;
+	table = malloc(size);
+	for (seed = 1; seed != 0; seed++) {
+		for (i = 0; i < size; i++)
+			table[i] = -1;
+		for (i = 0; i < n; i++) {
+			slot = str_hash(names[i], strlen(names[i]), seed)
+			       & (size - 1);
+			if (table[slot] >= 0)
+				break;
+			table[slot] = i;
+		}
+		if (i == n)
+			break;
+	}
+	if (seed == 0) {
+		fprintf(stderr, "mkhash: no perfect hash for %s\n", prefix);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("#define %s_HASH_SEED 0x%xU\n", prefix, seed);
+	printf("#define %s_HASH_SIZE %u\n\n", prefix, size);
+	printf("static const signed char %s_HASH[%s_HASH_SIZE] = {",
+	       prefix, prefix);
+	for (i = 0; i < size; i++)
+		printf("%s%d,", i % 16 ? " " : "\n\t", table[i]);
+	printf("\n};\n\n");
+	free(table);
+}
+
+int main(void)
+{
+	printf("/* generated by mkhash from Y86.def, do not edit */\n\n");
+	print_table("Y86_INS", ins_names, NR(ins_names));
+	print_table("Y86_REGID", regid_names, NR(regid_names));
+	exit(EXIT_SUCCESS);
+}
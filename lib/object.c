@@ -0,0 +1,151 @@
+#include "object.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Object files are in little endian, fields 32 bits wide:
+ *
+ *	"Y86OBJ01", nr_sections, nr_symbols, nr_relocs
+ *
+ * then for each section its addr, align, size, end and size bytes of data,
+ * for each symbol its section, value, the length of its name and the
+ * name, and for each relocation its section, offset and symbol.
+ */
+static void put32(FILE *out, val_t x)
+{
+	for (int i = 0; i < 4; i++)
+		fputc(x >> (8 * i), out);
+}
+
+static int get32(FILE *in, val_t *x)
+{
+	byte b[4];
+
+	if (fread(b, 1, sizeof(b), in) != sizeof(b))
+		return -1;
+	*x = b[0] | b[1] << 8 | b[2] << 16 | (val_t)b[3] << 24;
+	return 0;
+}
+
+/**
+ * object_save(obj, out)
+ *
+ * write object @obj to @out, return 0 on success, or -1 with errno set.
+ */
+int object_save(const struct object *obj, FILE *out)
+{
+	const struct obj_section *sec;
+	const struct obj_symbol *sym;
+	const struct obj_reloc *rel;
+
+	fwrite(OBJ_MAGIC, 1, 8, out);
+	put32(out, obj->nr_sections);
+	put32(out, obj->nr_symbols);
+	put32(out, obj->nr_relocs);
+	for (sec = obj->sections; sec < obj->sections + obj->nr_sections;
+	     sec++) {
+		put32(out, sec->addr);
+		put32(out, sec->align);
+		put32(out, sec->size);
+		put32(out, sec->end);
+		fwrite(sec->data, 1, sec->size, out);
+	}
+	for (sym = obj->symbols; sym < obj->symbols + obj->nr_symbols; sym++) {
+		put32(out, sym->section);
+		put32(out, sym->value);
+		put32(out, strlen(sym->name));
+		fputs(sym->name, out);
+	}
+	for (rel = obj->relocs; rel < obj->relocs + obj->nr_relocs; rel++) {
+		put32(out, rel->section);
+		put32(out, rel->offset);
+		put32(out, rel->symbol);
+	}
+	return ferror(out) ? -1 : 0;
+}
+
+/**
+ * object_load(in)
+ *
+ * read an object written by object_save() from @in,
+ * return NULL with errno set on failure (EINVAL: not an object).
+ */
+struct object *object_load(FILE *in)
+{
+	struct object *obj;
+	struct obj_section *sec;
+	struct obj_symbol *sym;
+	struct obj_reloc *rel;
+	char magic[8];
+	val_t len;
+
+	if (fread(magic, 1, 8, in) != 8 || memcmp(magic, OBJ_MAGIC, 8) != 0)
+		goto bad;
+	if ((obj = calloc(1, sizeof(*obj))) == NULL)
+		return NULL;
+	if (get32(in, &obj->nr_sections) || get32(in, &obj->nr_symbols)
+	    || get32(in, &obj->nr_relocs))
+		goto bad_object;
+	obj->sections = calloc(obj->nr_sections, sizeof(*obj->sections));
+	obj->symbols = calloc(obj->nr_symbols, sizeof(*obj->symbols));
+	obj->relocs = calloc(obj->nr_relocs, sizeof(*obj->relocs));
+	if ((obj->nr_sections && obj->sections == NULL)
+	    || (obj->nr_symbols && obj->symbols == NULL)
+	    || (obj->nr_relocs && obj->relocs == NULL))
+		goto bad_object;
+
+	for (sec = obj->sections; sec < obj->sections + obj->nr_sections;
+	     sec++) {
+		if (get32(in, &sec->addr) || get32(in, &sec->align)
+		    || get32(in, &sec->size) || get32(in, &sec->end)
+		    || (sec->align == 0 && sec->addr + sec->size < sec->addr))
+			goto bad_object;
+		if ((sec->data = malloc((size_t)sec->size + 1)) == NULL
+		    || fread(sec->data, 1, sec->size, in) != sec->size)
+			goto bad_object;
+	}
+	for (sym = obj->symbols; sym < obj->symbols + obj->nr_symbols; sym++) {
+		if (get32(in, &sym->section) || get32(in, &sym->value)
+		    || get32(in, &len)
+		    || (sym->section >= obj->nr_sections
+			&& sym->section != OBJ_UNDEF))
+			goto bad_object;
+		if ((sym->name = malloc((size_t)len + 1)) == NULL
+		    || fread(sym->name, 1, len, in) != len)
+			goto bad_object;
+		sym->name[len] = '\0';
+	}
+	for (rel = obj->relocs; rel < obj->relocs + obj->nr_relocs; rel++)
+		if (get32(in, &rel->section) || get32(in, &rel->offset)
+		    || get32(in, &rel->symbol)
+		    || rel->section >= obj->nr_sections
+		    || rel->symbol >= obj->nr_symbols
+		    || obj->sections[rel->section].size < sizeof(val_t)
+		    || rel->offset > obj->sections[rel->section].size
+				     - sizeof(val_t))
+			goto bad_object;
+	return obj;
+
+bad_object:
+	object_free(obj);
+bad:
+	errno = EINVAL;
+	return NULL;
+}
+
+void object_free(struct object *obj)
+{
+	val_t i;
+
+	if (obj->sections != NULL)
+		for (i = 0; i < obj->nr_sections; i++)
+			free(obj->sections[i].data);
+	if (obj->symbols != NULL)
+		for (i = 0; i < obj->nr_symbols; i++)
+			free(obj->symbols[i].name);
+	free(obj->sections);
+	free(obj->symbols);
+	free(obj->relocs);
+	free(obj);
+}
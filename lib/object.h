@@ -0,0 +1,56 @@
+#ifndef _OBJECT_
+#define _OBJECT_
+
+#include "Y86.h"
+#include <stdio.h>
+
+/*
+ * A relocatable object, written by Y86asm -c and linked by Y86ld.
+ *
+ * An object is a list of sections.  The first one holds the start of
+ * the source and goes where the previous object ended, then every
+ * .pos starts an absolute section, and every .align before the first
+ * .pos a section that goes where the previous one ended, aligned.
+ * Linking objects is then the same as assembling their sources one
+ * after the other, as long as no two sections share a byte: the
+ * linker refuses them.
+ *
+ * The values of symbols are offsets in the section that defines them.
+ * Every use of a symbol is a relocation: the linker stores the address
+ * of the symbol in the 32 bits at @offset of the section.
+ */
+#define OBJ_MAGIC "Y86OBJ01"		/* starts a file, with the version */
+#define OBJ_UNDEF ((val_t)-1)		/* section of an imported symbol */
+
+struct obj_section {
+	val_t addr;		/* if absolute */
+	val_t align;		/* 0 if absolute */
+	val_t size;		/* of data */
+	val_t end;		/* offset where the next section goes on */
+	byte *data;
+};
+
+struct obj_symbol {
+	char *name;
+	val_t section;		/* or OBJ_UNDEF */
+	val_t value;
+};
+
+struct obj_reloc {
+	val_t section;
+	val_t offset;		/* in the section */
+	val_t symbol;
+};
+
+struct object {
+	struct obj_section *sections;
+	struct obj_symbol *symbols;
+	struct obj_reloc *relocs;
+	val_t nr_sections, nr_symbols, nr_relocs;
+};
+
+extern int object_save(const struct object *obj, FILE *out);
+extern struct object *object_load(FILE *in);
+extern void object_free(struct object *obj);
+
+#endif
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Run the given Y86 sources on every engine of Y86sim and check that
+# they all stop in the state seq stops in, along with images that need
+# to be written by hand.  Run from the top directory after make.
+#
+engines="pipe threaded block jit"
+limit=1000000		# for programs that never halt
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+status=0
+
+# irmovl $5,%none; rrmovl %none,%eax; halt: %none is no register
+printf '\060\377\005\000\000\000\040\360\000' > "$tmp/none.yo"
+
+for src in "$@"; do
+	./Y86asm "$src" "$tmp/$(basename "$src" .ys).yo" || exit 1
+done
+
+# the final state, without what pipe prints after it
+state()
+{
+	./Y86sim -e $1 -n $limit "$2" | sed -e '/^PIPE:/,$d' -e '/^$/d'
+}
+
+for image in "$tmp"/*.yo; do
+	state seq "$image" > "$tmp/seq"
+	for e in $engines; do
+		state $e "$image" > "$tmp/$e"
+		if ! cmp -s "$tmp/seq" "$tmp/$e"; then
+			echo "$(basename "$image"): $e differs from seq"
+			diff "$tmp/seq" "$tmp/$e" | head -20
+			status=1
+		fi
+	done
+done
+exit $status